@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <irc_utils.h>
+#include <out_queue.h>
+#include <payload.h>
+#include <name_table.h>
+
+#define TRIAL_TIME 20000000L	/* ns each trial should last, roughly 		*/
+#define MIN_CALIBRATION 10000000L	/* ns a run must last to size the trials */
+#define DEFAULT_TRIALS 15
+#define DEFAULT_THRESHOLD 25	/* % slower than the baseline that fails 	*/
+
+#define TABLE_NAMES 1024		/* Names in the lookup tables, a power of 2 */
+#define PARSE_CHUNK_FRAMES 16	/* Frames fed to the reader at once 		*/
+#define SEND_DRAIN_EVERY 32		/* socket_send calls between draining reads */
+#define MAX_SINKS 1000
+
+#define SAMPLE_MSG "<bench_user> the quick brown fox jumps over the lazy dog, twice."
+#define SAMPLE_NAME "bench_user_42"
+#define SAMPLE_CHANNEL "#performance-engineering"
+
+
+typedef void (*BenchFunction)(long iterations);
+
+
+/*
+	A microbenchmark runs its operation the given
+	number of times, keeping any setup out of the loop.
+	Results are reported in nanoseconds per operation.
+*/
+typedef struct benchmark{
+	const char *name;
+	BenchFunction run;
+} Benchmark;
+
+
+typedef struct bench_config{
+	const char *baseline;	/* NULL to skip the comparison */
+	int threshold;			/* % */
+	int trials;
+	const char *filter;		/* Only benchmarks whose name contains it */
+} BenchConfig;
+
+BenchConfig config = { NULL, DEFAULT_THRESHOLD, DEFAULT_TRIALS, NULL };
+
+
+/* Results go here, so the work can't be optimized away */
+volatile long sink = 0;
+
+char nicknames[TABLE_NAMES][MAX_NAME_LEN + 1];
+char channel_names[TABLE_NAMES][MAX_CHANNEL_LEN];
+NameTable *nickname_table = NULL, *channel_table = NULL;
+
+char parse_chunk[PARSE_CHUNK_FRAMES*(FRAME_HEADER_LEN + sizeof(SAMPLE_MSG))];
+int parse_chunk_len = 0;
+
+OutQueue sinks[MAX_SINKS];
+int pair[2] = { -1, -1 };
+
+
+long now_ns(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long)now.tv_sec*1000000000L + now.tv_nsec;
+}
+
+
+void bench_frame_encode(long iterations){
+	char frame[MAX_FRAME_LEN];
+	int len = strlen(SAMPLE_MSG);
+
+	long i;
+	for (i = 0; i < iterations; i++)
+		sink += frame_encode(frame, SAMPLE_MSG, len);
+}
+
+
+/* One operation takes a frame out of the reader, refilling it a chunk at a time */
+void bench_frame_parse(long iterations){
+	FrameReader reader;
+	char msg[WHOLE_MSG_LEN + 1];
+	frame_reader_init(&reader);
+
+	long i;
+	for (i = 0; i < iterations; i++){
+		int len = frame_reader_next(&reader, msg, sizeof(msg));
+		if (len == FRAME_INCOMPLETE){
+			frame_reader_feed(&reader, parse_chunk, parse_chunk_len);
+			len = frame_reader_next(&reader, msg, sizeof(msg));
+		}
+		sink += len;
+	}
+}
+
+
+void bench_parse_name(long iterations){
+	char name[MAX_NAME_LEN + 1];
+
+	long i;
+	for (i = 0; i < iterations; i++)
+		sink += parse_name(SAMPLE_NAME, name);
+}
+
+
+void bench_invalid_channel_name(long iterations){
+	char channel_name[MAX_CHANNEL_LEN] = SAMPLE_CHANNEL;
+
+	long i;
+	for (i = 0; i < iterations; i++)
+		sink += invalid_channel_name(channel_name);
+}
+
+
+void bench_nickname_lookup(long iterations){
+	long i;
+	for (i = 0; i < iterations; i++)
+		sink += name_table_get(nickname_table, nicknames[i & (TABLE_NAMES - 1)]) != NULL;
+}
+
+
+/* As when checking that a new nickname is unique */
+void bench_nickname_lookup_miss(long iterations){
+	long i;
+	for (i = 0; i < iterations; i++)
+		sink += name_table_get(nickname_table, SAMPLE_NAME) != NULL;
+}
+
+
+void bench_channel_lookup(long iterations){
+	long i;
+	for (i = 0; i < iterations; i++)
+		sink += name_table_get(channel_table, channel_names[i & (TABLE_NAMES - 1)]) != NULL;
+}
+
+
+/*
+	One operation formats a message once, queues it
+	for every sink, and then has each sink gather and
+	consume it, as a shard writing to its clients does.
+*/
+void fanout(long iterations, int n_sinks){
+	struct iovec iov[OUT_QUEUE_MAX_IOV];
+
+	long i;
+	int j, k;
+	for (i = 0; i < iterations; i++){
+		Payload *payload = payload_create("%s: %s", SAMPLE_NAME, SAMPLE_MSG);
+
+		for (j = 0; j < n_sinks; j++)
+			out_queue_push(sinks + j, payload);
+		payload_unref(payload);
+
+		for (j = 0; j < n_sinks; j++){
+			int n_iov = out_queue_gather(sinks + j, iov, OUT_QUEUE_MAX_IOV), bytes = 0;
+			for (k = 0; k < n_iov; k++)
+				bytes += iov[k].iov_len;
+
+			out_queue_consume(sinks + j, bytes);
+			sink += bytes;
+		}
+	}
+}
+
+
+void bench_fanout_10(long iterations){
+	fanout(iterations, 10);
+}
+
+
+void bench_fanout_100(long iterations){
+	fanout(iterations, 100);
+}
+
+
+void bench_fanout_1000(long iterations){
+	fanout(iterations, 1000);
+}
+
+
+/* Sends over a socketpair, reading every few frames so it never fills up */
+void bench_socket_send(long iterations){
+	Socket socket = { pair[0], 0 };
+	char buffer[SEND_DRAIN_EVERY*MAX_FRAME_LEN];
+
+	long i;
+	for (i = 0; i < iterations; i++){
+		sink += socket_send(&socket, SAMPLE_MSG, MAX_MSG_LEN);
+
+		if ((i + 1) % SEND_DRAIN_EVERY == 0)
+			while (recv(pair[1], buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+	}
+
+	while (recv(pair[1], buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+}
+
+
+Benchmark BENCHMARKS[] = {
+	{ "frame_encode", bench_frame_encode },
+	{ "frame_parse", bench_frame_parse },
+	{ "parse_name", bench_parse_name },
+	{ "invalid_channel_name", bench_invalid_channel_name },
+	{ "nickname_lookup", bench_nickname_lookup },
+	{ "nickname_lookup_miss", bench_nickname_lookup_miss },
+	{ "channel_lookup", bench_channel_lookup },
+	{ "fanout_10", bench_fanout_10 },
+	{ "fanout_100", bench_fanout_100 },
+	{ "fanout_1000", bench_fanout_1000 },
+	{ "socket_send", bench_socket_send }
+};
+
+#define N_BENCHMARKS ((int)(sizeof(BENCHMARKS)/sizeof(BENCHMARKS[0])))
+
+
+void setup(void){
+
+	int i, len;
+	nickname_table = name_table_create(TABLE_NAMES);
+	channel_table = name_table_create(TABLE_NAMES);
+
+	for (i = 0; i < TABLE_NAMES; i++){
+		sprintf(nicknames[i], "user_%04d", i);
+		sprintf(channel_names[i], "#channel-number-%04d", i);
+		name_table_put(nickname_table, nicknames[i], nicknames[i]);
+		name_table_put(channel_table, channel_names[i], channel_names[i]);
+	}
+
+	len = strlen(SAMPLE_MSG);
+	for (i = 0; i < PARSE_CHUNK_FRAMES; i++)
+		parse_chunk_len += frame_encode(parse_chunk + parse_chunk_len, SAMPLE_MSG, len);
+
+	for (i = 0; i < MAX_SINKS; i++)
+		out_queue_init(sinks + i, MAX_QUEUED_BYTES);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		exit_error("setup: Could not create socketpair");
+}
+
+
+/*
+	Doubles the iterations until a run is long enough
+	to time, sizes the trials from it, and returns
+	the fastest trial's nanoseconds per operation,
+	which is the least disturbed by the rest of the system.
+*/
+double measure(Benchmark *benchmark){
+
+	long iterations = 1, elapsed = 0, start;
+	while (1){
+		start = now_ns();
+		benchmark->run(iterations);
+		elapsed = now_ns() - start;
+
+		if (elapsed >= MIN_CALIBRATION) break;
+		iterations *= 2;
+	}
+
+	iterations = (long)((double)iterations*TRIAL_TIME/elapsed) + 1;
+
+	double best = -1;
+	int i;
+	for (i = 0; i < config.trials; i++){
+		start = now_ns();
+		benchmark->run(iterations);
+		double ns_per_op = (double)(now_ns() - start)/iterations;
+
+		if (best < 0 || ns_per_op < best) best = ns_per_op;
+	}
+
+	return best;
+}
+
+
+/*
+	Reads the whole file into a \0-terminated
+	buffer, which the caller must free.
+	Returns NULL if it can't be read.
+*/
+char *read_file(const char *path){
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return NULL;
+
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+
+	char *text = (char *)malloc(size + 1);
+	if (text == NULL || fread(text, 1, size, file) != size){
+		free(text);
+		fclose(file);
+		return NULL;
+	}
+
+	text[size] = '\0';
+	fclose(file);
+	return text;
+}
+
+
+/* Returns the result named name in a JSON report, or -1 if it has none */
+double baseline_result(const char *report, const char *name){
+	char key[128];
+	snprintf(key, sizeof(key), "\"%s\":", name);
+
+	const char *found = strstr(report, key);
+	if (found == NULL) return -1;
+
+	return strtod(found + strlen(key), NULL);
+}
+
+
+/*
+	Prints how each result compares with the
+	baseline's, to stderr. Returns the number of
+	benchmarks that got slower than the threshold allows.
+*/
+int compare(const char *report, Benchmark *benchmarks[], double results[], int n){
+
+	int i, regressions = 0;
+	fprintf(stderr, "%-24s %12s %12s %9s\n", "benchmark", "baseline", "ns/op", "change");
+
+	for (i = 0; i < n; i++){
+		double base = baseline_result(report, benchmarks[i]->name);
+		if (base <= 0){
+			fprintf(stderr, "%-24s %12s %12.1f %9s\n", benchmarks[i]->name, "-", results[i], "new");
+			continue;
+		}
+
+		double change = 100*(results[i] - base)/base;
+		int regressed = change > config.threshold;
+		regressions += regressed;
+
+		fprintf(stderr, "%-24s %12.1f %12.1f %+8.1f%%%s\n", benchmarks[i]->name, base, results[i],\
+				change, regressed ? "  REGRESSION" : "");
+	}
+
+	if (regressions > 0)
+		fprintf(stderr, "%d benchmark(s) more than %d%% slower than %s\n", regressions, config.threshold, config.baseline);
+
+	return regressions;
+}
+
+
+void usage(char *program){
+	printf("Usage: %s [-b baseline.json] [-t threshold_percent] [-n trials] [-f filter]\n", program);
+	printf("\tPrints the results as JSON. With -b, also compares them with a\n"\
+		   "\tprevious run's and fails if any got more than -t %% slower\n");
+	exit(EXIT_FAILURE);
+}
+
+
+void parse_args(int argc, char *argv[]){
+	int option;
+	while ((option = getopt(argc, argv, "b:t:n:f:")) != -1){
+		switch (option){
+			case 'b':
+			config.baseline = optarg;
+			break;
+
+			case 't':
+			config.threshold = atoi(optarg);
+			break;
+
+			case 'n':
+			config.trials = atoi(optarg);
+			break;
+
+			case 'f':
+			config.filter = optarg;
+			break;
+
+			default:
+			usage(argv[0]);
+		}
+	}
+
+	if (config.threshold <= 0 || config.trials <= 0)
+		usage(argv[0]);
+}
+
+
+int main(int argc, char *argv[]){
+
+	parse_args(argc, argv);
+
+	char *baseline = NULL;
+	if (config.baseline != NULL && (baseline = read_file(config.baseline)) == NULL)
+		exit_error("main: Could not read baseline");
+
+	setup();
+
+	Benchmark *selected[N_BENCHMARKS];
+	double results[N_BENCHMARKS];
+	int i, n = 0;
+
+	for (i = 0; i < N_BENCHMARKS; i++)
+		if (config.filter == NULL || strstr(BENCHMARKS[i].name, config.filter) != NULL)
+			selected[n++] = BENCHMARKS + i;
+
+	/* Same layout as the baseline, so that a run can become the next one */
+	printf("{\n\t\"unit\": \"ns/op\",\n\t\"results\": {\n");
+	for (i = 0; i < n; i++){
+		results[i] = measure(selected[i]);
+		printf("\t\t\"%s\": %.1f%s\n", selected[i]->name, results[i], i < n - 1 ? "," : "");
+		fflush(stdout);
+	}
+	printf("\t}\n}\n");
+
+	int regressions = 0;
+	if (baseline != NULL){
+		regressions = compare(baseline, selected, results, n);
+		free(baseline);
+	}
+
+	return regressions > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
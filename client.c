@@ -5,11 +5,17 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
+#include <fcntl.h>
 
 #include <pthread.h>
 #include <irc_utils.h>
+#include <metrics.h>
 #include <regex.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
 
 #define MAX_MSG_FACTOR 5
 #define BUFFER_LEN MAX_MSG_LEN*MAX_MSG_FACTOR + 16
@@ -23,10 +29,12 @@
 #define NICKNAME nickname[0] == ':' ? "not set" : nickname
 #define MATCH_IPV4_REGEX "^([0-9]{1,3}\\.){3}[0-9]{1,3}$"
 
-#define VALID_NAME_CHAR(c) (c != '<' && c != '>' && c != ':' && c != '@' && c != ' ' && c != '\n')
-
 #define IGNORE_SIGINT 0
 
+#define SLEEP_CMD "/sleep"		/* Scripted mode only: pauses the script for some ms */
+#define RESUME_CMD "/resume"	/* Sent instead of the nickname, to resume a session */
+#define MAX_TOKEN_LEN 64
+
 
 void help(){
 	printf("Available commands:\n  > /connect: connect to current server\n  > /server <IPv4> <port>: change connection settings\n  > /nickname <nickname>: change your nickname\n  > /quit: quit the application");
@@ -85,11 +93,8 @@ void *receive_messages(void *args){
 	int received_bytes;
 	while (strcmp(msg, QUIT_CMD)){
 
-		buffer[0] = '\0';
 		received_bytes = socket_receive(socket, buffer, WHOLE_MSG_LEN);
 
-		if (strlen(buffer) == 0) continue;	/* Possible transmission mistakes */
-
 		if (received_bytes <= 0){
 			console_log("receive_messages: Error receiving bytes!");
 			break;
@@ -107,6 +112,17 @@ void *receive_messages(void *args){
 }
 
 
+/*
+	Returns whether msg is the /quit command, read
+	the way the server does: the command is the text
+	up to the first blank, so "/quitter" is not it.
+*/
+int is_quit(const char *msg){
+	size_t len = strcspn(msg, " \t\n");
+	return len == sizeof(QUIT_CMD) - 1 && !strncmp(msg, QUIT_CMD, len);
+}
+
+
 /*
 	Sends a message to the server. If
 	the message size is greater than the
@@ -151,7 +167,7 @@ void *send_messages(void *args){
 	size_t max_msg_len = BUFFER_LEN;
 	ssize_t real_msg_len;
 
-	while (strncmp(msg, QUIT_CMD, 5) && status > 0){
+	while (!is_quit(msg) && status > 0){
 
 		real_msg_len = getline(&msg, &max_msg_len, stdin);
 
@@ -343,7 +359,287 @@ void *client_worker(){
 }
 
 
-int main(){
+/* Settings of the scripted mode, taken from the command line */
+typedef struct bot_config{
+	char server[17];
+	int port;
+	char nickname[MAX_NAME_LEN + 1];
+	char channel[MAX_CHANNEL_LEN];	/* Empty to join none */
+	const char *script;				/* NULL to read stdin */
+	char token[MAX_TOKEN_LEN + 1];	/* Of the session to resume, empty for a new one */
+	uint8_t keep;					/* Boolean: stay connected after the script ends */
+} BotConfig;
+
+
+/*
+	Lines of a script being read without blocking,
+	so that they can be waited on together with
+	the server's messages.
+*/
+typedef struct script{
+	int fd;
+	char buffer[BUFFER_LEN];
+	int len;
+	uint8_t eof;			/* Boolean */
+	uint64_t resume_at;		/* metrics_now() after which lines may run again */
+} Script;
+
+
+/* Prints text with tabs, newlines and backslashes escaped */
+void print_escaped(const char *text){
+	for (; *text != '\0'; text++){
+		if (*text == '\t') fputs("\\t", stdout);
+		else if (*text == '\n') fputs("\\n", stdout);
+		else if (*text == '\\') fputs("\\\\", stdout);
+		else putchar(*text);
+	}
+}
+
+
+/*
+	Prints an event of the scripted mode as one
+	tab-separated line: milliseconds since the epoch,
+	the kind of event, who it is from and its text.
+*/
+void print_event(const char *event, const char *sender, const char *text){
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	printf("%ld%03ld\t%s\t", (long)now.tv_sec, now.tv_nsec/1000000, event);
+	print_escaped(sender);
+	putchar('\t');
+	print_escaped(text);
+	putchar('\n');
+}
+
+
+/*
+	Takes the next whole line out of the script into
+	line, \0-terminated and without its \n. A line
+	that fills the whole buffer is taken as it is.
+
+	Returns 1 if there was a line and 0 otherwise.
+*/
+int script_next_line(Script *script, char line[BUFFER_LEN + 1]){
+	char *newline = (char *)memchr(script->buffer, '\n', script->len);
+	int line_len;
+
+	if (newline != NULL) line_len = newline - script->buffer;
+	else if (script->len == BUFFER_LEN || (script->eof && script->len > 0)) line_len = script->len;
+	else return 0;
+
+	memcpy(line, script->buffer, line_len);
+	line[line_len] = '\0';
+
+	int used = newline != NULL ? line_len + 1 : line_len;
+	memmove(script->buffer, script->buffer + used, script->len - used);
+	script->len -= used;
+
+	return 1;
+}
+
+
+/*
+	Runs a script line: /sleep pauses the script,
+	anything else is sent to the server as typed.
+	Returns 1 on success and -1 if the connection failed.
+*/
+int run_line(Script *script, Socket *socket, const char *line){
+
+	if (!strncmp(line, SLEEP_CMD " ", sizeof(SLEEP_CMD))){
+		script->resume_at = metrics_now() + 1000*(uint64_t)atol(line + sizeof(SLEEP_CMD));
+		return 1;
+	}
+
+	if (line[0] == '\0') return 1;	/* Blank lines are neither sent (there is nothing to frame) nor logged */
+
+	if (send_to_server(socket, line) < 0) return -1;
+	print_event("sent", "", line);
+
+	return 1;
+}
+
+
+void bot_usage(char *program){
+	printf("Usage: %s -n nickname|-t resume_token [-s server_ip] [-p port] [-c channel] [-i script] [-k]\n", program);
+	printf("\tSends each line of the script (stdin by default) to the server, where\n"\
+		   "\t/sleep <ms> pauses it, and prints what happens as tab-separated\n"\
+		   "\t<epoch ms> <event> <sender> <text> lines. Quits once the script ends,\n"\
+		   "\tunless -k is given. -t resumes a lost session instead of starting one.\n"\
+		   "\tWithout options, the client runs interactively.\n");
+	exit(EXIT_FAILURE);
+}
+
+
+void parse_bot_args(int argc, char *argv[], BotConfig *config){
+	int option;
+	while ((option = getopt(argc, argv, "s:p:n:c:i:t:k")) != -1){
+		switch (option){
+			case 's':
+			strncpy(config->server, optarg, sizeof(config->server) - 1);
+			break;
+
+			case 'p':
+			config->port = atoi(optarg);
+			break;
+
+			case 'n':
+			if (!parse_name(optarg, config->nickname)){
+				printf("Invalid nickname.\n");
+				bot_usage(argv[0]);
+			}
+			break;
+
+			case 'c':
+			if (strlen(optarg) >= MAX_CHANNEL_LEN || invalid_channel_name(optarg)){
+				printf("Invalid channel name.\n");
+				bot_usage(argv[0]);
+			}
+			strcpy(config->channel, optarg);
+			break;
+
+			case 'i':
+			config->script = optarg;
+			break;
+
+			case 't':
+			strncpy(config->token, optarg, MAX_TOKEN_LEN);
+			break;
+
+			case 'k':
+			config->keep = 1;
+			break;
+
+			default:
+			bot_usage(argv[0]);
+		}
+	}
+
+	if ((config->nickname[0] == '\0' && config->token[0] == '\0') || config->port <= 0 || optind < argc)
+		bot_usage(argv[0]);
+}
+
+
+/*
+	Scripted mode: a single thread waits on both the
+	server and the script, so many bots can share a host.
+	Returns the program's exit status.
+*/
+int run_bot(BotConfig *config){
+
+	/* Logs would garble the events, which report failures instead */
+	log_level = LOG_OFF;
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	Script *script = (Script *)calloc(1, sizeof(Script));
+	FrameReader *reader = (FrameReader *)malloc(sizeof(FrameReader));
+	if (script == NULL || reader == NULL)
+		exit_error("run_bot: Could not allocate buffers");
+
+	script->fd = config->script != NULL ? open(config->script, O_RDONLY) : STDIN_FILENO;
+	if (script->fd < 0)
+		exit_error("run_bot: Could not open script");
+
+	Socket *socket = socket_create();
+	if (socket_connect(socket, config->port, config->server) < 0){
+		print_event("error", "", "could not connect");
+		socket_free(socket);
+		return EXIT_FAILURE;
+	}
+
+	char line[BUFFER_LEN + 1];
+	char msg[WHOLE_MSG_LEN + 1];
+	char msg_sender[MAX_NAME_LEN + 1];
+	char msg_text[MAX_MSG_LEN + 1];
+
+	snprintf(line, sizeof(line), "%s:%d", config->server, config->port);
+	print_event("connected", config->nickname, line);
+
+	/* The handshake: a nickname, or the session to resume */
+	if (config->token[0] != '\0') snprintf(line, sizeof(line), RESUME_CMD " %s", config->token);
+	else strcpy(line, config->nickname);
+
+	int status = socket_send(socket, line, MAX_MSG_LEN);
+	if (status > 0 && config->channel[0] != '\0'){
+		snprintf(line, sizeof(line), "/join %s", config->channel);
+		status = run_line(script, socket, line);
+	}
+
+	frame_reader_init(reader);
+	uint8_t quitting = 0;	/* Boolean: /quit was sent, waiting for the server to close */
+
+	while (status > 0){
+		uint64_t now = metrics_now();
+
+		/* Runs every line that is due */
+		while (status > 0 && !quitting && now >= script->resume_at && script_next_line(script, line)){
+			status = run_line(script, socket, line);
+			if (is_quit(line)) quitting = 1;
+		}
+		if (status < 0) break;
+
+		if (!quitting && script->eof && script->len == 0 && now >= script->resume_at && !config->keep){
+			status = run_line(script, socket, QUIT_CMD);
+			quitting = 1;
+		}
+
+		struct pollfd fds[2] = { { socket->sockfd, POLLIN, 0 }, { script->fd, POLLIN, 0 } };
+		int sleeping = now < script->resume_at;
+		int wants_input = !quitting && !script->eof && !sleeping && script->len < BUFFER_LEN;
+
+		if (poll(fds, wants_input ? 2 : 1, sleeping ? (int)((script->resume_at - now)/1000) + 1 : -1) < 0){
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		if (wants_input && fds[1].revents != 0){
+			ssize_t read_bytes = read(script->fd, script->buffer + script->len, BUFFER_LEN - script->len);
+			if (read_bytes > 0) script->len += read_bytes;
+			else if (read_bytes == 0 || errno != EINTR) script->eof = 1;
+		}
+
+		if (fds[0].revents == 0) continue;
+
+		int received_bytes = frame_reader_fill(reader, socket);
+		if (received_bytes == 0 || (received_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			break;
+
+		int msg_len;
+		while ((msg_len = frame_reader_next(reader, msg, sizeof(msg))) >= 0){
+			parse_message(msg, msg_sender, msg_text);
+
+			if (!strcmp(msg_sender, "SERVER") && !strcmp(msg_text, QUIT_CMD)){
+				status = 0;
+				break;
+			}
+
+			print_event("recv", msg_sender, msg_text);
+		}
+
+		if (msg_len == FRAME_TOO_LONG){
+			print_event("error", "", "message too long");
+			break;
+		}
+	}
+
+	print_event("closed", config->nickname, status < 0 ? "connection failed" : "");
+
+	socket_free(socket);
+	if (script->fd != STDIN_FILENO) close(script->fd);
+	free(script);
+	free(reader);
+
+	return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+int main(int argc, char *argv[]){
+
+	if (argc > 1){
+		BotConfig config = { "127.0.0.1", SERVER_PORT, "", "", NULL, "", 0 };
+		parse_bot_args(argc, argv, &config);
+		return run_bot(&config);
+	}
 
 	/* Handle SIGINT */
 	struct sigaction signal;
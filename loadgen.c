@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include <irc_utils.h>
+#include <out_queue.h>
+#include <payload.h>
+#include <metrics.h>
+
+#define MAX_EVENTS 256
+#define TICK_MS 1				/* Longest wait for events between sends 	*/
+#define CONNECT_BATCH 64		/* Connections opened per tick while ramping */
+#define RAMP_TIMEOUT 30000000	/* µs to wait for every user to join 		*/
+#define DRAIN_TIME 2000000		/* µs to wait for deliveries after the run 	*/
+#define MAX_QUEUED_MSGS 64
+
+#define TIMESTAMP_TAG "LG "		/* Starts every timed message */
+
+
+/* How users are spread over channels */
+enum JOIN_PATTERNS {
+	SPREAD_JOIN,	/* Filling channels one after the other 	*/
+	RANDOM_JOIN,	/* Each to a random channel 				*/
+	SINGLE_JOIN		/* All to the same channel 					*/
+};
+
+
+/* How each user's messages are spaced out */
+enum SEND_PATTERNS {
+	STEADY_SEND,	/* Evenly, from a random phase 	*/
+	POISSON_SEND	/* At exponential intervals 	*/
+};
+
+
+enum LOAD_PHASES {
+	RAMPING, RUNNING, DRAINING
+};
+
+
+typedef struct load_config {
+	char server[17];
+	int port;
+	int users;
+	int channel_size;
+	int join_pattern;	/* JOIN_PATTERNS */
+	double rate;		/* Messages per second, per user */
+	int send_pattern;	/* SEND_PATTERNS */
+	int msg_len;		/* Bytes per message body */
+	int duration;		/* Seconds */
+} LoadConfig;
+
+LoadConfig config = { "127.0.0.1", SERVER_PORT, 100, 10, SPREAD_JOIN, 1.0, STEADY_SEND, 64, 10 };
+
+
+/* A simulated user: one connection, driven by the event loop */
+typedef struct user {
+	int index;
+	Socket *socket;		/* NULL until connecting, and again once lost */
+	uint8_t connecting;	/* Boolean: waiting for the connection to be made */
+	FrameReader reader;
+	OutQueue out;
+	char nickname[MAX_NAME_LEN + 1];
+	int channel;
+	uint8_t joined;		/* Boolean */
+	uint64_t next_send;
+} User;
+
+
+User *users;
+int *channel_members;	/* Joined users per channel */
+int n_channels;
+int epoll_fd;
+
+/* Everything measured, recorded through the metrics module */
+Metrics totals;
+uint64_t expected_deliveries = 0;
+int connected = 0, joined = 0, failed = 0, send_errors = 0;
+int pending = 0;		/* Connections being made */
+
+
+/* Uniform in [0, 1) */
+double random_fraction(){
+	return rand()/(RAND_MAX + 1.0);
+}
+
+
+/* Microseconds until the user's next message, per the send pattern */
+uint64_t send_interval(){
+	double interval = 1.0/config.rate;
+	if (config.send_pattern == POISSON_SEND)
+		interval = -log(1.0 - random_fraction())/config.rate;
+
+	return (uint64_t)(interval*1000000);
+}
+
+
+void user_disconnect(User *user){
+	if (user->socket == NULL) return;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, user->socket->sockfd, NULL);
+	socket_free(user->socket);
+	user->socket = NULL;
+	out_queue_clear(&(user->out));
+
+	/* It never got to connect */
+	if (user->connecting){
+		user->connecting = 0;
+		pending--;
+		failed++;
+		return;
+	}
+
+	connected--;
+	if (user->joined){
+		channel_members[user->channel]--;
+		joined--;
+	}
+	metrics_count(CONNECTIONS_LOST, 1);
+}
+
+
+/*
+	Writes out what the user's socket takes of its
+	queue. A failed write loses the user, and counts
+	as a send error.
+
+	Returns 1 on success and -1 if the user was lost.
+*/
+int user_flush(User *user){
+	if (out_queue_flush(&(user->out), user->socket) >= 0) return 1;
+
+	send_errors++;
+	user_disconnect(user);
+	return -1;
+}
+
+
+/*
+	Queues a message from the user, and writes out
+	what the socket takes (unless it is connecting).
+
+	Returns 1 if the message was queued, and 0 if it
+	was skipped or the user was lost.
+*/
+int user_send(User *user, Payload *payload){
+	if (out_queue_push(&(user->out), payload) < 0){
+		warn_log("user_send: %s is backed up, message skipped", user->nickname);
+		return 0;
+	}
+
+	if (user->connecting) return 1;
+	return user_flush(user) > 0;
+}
+
+
+/*
+	Starts connecting the user, without waiting for
+	it, and queues its nickname and the join to its
+	channel: they go out (in order) once connected.
+*/
+void user_connect(User *user){
+
+	Socket *socket = socket_create();
+	socket->address.sin_family = AF_INET;
+	socket->address.sin_addr.s_addr = inet_addr(config.server);
+	socket->address.sin_port = htons(config.port);
+
+	if (socket_set_nonblocking(socket) < 0 ||\
+		(connect(socket->sockfd, (struct sockaddr *)&(socket->address), sizeof(socket->address)) < 0 &&\
+		 errno != EINPROGRESS)){
+		socket_free(socket);
+		failed++;
+		return;
+	}
+
+	user->socket = socket;
+	user->connecting = 1;
+	pending++;
+	frame_reader_init(&(user->reader));
+	out_queue_init(&(user->out), MAX_QUEUED_MSGS*MAX_FRAME_LEN);
+
+	/* Writable once connected (or refused) */
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+	event.data.ptr = user;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket->sockfd, &event) < 0)
+		exit_error("user_connect: Could not watch socket");
+
+	Payload *nickname = payload_create("%s", user->nickname);
+	Payload *join = payload_create("/join lg_%d", user->channel);
+	user_send(user, nickname);
+	user_send(user, join);
+	payload_unref(nickname);
+	payload_unref(join);
+}
+
+
+/* Called once the user's connection is made, or fails */
+void user_finish_connect(User *user){
+
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(user->socket->sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0){
+		user_disconnect(user);
+		return;
+	}
+
+	user->connecting = 0;
+	pending--;
+	connected++;
+
+	/* From now on, writes are retried every tick */
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.ptr = user;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, user->socket->sockfd, &event) < 0)
+		exit_error("user_finish_connect: Could not watch socket");
+
+	user_flush(user);
+}
+
+
+/*
+	Handles a message the server relayed to the
+	user: timed ones record their latency, and
+	the user's own join marks it as ready.
+*/
+void user_receive(User *user, char *msg){
+
+	char *tag = strstr(msg, ") " TIMESTAMP_TAG);
+
+	if (tag != NULL){
+		uint64_t sent = strtoull(tag + 2 + strlen(TIMESTAMP_TAG), NULL, 10);
+		metrics_count(MESSAGES_IN, 1);
+		metrics_record(DELIVERY_LATENCY, metrics_now() - sent);
+		return;
+	}
+
+	if (!user->joined){
+		char join_msg[MAX_MSG_LEN];
+		sprintf(join_msg, "SERVER: %s joined channel lg_%d.", user->nickname, user->channel);
+
+		if (!strcmp(msg, join_msg)){
+			user->joined = 1;
+			channel_members[user->channel]++;
+			joined++;
+		}
+	}
+}
+
+
+/* Reads everything available on the user's socket */
+void user_read(User *user){
+
+	char msg[WHOLE_MSG_LEN + 1];
+	int received, msg_len;
+
+	while ((received = frame_reader_fill(&(user->reader), user->socket)) > 0){
+		metrics_count(BYTES_IN, received);
+
+		while ((msg_len = frame_reader_next(&(user->reader), msg, sizeof(msg))) >= 0)
+			user_receive(user, msg);
+
+		if (msg_len == FRAME_TOO_LONG){
+			user_disconnect(user);
+			return;
+		}
+	}
+
+	if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		user_disconnect(user);
+}
+
+
+/* Sends a timed message from the user to its channel */
+void user_chat(User *user, const char *padding, uint64_t now){
+
+	Payload *msg = payload_create(TIMESTAMP_TAG "%lu %s", (unsigned long)now, padding);
+	int sent = user_send(user, msg);
+	payload_unref(msg);
+
+	if (!sent) return;
+
+	metrics_count(MESSAGES_OUT, 1);
+	expected_deliveries += channel_members[user->channel];
+}
+
+
+/* Waits for events for up to a tick, and handles them */
+void poll_users(){
+	struct epoll_event events[MAX_EVENTS];
+	int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, TICK_MS);
+
+	int i;
+	for (i = 0; i < n_events; i++){
+		User *user = (User *)events[i].data.ptr;
+		if (user->socket != NULL && user->connecting) user_finish_connect(user);
+		if (user->socket != NULL && !user->connecting) user_read(user);
+	}
+}
+
+
+void report(uint64_t elapsed){
+
+	Histogram *latencies = totals.histograms + DELIVERY_LATENCY;
+	double seconds = elapsed/1000000.0;
+	uint64_t sent = totals.counters[MESSAGES_OUT], delivered = totals.counters[MESSAGES_IN];
+
+	printf("Users: %d connected, %d joined, %d failed to connect, %lu lost\n", connected, joined,\
+		   failed, (unsigned long)totals.counters[CONNECTIONS_LOST]);
+	printf("Sent: %lu messages in %.1f s (%.1f/s), %lu bytes, %lu send retries, %d send errors\n",\
+		   (unsigned long)sent, seconds, sent/seconds, (unsigned long)totals.counters[BYTES_OUT],\
+		   (unsigned long)totals.counters[SEND_RETRIES], send_errors);
+	printf("Delivered: %lu of %lu messages (%.1f/s), %lu bytes received\n", (unsigned long)delivered,\
+		   (unsigned long)expected_deliveries, delivered/seconds, (unsigned long)totals.counters[BYTES_IN]);
+	printf("Latency (us): p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",\
+		   (unsigned long)histogram_percentile(latencies, 0.5),\
+		   (unsigned long)histogram_percentile(latencies, 0.9),\
+		   (unsigned long)histogram_percentile(latencies, 0.99),\
+		   (unsigned long)histogram_percentile(latencies, 0.999),\
+		   (unsigned long)histogram_percentile(latencies, 1.0));
+}
+
+
+void usage(char *program){
+	printf("Usage: %s [-s server_ip] [-p port] [-u users] [-c channel_size] [-j spread|random|single]\n"\
+		   "\t[-r messages_per_second] [-P steady|poisson] [-l message_len] [-d seconds]\n", program);
+	printf("\tEach user sends -r messages per second to its channel for -d seconds\n");
+	exit(EXIT_FAILURE);
+}
+
+
+void parse_args(int argc, char *argv[]){
+	int option;
+	while ((option = getopt(argc, argv, "s:p:u:c:j:r:P:l:d:")) != -1){
+		switch (option){
+			case 's':
+			strncpy(config.server, optarg, sizeof(config.server) - 1);
+			break;
+
+			case 'p':
+			config.port = atoi(optarg);
+			break;
+
+			case 'u':
+			config.users = atoi(optarg);
+			break;
+
+			case 'c':
+			config.channel_size = atoi(optarg);
+			break;
+
+			case 'j':
+			if (!strcmp(optarg, "spread")) config.join_pattern = SPREAD_JOIN;
+			else if (!strcmp(optarg, "random")) config.join_pattern = RANDOM_JOIN;
+			else if (!strcmp(optarg, "single")) config.join_pattern = SINGLE_JOIN;
+			else usage(argv[0]);
+			break;
+
+			case 'r':
+			config.rate = atof(optarg);
+			break;
+
+			case 'P':
+			if (!strcmp(optarg, "steady")) config.send_pattern = STEADY_SEND;
+			else if (!strcmp(optarg, "poisson")) config.send_pattern = POISSON_SEND;
+			else usage(argv[0]);
+			break;
+
+			case 'l':
+			config.msg_len = atoi(optarg);
+			break;
+
+			case 'd':
+			config.duration = atoi(optarg);
+			break;
+
+			default:
+			usage(argv[0]);
+		}
+	}
+
+	if (config.users <= 0 || config.channel_size <= 0 || config.rate <= 0 || config.duration <= 0 ||\
+		config.msg_len < 0 || config.msg_len > MAX_MSG_LEN - 32)
+		usage(argv[0]);
+}
+
+
+int main(int argc, char *argv[]){
+
+	parse_args(argc, argv);
+
+	/* Thousands of connections would drown the report */
+	log_level = LOG_WARN;
+	metrics_attach(&totals);
+	srand(getpid());
+
+	n_channels = config.join_pattern == SINGLE_JOIN ? 1 : (config.users + config.channel_size - 1)/config.channel_size;
+	users = (User *)calloc(config.users, sizeof(User));
+	channel_members = (int *)calloc(n_channels, sizeof(int));
+	if (users == NULL || channel_members == NULL)
+		exit_error("main: Could not allocate users");
+
+	epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0)
+		exit_error("main: Could not create epoll instance");
+
+	int i;
+	for (i = 0; i < config.users; i++){
+		users[i].index = i;
+		sprintf(users[i].nickname, "lg%d_%d", getpid() % 100000, i);
+
+		switch (config.join_pattern){
+			case SPREAD_JOIN: users[i].channel = i/config.channel_size; break;
+			case RANDOM_JOIN: users[i].channel = rand() % n_channels; break;
+			case SINGLE_JOIN: users[i].channel = 0; break;
+		}
+	}
+
+	/* The padding that makes messages msg_len bytes long, timestamp included */
+	char padding[MAX_MSG_LEN];
+	int padding_len = config.msg_len - (int)strlen(TIMESTAMP_TAG) - 17;
+	if (padding_len < 0) padding_len = 0;
+	memset(padding, 'x', padding_len);
+	padding[padding_len] = '\0';
+
+	int phase = RAMPING, next_user = 0;
+	uint64_t now = metrics_now(), ramp_start = now, run_start = 0, progress = 0;
+
+	while (1){
+		poll_users();
+		now = metrics_now();
+
+		if (phase == RAMPING){
+			for (i = 0; i < CONNECT_BATCH && next_user < config.users; i++)
+				user_connect(users + next_user++);
+
+			if (next_user < config.users || ((pending > 0 || joined < connected) && now - ramp_start < RAMP_TIMEOUT))
+				continue;
+
+			printf("Ramped up in %.1f s: %d of %d users joined %d channels\n",\
+				   (now - ramp_start)/1000000.0, joined, config.users, n_channels);
+
+			/* Random phases keep users from sending in lockstep */
+			for (i = 0; i < config.users; i++)
+				users[i].next_send = now + (uint64_t)(random_fraction()*send_interval());
+
+			phase = RUNNING;
+			run_start = progress = now;
+		}
+
+		if (phase == RUNNING && now - run_start >= (uint64_t)config.duration*1000000){
+			phase = DRAINING;
+			report(now - run_start);
+		}
+
+		if (phase == DRAINING){
+			if (now - run_start < (uint64_t)config.duration*1000000 + DRAIN_TIME) continue;
+
+			printf("After draining:\n");
+			report((uint64_t)config.duration*1000000);
+			break;
+		}
+
+		for (i = 0; i < config.users; i++){
+			User *user = users + i;
+			if (user->socket == NULL || user->connecting) continue;
+
+			if (user->joined && user->next_send <= now){
+				user_chat(user, padding, now);
+				user->next_send += send_interval();
+			}
+
+			/* Whatever the socket didn't take before */
+			if (user->socket != NULL && user->out.count > 0) user_flush(user);
+		}
+
+		if (now - progress >= 1000000){
+			progress = now;
+			printf("%.0f s: %lu sent, %lu delivered\n", (now - run_start)/1000000.0,\
+				   (unsigned long)totals.counters[MESSAGES_OUT], (unsigned long)totals.counters[MESSAGES_IN]);
+		}
+	}
+
+	for (i = 0; i < config.users; i++)
+		user_disconnect(users + i);
+
+	return 0;
+}
@@ -4,14 +4,46 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdarg.h>
 
+#include <errno.h>
 #include <irc_utils.h>
+#include <out_queue.h>
+#include <payload.h>
+#include <history.h>
+#include <journal.h>
+#include <token_bucket.h>
+#include <name_table.h>
+#include <slab.h>
+#include <id_set.h>
+#include <mailbox.h>
+#include <uring.h>
+#include <metrics.h>
 #include <signal.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/random.h>
 
 #include <server.h>
 
-#define LOBBY 0
+#define LOBBY NO_HANDLE	/* Admin of the lobby: no client has this id */
+#define MAX_EVENTS 64
+#define STATS_TEXT_LEN 8192		/* Room for the Prometheus text */
+
+#define FLUSH_BATCH_BYTES 16384	/* Queued bytes written regardless of the flush policy */
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256		/* Provided buffers per worker, a power of 2 */
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+/* io_uring user_data: a request type in the top byte, and a pointer (or nothing) */
+#define URING_USER_DATA(type, ptr) (((uint64_t)(type) << 56) | (uint64_t)(uintptr_t)(ptr))
+#define URING_TYPE(user_data) ((int)((user_data) >> 56))
+#define URING_PTR(user_data) ((void *)(uintptr_t)((user_data) & ((((uint64_t)1) << 56) - 1)))
 
 #define QUIT_CMD "/quit"
 #define PING_CMD "/ping"
@@ -23,984 +55,4056 @@
 #define WHOIS_CMD "/whois"
 #define MODE_CMD "/mode"
 #define INVITE_CMD "/invite"
+#define STATS_CMD "/stats"
+#define RESUME_CMD "/resume"	/* Sent instead of a nickname, to resume a session */
+
+#define RESUME_TOKEN_LEN 16		/* Hex digits */
+#define SESSION_SWEEP_INTERVAL 1	/* Seconds between looks for expired sessions */
+#define CHANNEL_SEQ_SHIFT 32	/* Above it, sequence numbers count channel incarnations */
+
+#define MAX_LINKS 16			/* Servers a server can be linked with */
+#define ALL_LINKS -1
+#define LINK_RETRY_INTERVAL 1	/* Seconds between attempts to reopen a lost link */
+#define LINK_QUEUED_BYTES (1024*MAX_FRAME_LEN)	/* Unsent bytes a link holds before it is dropped */
+#define MAX_LINK_SECRET_LEN 128
+
+/*
+	Messages servers exchange over a link, each a
+	frame of its own: a verb and its arguments. A
+	relay verb is followed by a second frame, the
+	message to deliver exactly as clients get it.
+*/
+#define LINK_SERVER "SERVER"	/* <id> <secret>: the hello each end sends first */
+#define LINK_USER "USER"		/* <nickname> is taken on the sender 			*/
+#define LINK_NICK "NICK"		/* <old> <new>: a user of the sender renamed 	*/
+#define LINK_JOIN "JOIN"		/* <nickname> <channel>: it moved to channel 	*/
+#define LINK_PART "PART"		/* <nickname>: it left its channel, keeping the name */
+#define LINK_QUIT "QUIT"		/* <nickname> is free again 					*/
+#define LINK_MSG "MSG"			/* <channel>: relays a message, kept in history */
+#define LINK_NOTICE "NOTICE"	/* <channel>: relays a server notice 			*/
+#define LINK_ALL "ALL"			/* Relays a message to every user 				*/
+
+
+/*
+	Locking: clients_lock guards the client slab, the
+	nickname index and the user count. channels_lock
+	guards the channel registry: joins only read it,
+	while creating or deleting a channel writes it.
+	Each channel's own lock guards its members, modes
+	and ACLs, so channels never contend with each other.
+	Lock order: channels_lock, then a channel's lock,
+	then clients_lock.
+
+	Anything else about a client (its queue, channel,
+	etc.) is only ever touched by the worker that owns
+	it. Other workers go through that worker's mailbox.
+*/
+pthread_mutex_t clients_lock;
+pthread_rwlock_t channels_lock;
+
+enum IO_BACKENDS {
+    EPOLL_BACKEND, URING_BACKEND
+};
+
+
+/*
+	When queued frames are written: right away (one
+	syscall per message), at the end of each loop
+	iteration, or once a window of flush_window
+	microseconds passes. The later, the more frames
+	each gathering write carries.
+*/
+enum FLUSH_POLICIES {
+    FLUSH_IMMEDIATE, FLUSH_LOOP, FLUSH_WINDOW
+};
+
+
+/*
+	What becomes of a client whose queue reaches the
+	high-water mark: it is disconnected, or its oldest
+	frames are dropped down to the low-water mark.
+*/
+enum SLOW_CONSUMER_POLICIES {
+    SLOW_DISCONNECT, SLOW_DROP_OLDEST
+};
+
+
+/* Runtime settings, filled in from the command line */
+typedef struct server_config {
+    int max_users;
+    int max_channels;
+    int workers;
+    int backend;		/* IO_BACKENDS */
+    int flush_policy;	/* FLUSH_POLICIES */
+    int flush_window;	/* In microseconds */
+    char *stats_endpoint;	/* Loopback port or UNIX socket path, NULL for none */
+    int history_count;	/* Messages each channel keeps for those who join */
+    int history_bytes;	/* Bytes of them, at most */
+    char *journal_dir;	/* Where channel messages are recorded, NULL for nowhere */
+    int journal_sync;	/* JOURNAL_SYNC_POLICIES */
+    int journal_interval;	/* In milliseconds */
+    int resume_grace;	/* Seconds a lost client can resume its session for, 0 for none */
+    int port;			/* Clients connect to it */
+    int server_id;		/* Unique among linked servers: the lowest wins nickname clashes */
+    int link_port;		/* Other servers link to it, 0 for none */
+    uint32_t link_address;	/* Where it listens for them, in host byte order */
+    char *peers[MAX_LINKS];	/* <ip>:<port> of the servers to link to */
+    int n_peers;
+
+    /* Token bucket rates (per second) and bursts, 0 for no limit */
+    int chat_rate, chat_burst;			/* Each client's lines 	*/
+    int command_rate, command_burst;	/* Each client's commands */
+    int channel_rate, channel_burst;	/* Each channel's lines */
+
+    int slow_policy;	/* SLOW_CONSUMER_POLICIES */
+    int high_water;		/* Bytes a client's queue holds, at most */
+    int low_water;		/* Bytes SLOW_DROP_OLDEST trims it down to */
+} ServerConfig;
+
+ServerConfig config = { DEFAULT_MAX_USERS, DEFAULT_MAX_CHANNELS, DEFAULT_WORKERS,\
+						EPOLL_BACKEND, FLUSH_IMMEDIATE, 0, NULL,\
+						DEFAULT_HISTORY_COUNT, DEFAULT_HISTORY_BYTES,\
+						NULL, JOURNAL_SYNC_INTERVAL, DEFAULT_JOURNAL_INTERVAL,\
+						DEFAULT_RESUME_GRACE, SERVER_PORT, 0, 0, INADDR_LOOPBACK, { NULL }, 0,\
+						DEFAULT_CHAT_RATE, 2*DEFAULT_CHAT_RATE, DEFAULT_COMMAND_RATE, 2*DEFAULT_COMMAND_RATE,\
+						DEFAULT_CHANNEL_RATE, 2*DEFAULT_CHANNEL_RATE,\
+						SLOW_DISCONNECT, MAX_QUEUED_BYTES, MAX_QUEUED_BYTES/2 };
+
+/*
+	Clients and channels live in slabs. A client's
+	id is its slab handle, so it indexes the slab
+	directly, yet is never reused by a later client
+	(e.g. in mute lists): its generation has 31 bits
+	of its own, which no amount of churn wraps.
+*/
+Slab *client_slab;
+Slab *channel_slab;
+
+int current_users = 0;		/* Clients that finished the handshake, in all workers */
+
+NameTable *clients_by_name;		/* Indexed by username */
+
+NameTable *channels;		/* Indexed by channel name */
+Channel *lobby;
+
+/* Sent to clients whose lines are dropped for going over budget, formatted once */
+Payload *flood_notice;
+Payload *busy_notice;
+uint64_t channel_incarnations = 0;	/* Channels created so far. Guarded by channels_lock */
+
+/*
+	Sessions of clients that were lost, waiting to be
+	resumed, oldest first. They keep their nicknames
+	taken. Guarded by clients_lock.
+*/
+NameTable *sessions_by_token;
+NameTable *sessions_by_name;
+Session *sessions_head = NULL, *sessions_tail = NULL;
+int n_sessions = 0;
+
+Shard *shards;
+int n_shards;
+__thread Shard *current_shard;		/* The worker running on this thread */
+
+/*
+	Links with other servers, all owned by the link
+	thread, which workers reach through its mailbox.
+	What each link knows of the other server's users
+	and channels is read by workers too, so it is
+	guarded by links_lock, as is n_links.
+	Lock order: clients_lock or a channel's lock,
+	then links_lock.
+*/
+pthread_rwlock_t links_lock;
+Link *links;			/* MAX_LINKS of them */
+int n_links = 0;		/* Slots used so far, none of them past it */
+uint8_t linking = 0;	/* Boolean: set once, before the workers start */
+Mailbox link_mailbox;
+int link_wake_fd;
+Socket *link_listener = NULL;
+
+/* Shared by every linked server, which proves itself with it in its hello */
+char link_secret[MAX_LINK_SECRET_LEN + 1] = "";
+
+
+struct client {
+    Socket *socket;
+    int64_t id;
+    int state;
+    uint8_t dropped;	/* Boolean */
+    char username[MAX_NAME_LEN + 1];
+    Channel *channel;
+    Shard *shard;		/* Worker that owns it, never changes */
+
+    int slot;			/* Position in shard->clients 		*/
+    int member_slot;	/* Position in its channel's members 	*/
+
+    FrameReader reader;
+    OutQueue out;
+
+    uint8_t flagged;	/* Boolean: in shard->to_flush */
+
+    char token[RESUME_TOKEN_LEN + 1];	/* To resume its session, if it is lost */
+    uint64_t last_seq;	/* Of the newest message of its channel queued to it */
+    uint64_t incarnation;	/* Of its channel: the high bits of that channel's seqs */
+
+    TokenBucket chat_budget;
+    TokenBucket command_budget;
+    uint8_t throttled;	/* Boolean: told its latest messages were dropped */
+
+    /* io_uring bookkeeping: it is freed once no request uses it */
+    int requests;		/* In flight 						*/
+    uint8_t receiving;	/* Boolean: multishot recv is armed */
+    uint8_t sending;	/* Boolean 							*/
+    uint8_t closing;	/* Boolean 							*/
+    struct msghdr send_msg;		/* Of the send in flight */
+    struct iovec send_iov[OUT_QUEUE_MAX_IOV];
+};
+
+
+struct channel {
+    pthread_mutex_t lock;
+    int64_t handle;
+    int64_t admin;
+    uint8_t private;	/* Boolean 	*/
+
+    /* Hold client ids, each up to max_users of them */
+    IdSet muted_users;
+    IdSet allowed_users;
+
+    /* One list per worker, each with the members it owns */
+    Members *members;
+    int current_users;	/* In all workers */
+
+    History history;	/* Replayed to whoever joins */
+    uint64_t seq;		/* Of its latest message */
+    TokenBucket budget;	/* For its members' lines, all together */
+
+    char name[MAX_CHANNEL_LEN];
+};
+
+
+/*
+	What a lost client gets back if it resumes in
+	time: its nickname, its channel, and the channel
+	messages after cursor that are still in its history.
+*/
+struct session {
+    char token[RESUME_TOKEN_LEN + 1];
+    char username[MAX_NAME_LEN + 1];
+    char channel[MAX_CHANNEL_LEN];
+    uint64_t cursor;	/* Seq of the last channel message it was fully sent */
+    uint64_t expires;	/* metrics_now() after which it can't be resumed */
+    Session *prev, *next;	/* In expiry order */
+};
+
+
+/* A user of another server, as that server describes it */
+struct remote_user {
+    char username[MAX_NAME_LEN + 1];
+    char channel[MAX_CHANNEL_LEN];		/* Empty while it is in none */
+};
+
+
+/* How many members a channel has on another server */
+struct remote_channel {
+    char name[MAX_CHANNEL_LEN];
+    int members;
+};
+
+
+/*
+	A connection with another server, over which
+	both relay their users' messages. Servers are
+	linked in a full mesh and nothing is passed
+	on: each message crosses a link at most once.
+*/
+struct link {
+    int index;
+    int state;			/* LINK_STATES */
+    char *peer;			/* <ip>:<port> to (re)connect to, NULL if the other end connected */
+    int fd;				/* -1 while down */
+    Socket *socket;		/* Once connected */
+    int peer_id;		/* Of the server at the other end, once it said hello */
+    uint8_t dropped;	/* Boolean: it fell too far behind */
+    uint64_t retry_at;	/* metrics_now() after which it is reopened */
+    int yielded_to;		/* Server it was closed for, as a second link with it: not reopened meanwhile */
+
+    FrameReader reader;
+    OutQueue out;
+    int relaying;		/* RELAYS: what the next frame is, after a relay verb */
+    char relay_channel[MAX_CHANNEL_LEN];
+
+    /* Both guarded by links_lock */
+    NameTable *users;		/* RemoteUser by nickname 	*/
+    NameTable *channels;	/* RemoteChannel by name, for channels with members */
+};
+
+
+/* Growable array, with its size and capacity */
+struct members {
+    Client **users;
+    int count;
+    int capacity;
+};
+
+
+/*
+	An event loop running on its own thread. Each
+	has its own listening socket, all bound to the
+	same port, and the kernel spreads connections
+	among them. The clients it accepts stay with it.
+*/
+struct shard {
+    int index;
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;		/* eventfd, readable once mail is posted 	*/
+    Socket *listener;
+    Mailbox mailbox;
+    Ring *ring;			/* NULL if it runs on epoll */
+
+    /* Growable array of its clients that finished the handshake */
+    Client **clients;
+    int current_users;
+    int clients_capacity;
+
+    /* Growable array of clients with frames to write, per the flush policy */
+    Client **to_flush;
+    int flushes;
+    int flush_capacity;
+    int flush_timer_fd;		/* timerfd, for FLUSH_WINDOW 		*/
+    int sweep_timer_fd;		/* timerfd, to expire sessions: the first worker's only, -1 elsewhere */
+    uint8_t timer_armed;	/* Boolean 						*/
+    uint8_t flush_due;		/* Boolean: the window has passed 	*/
+
+    Metrics metrics;		/* Written by this worker only */
+    uint64_t received;		/* When the frames being handled were read, in µs */
+};
+
+
+/* Work posted by a worker to another one's mailbox */
+struct mail {
+    MailNode node;
+    int type;
+    int64_t client;		/* Client id, for DIRECT_MAIL and KICK_MAIL 	*/
+    int64_t channel;	/* Channel handle, for CHANNEL_MAIL and KICK_MAIL */
+    int64_t sender;		/* Client id, to reply to 					*/
+    int link;			/* Link index, or ALL_LINKS, for LINK_MAIL 	*/
+    Payload *header;	/* Frame sent ahead of payload, for LINK_MAIL */
+    Payload *payload;
+};
+
+
+/* Requests a worker has in flight on its io_uring */
+enum URING_REQUESTS {
+    ACCEPT_REQUEST = 1, WAKE_REQUEST, RECV_REQUEST, SEND_REQUEST, TIMER_REQUEST, SWEEP_REQUEST
+};
+
+
+enum MAIL_TYPES {
+    CHANNEL_MAIL,	/* Queue payload to the channel's members in the worker 	*/
+    GLOBAL_MAIL,	/* Queue payload to every client of the worker 			*/
+    DIRECT_MAIL,	/* Queue payload to the client 							*/
+    KICK_MAIL,		/* Send the client back to the lobby, if still in channel 	*/
+    YIELD_MAIL,		/* Rename the client, if another server won its nickname 	*/
+    LINK_MAIL		/* Send header and payload over the link, or every one that is up */
+};
+
+
+enum LINK_STATES {
+    LINK_DOWN, LINK_CONNECTING, LINK_HANDSHAKE, LINK_UP
+};
+
+
+/* Frames that follow a relay verb */
+enum RELAYS {
+    RELAY_NONE, RELAY_MESSAGE, RELAY_NOTICE, RELAY_ALL
+};
+
+
+enum COMMANDS {
+    QUIT, PING, RENAME, JOIN, KICK, MUTE, UNMUTE, WHOIS, MODE, INVITE, STATS, NO_CMD
+};
+
+
+/*
+	A command split in place, in a single pass: its
+	name (with the '/') and its argument, which is
+	the rest of the line. Both point into the
+	message, and the argument is NUL-terminated.
+*/
+struct command_line {
+    char *name;
+    int name_len;
+    char *arg;
+    int arg_len;
+};
+
+
+/* Every command handler takes the argument slice and returns its COMMANDS value */
+typedef int (*CommandHandler)(Client *client, char *arg, int arg_len);
+
+typedef struct command {
+    const char *name;
+    int name_len;
+    CommandHandler handler;
+} Command;
+
+
+/*
+	Perfect hash of command names, picked to have no
+	collisions among them: each has a slot of its own
+	in COMMAND_TABLE. Names must have 3+ characters.
+*/
+#define COMMAND_SLOTS 32
+#define COMMAND_HASH(name, len) ((7*(name)[1] + 2*(name)[2]) & (COMMAND_SLOTS - 1))
+
+
+/*
+	States of a connection's life cycle:
+	it starts by waiting for the nickname handshake,
+	then relays messages and commands until it quits
+	(and its last messages are flushed) or the
+	connection drops.
+*/
+enum CLIENT_STATES {
+    AWAITING_NICKNAME, CHATTING, QUITTING, DISCONNECTED
+};
+
+
+
+/*
+	Makes sure array, which has room for *capacity
+	elements, can hold needed elements, doubling it
+	if it can't. Returns the (possibly moved) array.
+
+	Exits if allocation fails.
+*/
+void *reserve(void *array, int *capacity, int needed, size_t element_size){
+
+	if (needed <= *capacity) return array;
+
+	int new_capacity = *capacity > 0 ? *capacity : 4;
+	while (new_capacity < needed) new_capacity *= 2;
+
+	array = realloc(array, new_capacity*element_size);
+	if (array == NULL)
+		exit_error("reserve: Could not grow array");
+
+	*capacity = new_capacity;
+	return array;
+}
+
+
+/*
+	Creates an empty channel with the given name and admin.
+	Admin should only be NULL for the initial Lobby chat.
+	The channel is set by default to be public.
+
+	Returns NULL if there are already max_channels channels.
+*/
+Channel *channel_create(char name[MAX_CHANNEL_LEN], Client *admin){
+
+	int64_t handle;
+	Channel *c = (Channel *)slab_alloc(channel_slab, &handle);
+	if (c == NULL) return NULL;
+
+	/* The slab hands out zeroed memory: every array starts empty */
+	pthread_mutex_init(&(c->lock), NULL);
+	c->handle = handle;
+
+	c->members = (Members *)calloc(n_shards, sizeof(Members));
+	if (c->members == NULL)
+		exit_error("channel_create: Could not allocate member lists");
+
+	strncpy(c->name, name, MAX_CHANNEL_LEN);
+	history_init(&(c->history), config.history_count, config.history_bytes);
+
+	/* Sequence numbers never repeat, even for a later channel with the same name */
+	c->seq = ++channel_incarnations << CHANNEL_SEQ_SHIFT;
+	token_bucket_init(&(c->budget), config.channel_rate, config.channel_burst, metrics_now());
+	
+	c->private = 0;
+	c->admin = (admin == NULL) ? LOBBY : admin->id;
+
+	if (admin != NULL)
+		id_set_add(&(c->allowed_users), admin->id);
+
+	return c;
+}
+
+
+/* Does not free the channel's users */
+void channel_free(Channel *c){
+	id_set_clear(&(c->muted_users));
+	id_set_clear(&(c->allowed_users));
+	history_clear(&(c->history));
+	int i;
+	for (i = 0; i < n_shards; i++) free(c->members[i].users);
+	free(c->members);
+
+	pthread_mutex_destroy(&(c->lock));
+	slab_release(channel_slab, c->handle);
+}
+
+
+/* NOTE: the caller must hold channels_lock */
+Channel *find_channel(char channel_name[MAX_CHANNEL_LEN]){
+	return (Channel *)name_table_get(channels, channel_name);
+}
+
+
+/*
+	Queues payload to be sent to the client as soon
+	as its socket is writable, without blocking.
+	A client whose queue is full is lagging too
+	far behind, and is dealt with per the
+	slow-consumer policy.
+
+	Returns 1 on success and -1 on failure.
+*/
+int client_send_payload(Client *client, Payload *payload){
+
+	if (client->dropped) return -1;
+
+	int was_empty = client->out.count == 0;
+
+	if (out_queue_push(&(client->out), payload) < 0 && shed_load(client, payload) < 0)
+		return -1;
+
+	metrics_count(MESSAGES_OUT, 1);
+	metrics_record(QUEUE_DEPTH, client->out.count);
+	if (payload->seq >> CHANNEL_SEQ_SHIFT == client->incarnation) client->last_seq = payload->seq;
+
+	return schedule_flush(client, was_empty);
+}
+
+
+/*
+	Makes room for payload in the queue of a client
+	that reached the high-water mark, per the
+	slow-consumer policy: either the client is
+	disconnected, or its oldest frames are dropped
+	down to the low-water mark. It never waits for
+	the client, and a disconnected one only leaves
+	its channel once its worker gets to it, so
+	whoever is sending (or iterating over members)
+	goes on as before.
+
+	Returns 1 if payload was queued and -1 otherwise.
+*/
+int shed_load(Client *client, Payload *payload){
+
+	if (config.slow_policy == SLOW_DISCONNECT){
+		warn_log("client_send: Client %s unresponsive. Disconnecting.", client->username);
+		metrics_count(SLOW_DISCONNECTED, 1);
+		drop_client(client);
+		return -1;
+	}
+
+	/* The kernel is still reading the frames of an io_uring send */
+	int in_flight = client->sending ? client->send_msg.msg_iovlen : 0;
+	int dropped = out_queue_trim(&(client->out), in_flight, config.low_water);
+
+	metrics_count(SLOW_TRIMMED, 1);
+	debug_log("client_send: Client %s lagging. Dropped %d messages.", client->username, dropped);
+
+	/* Too much of it in flight: the new message goes instead */
+	if (out_queue_push(&(client->out), payload) < 0){
+		metrics_count(SLOW_MESSAGES_DROPPED, dropped + 1);
+		return -1;
+	}
+
+	metrics_count(SLOW_MESSAGES_DROPPED, dropped);
+	return 1;
+}
+
+
+/*
+	Writes the client's queue, or has it written
+	later, per the flush policy. Under the immediate
+	policy, a queue that already had frames is left
+	to the reactor, unless was_empty is set.
+
+	Returns 1 on success and -1 on failure.
+*/
+int schedule_flush(Client *client, int was_empty){
+
+	/* A full batch doesn't wait for the policy */
+	int batch_ready = client->out.count >= OUT_QUEUE_MAX_IOV || client->out.bytes >= FLUSH_BATCH_BYTES;
+
+	/* io_uring can't write inline: it goes with the next submission */
+	if (client->shard->ring != NULL){
+		if (batch_ready) submit_send(client);
+		else flag_for_flush(client);
+		return 1;
+	}
+
+	if (config.flush_policy != FLUSH_IMMEDIATE && !batch_ready){
+		flag_for_flush(client);
+		return 1;
+	}
+
+	/* Otherwise the reactor flushes it once the socket is writable */
+	if ((was_empty || batch_ready) && out_queue_flush(&(client->out), client->socket) < 0){
+		drop_client(client);
+		return -1;
+	}
+
+	return 1;
+}
+
+
+/*
+	Queues the channel's history after the message
+	numbered after (0 for all of it) to the client,
+	which has just joined it, to go out in as few
+	writes as possible. The oldest messages are left
+	out if they don't fit in the client's queue.
+
+	NOTE: the caller must hold the channel's lock.
+*/
+void replay_history(Client *client, Channel *channel, uint64_t after){
+	History *history = &(channel->history);
+	if (history->count == 0 || client->dropped) return;
+
+	int i = 0, bytes = history->bytes;
+	while (i < history->count && (history_get(history, i)->seq <= after ||\
+								  client->out.bytes + bytes > client->out.max_bytes))
+		bytes -= history_get(history, i++)->len;
+
+	int replayed = history->count - i, was_empty = client->out.count == 0;
+	for (; i < history->count; i++){
+		out_queue_push(&(client->out), history_get(history, i));
+		client->last_seq = history_get(history, i)->seq;
+	}
+
+	metrics_count(MESSAGES_OUT, replayed);
+	if (replayed > 0) schedule_flush(client, was_empty);
+}
+
+
+/*
+	Has the client's pending frames written along with
+	those of other clients, per the flush policy. The
+	first client flagged in a window starts its timer.
+*/
+void flag_for_flush(Client *client){
+	if (client->flagged) return;
+
+	Shard *shard = client->shard;
+	shard->to_flush = reserve(shard->to_flush, &(shard->flush_capacity),\
+							  shard->flushes + 1, sizeof(Client *));
+	shard->to_flush[shard->flushes++] = client;
+	client->flagged = 1;
+
+	if (config.flush_policy == FLUSH_WINDOW && !shard->timer_armed){
+		struct itimerspec window;
+		memset(&window, 0, sizeof(window));
+		window.it_value.tv_sec = config.flush_window/1000000;
+		window.it_value.tv_nsec = (config.flush_window%1000000)*1000;
+
+		if (timerfd_settime(shard->flush_timer_fd, 0, &window, NULL) < 0)
+			exit_error("flag_for_flush: Could not start flush window");
+		shard->timer_armed = 1;
+	}
+}
+
+
+/* Takes the client out of its worker's flush list, e.g. before freeing it */
+void unflag_client(Client *client){
+
+	Shard *shard = client->shard;
+	int i;
+	for (i = 0; client->flagged && i < shard->flushes; i++){
+		if (shard->to_flush[i] == client){
+			shard->to_flush[i] = shard->to_flush[--shard->flushes];
+			client->flagged = 0;
+		}
+	}
+}
+
+
+/*
+	Called when the flush window's timer fires:
+	the flagged clients are due to be written.
+*/
+void flush_window_passed(Shard *shard){
+	uint64_t expirations;
+	if (read(shard->flush_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		warn_log("flush_window_passed: Could not read timer");
+
+	shard->timer_armed = 0;
+	shard->flush_due = 1;
+}
+
+
+/*
+	Writes out the pending frames of every client
+	flagged in an epoll worker, each with as few
+	gathering writes as the socket allows.
+*/
+void flush_clients(Shard *shard){
+
+	int i;
+	for (i = 0; i < shard->flushes; i++){
+		Client *client = shard->to_flush[i];
+		client->flagged = 0;
+
+		if (!client->dropped && out_queue_flush(&(client->out), client->socket) < 0)
+			drop_client(client);
+	}
+
+	shard->flushes = 0;
+	shard->flush_due = 0;
+}
+
+
+/* Sends a \0-terminated message to a single client */
+int client_send(Client *client, const char msg[]){
+	Payload *payload = payload_create("%s", msg);
+	int status = client_send_payload(client, payload);
+	payload_unref(payload);
+
+	return status;
+}
+
+
+/*
+	Posts payload (if any) to shard's mailbox, waking
+	the worker up if needed. The fields of mail that
+	type uses must be filled in.
+*/
+void post_mail(Shard *shard, Mail *mail, Payload *payload){
+
+	mail->payload = payload;
+	if (payload != NULL) payload_ref(payload);
+
+	if (mailbox_post(&(shard->mailbox), &(mail->node))){
+		uint64_t wake = 1;
+		if (write(shard->wake_fd, &wake, sizeof(wake)) < 0)
+			warn_log("post_mail: Could not wake up worker %d", shard->index);
+	}
+}
+
+
+/* Allocates mail of the given type, with no client or channel */
+Mail *mail_create(int type){
+	Mail *mail = (Mail *)malloc(sizeof(Mail));
+	if (mail == NULL)
+		exit_error("mail_create: Could not allocate mail");
+
+	mail->type = type;
+	mail->client = NO_HANDLE;
+	mail->channel = NO_HANDLE;
+	mail->sender = NO_HANDLE;
+	mail->link = ALL_LINKS;
+	mail->header = NULL;
+	mail->payload = NULL;
+
+	return mail;
+}
+
+
+/* Queues payload to every client owned by the current worker */
+void broadcast_local(Payload *payload){
+	int j;
+	for (j = 0; j < current_shard->current_users; j++)
+		client_send_payload(current_shard->clients[j], payload);
+}
+
+
+/*
+	Queues payload to the channel's members owned
+	by the current worker.
+
+	NOTE: the caller must hold the channel's lock.
+*/
+void fanout_local(Payload *payload, Channel *channel){
+	Members *members = channel->members + current_shard->index;
+
+	int j;
+	for (j = 0; j < members->count; j++)
+		client_send_payload(members->users[j], payload);
+}
+
+
+/*
+	Queues the same payload to the channel's members
+	on this server, without copying it. Members owned
+	by other workers get it through their mailboxes,
+	with a single mail per worker.
+
+	NOTE: the caller must hold the channel's lock.
+*/
+void fanout_shards(Payload *payload, Channel *channel){
+	metrics_record(FANOUT_SIZE, channel->current_users);
+
+	int i;
+	for (i = 0; i < n_shards; i++){
+		if (channel->members[i].count == 0) continue;
+
+		if (shards + i == current_shard){
+			fanout_local(payload, channel);
+		} else {
+			Mail *mail = mail_create(CHANNEL_MAIL);
+			mail->channel = channel->handle;
+			post_mail(shards + i, mail, payload);
+		}
+	}
+}
+
+
+/*
+	Queues the same payload to all clients on a
+	channel, without copying it, here and on every
+	linked server where it has members.
+
+	NOTE: the caller must hold the channel's lock.
+*/
+void fanout(Payload *payload, Channel *channel){
+	fanout_shards(payload, channel);
+	relay_to_channel(payload, channel);
+}
+
+
+/* Queues payload to every client on this server, whichever worker owns it */
+void broadcast_shards(Payload *payload){
+	int i;
+	for (i = 0; i < n_shards; i++){
+		if (shards + i == current_shard)
+			broadcast_local(payload);
+		else
+			post_mail(shards + i, mail_create(GLOBAL_MAIL), payload);
+	}
+}
+
+
+/*
+	Queues the same payload to all clients on a
+	channel, without copying it. To send to all
+	clients regardless of channel, set channel to NULL
+*/
+void broadcast(Payload *payload, Channel *channel){
+
+	if (channel == NULL){
+		broadcast_shards(payload);
+
+		if (linking){
+			Payload *header = payload_create(LINK_ALL);
+			post_link_mail(ALL_LINKS, header, payload);
+			payload_unref(header);
+		}
+	}
+
+	else {
+		pthread_mutex_lock(&(channel->lock));
+		fanout(payload, channel);
+		pthread_mutex_unlock(&(channel->lock));
+	}
+}
+
+
+/*
+	Queues payload to the client with the given id,
+	whichever worker owns it. Does nothing if there
+	is no such client.
+*/
+void send_to_id(int64_t id, Payload *payload){
+
+	Shard *shard = get_shard(id);
+	if (shard == NULL) return;
+
+	if (shard == current_shard){
+		client_send_payload(get_client(id), payload);
+	} else {
+		Mail *mail = mail_create(DIRECT_MAIL);
+		mail->client = id;
+		post_mail(shard, mail, payload);
+	}
+}
+
+
+/*
+	Sends msg to all clients on a channel.
+	To send to all clients regardles of channel,
+	set channel to NULL
+*/
+void send_to_clients(char msg[], Channel *channel){
+	Payload *payload = payload_create("%s", msg);
+	broadcast(payload, channel);
+	payload_unref(payload);
+}
+
+
+/*
+	Shuts down the client's connection without
+	touching the clients or channel arrays. The
+	reactor then sees the hang up and runs the
+	regular disconnect path, so it is safe to call
+	while iterating over those arrays.
+*/
+void drop_client(Client *client){
+	client->dropped = 1;
+	client->last_seq = delivered_cursor(client);	/* What it misses can be resumed */
+
+	/* An in-flight send still reads from the queue: its completion clears it */
+	if (!client->sending) out_queue_clear(&(client->out));
+
+	socket_shutdown(client->socket, SHUT_RDWR);
+}
+
+
+/*
+	Deletes the channel with the given handle if
+	it is (still) empty, unless it is the lobby.
+	A handle is used because, once the channel's
+	lock is released, another thread may delete it
+	first and its slot may even be reused.
+
+	NOTE: this function uses channels_lock and
+		  the channel's lock.
+*/
+void delete_if_empty(int64_t channel_handle){
+	
+	pthread_rwlock_wrlock(&channels_lock);
+
+	Channel *channel = (Channel *)slab_get(channel_slab, channel_handle);
+
+	/* Waits for whoever emptied it to be done with it */
+	int is_empty = 0;
+	if (channel != NULL){
+		pthread_mutex_lock(&(channel->lock));
+		is_empty = channel->current_users == 0;
+		pthread_mutex_unlock(&(channel->lock));
+	}
+
+	/* Nobody can reach it now, other than through the registry */
+	if (is_empty && channel != lobby){
+		/* Remove channel from registry */
+		debug_log("Removing channel %s", channel->name);
+		name_table_remove(channels, channel->name);
+
+		channel_free(channel);
+		debug_log("Current channels: %d", name_table_size(channels));
+	}
+
+	pthread_rwlock_unlock(&channels_lock);
+}
+
+
+/*
+	Removes client from current channel, telling
+	the other members if announce is set.
+
+	If the client is the only one in the
+	channel, also deletes the channel from the
+	list (except for the lobby).
+	
+	Returns 0 on failure, 1 on success.
+
+	NOTE: this function uses the channel's lock
+		  (and channels_lock if it deletes it).
+*/
+int leave_channel(Client *client, int announce){
+	
+	Channel *current_channel = client->channel;
+	pthread_mutex_lock(&(current_channel->lock));
+
+	/* Swap-remove: the last member takes the vacant position */
+	Members *members = current_channel->members + client->shard->index;
+	Client *last = members->users[--members->count];
+	members->users[client->member_slot] = last;
+	last->member_slot = client->member_slot;
+	members->users[members->count] = NULL;
+
+	current_channel->current_users--;
+	debug_log("Channel %s has %d users", current_channel->name, current_channel->current_users);
+
+	if (announce){
+		Payload *leave_msg = payload_create("SERVER: %s left the channel.", client->username);
+		fanout(leave_msg, current_channel);
+		payload_unref(leave_msg);
+	}
+
+	int is_empty = current_channel->current_users == 0;
+	int64_t handle = current_channel->handle;
+
+	pthread_mutex_unlock(&(current_channel->lock));
+
+	if (is_empty) delete_if_empty(handle);
+	return 1;
+}
+
+
+/*
+	Finds the channel with the given name, creating
+	it (with client as admin) if there is none, and
+	adds client to its users, replaying the messages
+	after the one numbered after. The position client
+	took is stored in slot, since client's own
+	member_slot still refers to its old channel.
+
+	If the channel is private and client is not
+	invited, or no more channels can be created,
+	client is not added and NULL is returned.
+
+	NOTE: this function uses channels_lock and
+		  the channel's lock.
+*/
+Channel *add_to_channel(char channel_name[MAX_CHANNEL_LEN], Client *client, int *slot, uint64_t after){
+
+	/* Existing channels can't be deleted while the registry is read-locked */
+	pthread_rwlock_rdlock(&channels_lock);
+	Channel *channel = find_channel(channel_name);
+
+	if (channel == NULL){
+		pthread_rwlock_unlock(&channels_lock);
+		pthread_rwlock_wrlock(&channels_lock);
+
+		channel = find_channel(channel_name);	/* It may have been created meanwhile */
+		if (channel == NULL){
+			channel = channel_create(channel_name, client);
+
+			if (channel == NULL){
+				pthread_rwlock_unlock(&channels_lock);
+				client_send(client, "SERVER: Too many channels. Try joining an existing one.");
+				return NULL;
+			}
+
+			name_table_put(channels, channel->name, channel);
+		}
+	}
+
+	pthread_mutex_lock(&(channel->lock));
+
+	/* If channel is private, must be invited to it */
+	if (channel->private && !is_invited(channel, client->id)){
+		pthread_mutex_unlock(&(channel->lock));
+		pthread_rwlock_unlock(&channels_lock);
+
+		char invite_msg[] = "SERVER: You are not invited to this channel";
+		client_send(client, invite_msg);
+
+		return NULL;
+	}
+	
+	Members *members = channel->members + client->shard->index;
+	members->users = reserve(members->users, &(members->capacity),\
+							 members->count + 1, sizeof(Client *));
+	*slot = members->count;
+	members->users[members->count++] = client;
+
+	channel->current_users++;
+
+	/* Messages of its last channel may still be queued: they no longer count for resuming */
+	client->incarnation = channel->seq >> CHANNEL_SEQ_SHIFT;
+	client->last_seq = after > channel->seq ? channel->seq : after;
+
+	/* Under the lock, so that no message is missed or seen twice */
+	replay_history(client, channel, after);
+
+	pthread_mutex_unlock(&(channel->lock));
+	pthread_rwlock_unlock(&channels_lock);
+
+	return channel;
+}
+
+
+/*
+	Adds client to the list of users of channel
+	with channel_name, leaving previous channel.
+
+	If no channel with the name exists, it is created
+	and client becomes its admin. If the channel
+	name is invalid, does nothing.
+
+	Returns 0 on failure, 1 on success.
+*/
+int join_channel(char channel_name[MAX_CHANNEL_LEN], Client *client){
+
+	if (invalid_channel_name(channel_name)) return 0;
+
+	if (client->channel != NULL &&\
+		!strcmp(channel_name, client->channel->name)) return 0;
+
+	/* Adding client to new channel, possibly creating it */
+	int slot;
+	Channel *new_channel = add_to_channel(channel_name, client, &slot, 0);
+	if (new_channel == NULL) return 0;
+
+	/* Remove client from current channel, deleting it if necessary */	
+	if (client->channel != NULL)
+		leave_channel(client, 1);
+
+	client->channel = new_channel;
+	client->member_slot = slot;
+	link_event(LINK_JOIN " %s %s", client->username, client->channel->name);
+
+	Payload *join_msg = payload_create("SERVER: %s joined channel %s.", client->username, client->channel->name);
+	broadcast(join_msg, client->channel);
+	payload_unref(join_msg);
+
+	return 1;
+}
+
+
+/*
+	Removes client from its worker's clients array.
+	The last client in the array is moved
+	to the vacant position.
+	Mutex is used to prevent thread usage
+	inconsistencies.
+	Client must be freed outside this function.
+	Alters current_users value
+
+	Returns boolean whether or not the removal
+	was successful.
+*/
+int remove_client(Client *client){
+	Shard *shard = client->shard;
+	
+	int i = client->slot;
+	if (i < 0 || i >= shard->current_users || shard->clients[i] != client){
+		warn_log("remove_client: Client not found.");
+		return 0;
+	}
+
+	shard->current_users--;
+	shard->clients[i] = shard->clients[shard->current_users];
+	shard->clients[i]->slot = i;
+	shard->clients[shard->current_users] = NULL;	/* Small safety feature */
+	client->slot = -1;
+
+	pthread_mutex_lock(&clients_lock);
+
+	name_table_remove(clients_by_name, client->username);
+	current_users--;
+	debug_log("remove_client: Current users: %d", current_users);
+
+	/* A saved session keeps the nickname taken */
+	int kept = name_table_get(sessions_by_name, client->username) != NULL;
+
+	pthread_mutex_unlock(&clients_lock);
+
+	link_event(kept ? LINK_PART " %s" : LINK_QUIT " %s", client->username);
+
+	return 1;
+}
+
+
+/* NOTE: only removes the clients of the calling worker */
+void disconnect_clients(){
+	char CLOSE_MSG[] = "SERVER: Closing server. Terminating connection.";
+	send_to_clients(CLOSE_MSG, NULL);
+	char QUIT_MSG[] = "SERVER: /quit";
+	send_to_clients(QUIT_MSG, NULL);
+
+	while (current_shard->current_users > 0){
+		remove_client(current_shard->clients[0]);
+	}
+}
+
+
+void handle_interrupt(int sig){
+	if (current_users > 0){
+		printf("\nCan't terminate because users are still connected\n");
+	} else exit(0);
+}
+
+
+/*
+	Creates a client owned by the current worker,
+	with temporary username "user_<id>" and NULL
+	channel. Returns NULL if there are already
+	max_users connections.
+*/
+Client *client_create(Socket *socket){
+
+	int64_t id;
+	pthread_mutex_lock(&clients_lock);
+	Client *client = (Client *)slab_alloc(client_slab, &id);
+	if (client != NULL) client->shard = current_shard;		/* Other workers look it up */
+	pthread_mutex_unlock(&clients_lock);
+
+	if (client == NULL) return NULL;
+
+	client->id = id;
+	client->socket = socket;
+	client->channel = NULL;
+	client->state = AWAITING_NICKNAME;
+	client->dropped = 0;
+	client->slot = -1;
+	client->member_slot = -1;
+	client->token[0] = '\0';
+	client->last_seq = 0;
+	client->throttled = 0;
+
+	uint64_t now = metrics_now();
+	token_bucket_init(&(client->chat_budget), config.chat_rate, config.chat_burst, now);
+	token_bucket_init(&(client->command_budget), config.command_rate, config.command_burst, now);
+	frame_reader_init(&(client->reader));
+	out_queue_init(&(client->out), config.high_water);
+	default_name(client);
+
+	return client;
+}
+
+
+void client_free(Client *client){
+	out_queue_clear(&(client->out));
+	socket_free(client->socket);
+
+	pthread_mutex_lock(&clients_lock);
+	slab_release(client_slab, client->id);
+	pthread_mutex_unlock(&clients_lock);
+}
+
+
+/*
+	Adds client to the last available position
+	in its worker's clients array. Mutex is used to
+	prevent thread usage inconsistencies.
+	Alters current_users value
+
+	Returns boolean whether or not the insertion
+	was successful.
+*/
+int add_client(Client *client){
+	pthread_mutex_lock(&clients_lock);
+	int added = register_client(client);
+	pthread_mutex_unlock(&clients_lock);
+
+	if (added) add_to_shard(client);
+	return added;
+}
+
+
+/*
+	The part of add_client done under clients_lock:
+	indexes the client by its name and counts it in.
+
+	Returns 0 if the server is full, and 1 otherwise.
+
+	NOTE: the caller must hold clients_lock.
+*/
+int register_client(Client *client){
+
+	if (current_users >= config.max_users){
+		warn_log("add_client: did not add user. Max users online.");
+		return 0;
+	}
+
+	/* Another worker may have taken the name since it was checked */
+	if (name_taken(client->username) || !name_table_put(clients_by_name, client->username, client)){
+		default_name(client);
+		name_table_put(clients_by_name, client->username, client);
+	}
+
+	current_users++;
+	debug_log("add_client: Current users: %d", current_users);
+
+	return 1;
+}
+
+
+/* The rest of add_client: tells linked servers, and seats the client in its worker */
+void add_to_shard(Client *client){
+
+	link_event(LINK_USER " %s", client->username);
+
+	Shard *shard = client->shard;
+	shard->clients = reserve(shard->clients, &(shard->clients_capacity),\
+							 shard->current_users + 1, sizeof(Client *));
+	client->slot = shard->current_users;
+	shard->clients[shard->current_users++] = client;
+}
+
+
+/*
+	Returns whether a connected user, a session
+	waiting to be resumed or a user of a linked
+	server has the name.
+
+	NOTE: the caller must hold clients_lock.
+*/
+int name_taken(const char *name){
+	return name_table_get(clients_by_name, name) != NULL || name_table_get(sessions_by_name, name) != NULL ||\
+		   remote_name_owner(name) >= 0;
+}
+
+
+/*
+	Gives the client its default nickname, "user_<id>".
+	Ids are only unique within a server, so linked
+	servers add their own id, after a '@' that chosen
+	nicknames can't have.
+*/
+void default_name(Client *client){
+	if (linking) sprintf(client->username, "user_%ld@%d", (long)client->id, config.server_id);
+	else sprintf(client->username, "user_%ld", (long)client->id);
+}
+
+
+/*
+	Given a username, return whether
+	it is unique among the connected users.
+*/
+int unique_name(char *name){
+	pthread_mutex_lock(&clients_lock);
+	int is_unique = !name_taken(name);
+	pthread_mutex_unlock(&clients_lock);
+
+	return is_unique;
+}
+
+
+int is_admin(Client *client, Channel *channel){
+	if (channel == NULL || client == NULL) return 0;
+	return client->id == channel->admin;
+}
+
+
+/* Given a username, return its ID, or -1 if it doesn't exist */
+int64_t get_id(char *username){
+	pthread_mutex_lock(&clients_lock);
+	Client *client = (Client *)name_table_get(clients_by_name, username);
+	int64_t id = client != NULL ? client->id : -1;
+	pthread_mutex_unlock(&clients_lock);
+
+	return id;
+}
+
+
+/* NOTE: the caller must hold clients_lock */
+int is_connected(int64_t id){
+	return slab_get(client_slab, id) != NULL;
+}
+
+
+/*
+	Ids are never reused, so the mute and invite lists
+	of a channel keep those of users who disconnected
+	(no later user can match them). Once a list reaches
+	its bound, they are dropped to make room.
+
+	NOTE: the caller must hold the channel's lock.
+*/
+int prune_ids(IdSet *ids){
+	pthread_mutex_lock(&clients_lock);
+	int removed = id_set_prune(ids, is_connected);
+	pthread_mutex_unlock(&clients_lock);
+
+	return removed;
+}
+
+
+int is_invited(Channel *channel, int64_t id){
+	return id_set_contains(&(channel->allowed_users), id);
+}
+
+
+int is_muted(int64_t client_id, Channel *channel){
+	return id_set_contains(&(channel->muted_users), client_id);
+}
+
+
+/* Given an id, return its client, or NULL if it is no longer connected */
+Client *get_client(int64_t id){
+	pthread_mutex_lock(&clients_lock);
+	Client *client = (Client *)slab_get(client_slab, id);
+	pthread_mutex_unlock(&clients_lock);
+
+	return client;
+}
+
+
+/*
+	Returns the worker that owns the client with
+	the given id, or NULL if there is no such client.
+	Only that worker may use the client itself.
+*/
+Shard *get_shard(int64_t id){
+	pthread_mutex_lock(&clients_lock);
+	Client *client = (Client *)slab_get(client_slab, id);
+	Shard *shard = client != NULL ? client->shard : NULL;
+	pthread_mutex_unlock(&clients_lock);
+
+	return shard;
+}
+
+
+/* Set channel mode to either private (mode = '+'') or public (mode = '-') */
+void set_public(Channel *channel, char mode){
+	channel->private = (mode == '+') ? 1 : 0;
+}
+
+
+int invite_command(Client *client, char *arg, int arg_len){
+
+	if (!is_admin(client, client->channel)){
+		char not_admin_msg[] = "SERVER: Only admins can use this command.";
+		client_send(client, not_admin_msg);
+		return INVITE;
+	}
+
+	if (arg_len == 0){
+		char bad_syntax[] = "SERVER: Incorrect syntax. Usage is /invite <username>";
+		client_send(client, bad_syntax);
+		return INVITE;
+	}
+
+	int64_t invited_user_id = get_id(arg);
+	if (invited_user_id == -1){
+		char bad_username[] = "SERVER: Could not find user.";
+		client_send(client, bad_username);
+		return INVITE;
+	}
+
+	Channel *channel = client->channel;
+	pthread_mutex_lock(&(channel->lock));
+
+	if (!channel->private){
+		pthread_mutex_unlock(&(channel->lock));
+		char bad_mode[] = "SERVER: Command unavailable to public channels.";
+		client_send(client, bad_mode);
+		return INVITE;
+	}
+
+	if (is_invited(channel, invited_user_id)){
+		pthread_mutex_unlock(&(channel->lock));
+		char bad_username[] = "SERVER: User is already invited.";
+		client_send(client, bad_username);
+		return INVITE;
+	}
+
+	if (id_set_size(&(channel->allowed_users)) >= config.max_users && prune_ids(&(channel->allowed_users)) == 0){
+		pthread_mutex_unlock(&(channel->lock));
+		char full_list[] = "SERVER: Invite list is full.";
+		client_send(client, full_list);
+		return INVITE;
+	}
+
+	id_set_add(&(channel->allowed_users), invited_user_id);
+
+	pthread_mutex_unlock(&(channel->lock));
+
+	Payload *invite_msg = payload_create("SERVER: %s has invited you to channel %s. Join with /join %s.",\
+										 client->username, client->channel->name, client->channel->name);
+	send_to_id(invited_user_id, invite_msg);
+	payload_unref(invite_msg);
+
+	return INVITE;
+}
+
+
+int mode_command(Client *client, char *arg, int arg_len){
+
+	if (!is_admin(client, client->channel)){
+		char not_admin_msg[] = "SERVER: Only admins can use this command.";
+		client_send(client, not_admin_msg);
+		return MODE;
+	}
+
+	/* Modes are the argument's first word */
+	int modes_len = 0;
+	while (modes_len < arg_len && arg[modes_len] != ' ' && arg[modes_len] != '\t') modes_len++;
+
+	if (modes_len == 0 || (arg[0] != '+' && arg[0] != '-')){
+		char bad_syntax[] = "SERVER: Incorrect syntax. Try /mode (+|-)<modes>";
+		client_send(client, bad_syntax);
+		return MODE;
+	}
+
+	pthread_mutex_lock(&(client->channel->lock));
+
+	int i;
+	for (i = 1; i < modes_len; i++){
+		switch (arg[i]){
+			case 'i':
+			set_public(client->channel, arg[0]);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&(client->channel->lock));
+
+
+	return MODE;
+}
+
+
+int whois_command(Client *client, char *arg, int arg_len){
+
+	if (!is_admin(client, client->channel)){
+		char not_admin_msg[] = "SERVER: Only admins can use this command.";
+		client_send(client, not_admin_msg);
+		return WHOIS;
+	}
+
+	if (arg_len == 0){
+		char bad_syntax[] = "SERVER: Incorrect syntax. Try /whois <user_name>";
+		client_send(client, bad_syntax);
+		return WHOIS;
+	}
+
+	char ip[65], msg[WHOLE_MSG_LEN];
+
+	/* Another worker may own the user: it can't quit or rename while the lock is held */
+	pthread_mutex_lock(&clients_lock);
+	Client *whois_client = (Client *)name_table_get(clients_by_name, arg);
+
+	if (whois_client != NULL){
+		socket_ip(whois_client->socket, ip);
+		sprintf(msg, "SERVER: %s IP is %s", whois_client->username, ip);
+	}
+
+	pthread_mutex_unlock(&clients_lock);
+
+	if (whois_client == NULL){
+		char bad_username[] = "SERVER: Could not find user.";
+		client_send(client, bad_username);
+		return WHOIS;
+	}
+
+	client_send(client, msg);
+
+	return WHOIS;
+}
+
+
+int kick_command(Client *client, char *arg, int arg_len){
+
+	if (!is_admin(client, client->channel)){
+		char not_admin_msg[] = "SERVER: Only admins can use this command.";
+		client_send(client, not_admin_msg);
+		return KICK;
+	}
+
+	if (arg_len == 0){
+		char bad_syntax[] = "SERVER: Incorrect syntax. Try /kick <user_name>";
+		client_send(client, bad_syntax);
+		return KICK;
+	}
+
+	int64_t kicked_client_id = get_id(arg);
+	if (kicked_client_id == -1){
+		char bad_username[] = "SERVER: Could not find user.";
+		client_send(client, bad_username);
+		return KICK;
+	}
+
+	
+	/* Only the worker that owns the kicked client can move it */
+	Shard *shard = get_shard(kicked_client_id);
+
+	if (shard == current_shard){
+		kick_client(get_client(kicked_client_id), client->channel->handle, client->id);
+	} else if (shard != NULL){
+		Mail *mail = mail_create(KICK_MAIL);
+		mail->client = kicked_client_id;
+		mail->channel = client->channel->handle;
+		mail->sender = client->id;
+		post_mail(shard, mail, NULL);
+	} else {
+		char bad_username[] = "SERVER: Could not find user.";
+		client_send(client, bad_username);
+	}
+	
+	return KICK;
+}
+
+
+/*
+	Sends kicked back to the lobby, if it is still on
+	the channel with the given handle. Otherwise, tells
+	the kicker that it isn't.
+
+	NOTE: must run on the worker that owns kicked.
+*/
+void kick_client(Client *kicked, int64_t channel_handle, int64_t kicker_id){
+
+	if (kicked != NULL && kicked->state == CHATTING && kicked->channel->handle == channel_handle){
+		join_channel("lobby", kicked);
+
+		char kicked_msg[] = "SERVER: You have been kicked from the channel. Returning to lobby.";
+		client_send(kicked, kicked_msg);
+	} else {
+		Payload *not_in_channel = payload_create("SERVER: User is not in channel.");
+		send_to_id(kicker_id, not_in_channel);
+		payload_unref(not_in_channel);
+	}
+}
+
+
+int unmute_command(Client *client, char *arg, int arg_len){
+
+	if (!is_admin(client, client->channel)){
+		char not_admin_msg[] = "SERVER: Only admins can use this command.";
+		client_send(client, not_admin_msg);
+		return UNMUTE;
+	}
+
+	if (arg_len == 0){
+		char bad_syntax[] = "SERVER: Incorrect syntax. Try /unmute <user_name>";
+		client_send(client, bad_syntax);
+		return UNMUTE;
+	}
+
+	int64_t muted_client_id = get_id(arg);
+	Channel *channel = client->channel;
+	pthread_mutex_lock(&(channel->lock));
+
+	if (muted_client_id == -1 || !is_muted(muted_client_id, channel)){
+		pthread_mutex_unlock(&(channel->lock));
+		char bad_username[] = "SERVER: Could not find user or user is already unmuted.";
+		client_send(client, bad_username);
+		return UNMUTE;
+	}
+
+	/* Removing client from muted list */
+	id_set_remove(&(channel->muted_users), muted_client_id);
+
+	pthread_mutex_unlock(&(channel->lock));
+
+	return UNMUTE;
+}
+
+
+int mute_command(Client *client, char *arg, int arg_len){
+
+	if (!is_admin(client, client->channel)){
+		char not_admin_msg[] = "SERVER: Only admins can use this command.";
+		client_send(client, not_admin_msg);
+		return MUTE;
+	}
+
+	if (arg_len == 0){
+		char bad_syntax[] = "SERVER: Incorrect syntax. Try /mute <user_name>";
+		client_send(client, bad_syntax);
+		return MUTE;
+	}
+
+	int64_t muted_client_id = get_id(arg);
+	Channel *channel = client->channel;
+	pthread_mutex_lock(&(channel->lock));
+
+	if (muted_client_id == -1 || is_muted(muted_client_id, channel)){
+		pthread_mutex_unlock(&(channel->lock));
+		char bad_username[] = "SERVER: Could not find user or user is already muted.";
+		client_send(client, bad_username);
+		return MUTE;		
+	}
+
+	if (id_set_size(&(channel->muted_users)) >= config.max_users && prune_ids(&(channel->muted_users)) == 0){
+		pthread_mutex_unlock(&(channel->lock));
+		char full_list[] = "SERVER: Mute list is full.";
+		client_send(client, full_list);
+		return MUTE;
+	}
+
+	/* Adding client to muted list */
+	id_set_add(&(channel->muted_users), muted_client_id);
+	pthread_mutex_unlock(&(channel->lock));
+
+	return MUTE;
+}
+
+
+int join_command(Client *client, char *arg, int arg_len){
+
+	if (arg_len == 0){
+		char bad_syntax[] = "SERVER: Incorrect syntax. Try /join <channel_name>";
+		client_send(client, bad_syntax);
+		return JOIN;
+	}
+
+	if (arg_len >= MAX_CHANNEL_LEN){
+		char too_long[] = "SERVER: Channel name is too long.";
+		client_send(client, too_long);
+		return JOIN;
+	}
+
+	debug_log("Attempting to join channel %s...", arg);
+
+	join_channel(arg, client);
+
+	return JOIN;
+}
+
+
+int quit_command(Client *client, char *arg, int arg_len){
+
+	const char QUIT_MSG[] = "SERVER: /quit";
+
+	/* Sends quit command to client */
+	client_send(client, QUIT_MSG);
+
+	debug_log("User disconnected correctly.");
+	Payload *msg = payload_create("SERVER: %s disconnected.", client->username);
+	broadcast(msg, client->channel);
+	payload_unref(msg);
+	leave_channel(client, 1);
+
+	return QUIT;
+}
+
+
+int ping_command(Client *client, char *arg, int arg_len){
+
+	const char PING_MSG[] = "SERVER: pong";
+
+	if (client_send(client, PING_MSG) < 0)
+		debug_log("interpret_command: could not ping back user %s", client->username);
+	else
+		debug_log("interpret_command: successfully pinged user %s", client->username);
+
+	return PING;
+}
+
+
+int rename_command(Client *client, char *arg, int arg_len){
+
+	if (arg_len == 0){
+		char msg[] = "SERVER: Rename syntax is not correct. Usage is: /nickname <new name>";
+		client_send(client, msg);
+		return RENAME;
+	}
+
+	/* This message gets overwritten if the rename is successful */
+	char RENAME_MSG[MAX_MSG_LEN + 64] = "SERVER: Failed to rename. Make sure your name does not exceed the maximum character limit, contain special symbols and is unique.";
+
+	char new_name[MAX_NAME_LEN + 1], old_name[MAX_NAME_LEN + 1];
+
+	int is_valid = parse_name(arg, new_name);
+
+	if (is_valid){
+		/* Checked under the lock, since another worker may be taking the name */
+		pthread_mutex_lock(&clients_lock);
+		is_valid = !name_taken(new_name);
+
+		if (is_valid){
+			sprintf(RENAME_MSG, "SERVER: User %s renamed to %s", client->username, new_name);
+
+			/* The index points at the username itself, so it must be re-keyed */
+			strcpy(old_name, client->username);
+			name_table_remove(clients_by_name, client->username);
+			strncpy(client->username, new_name, MAX_NAME_LEN + 1);
+			name_table_put(clients_by_name, client->username, client);
+		}
+
+		pthread_mutex_unlock(&clients_lock);
+	}
+
+	if (!is_valid){
+		client_send(client, RENAME_MSG);
+		return RENAME;
+	}
+
+	link_event(LINK_NICK " %s %s", old_name, client->username);
+	send_to_clients(RENAME_MSG, NULL);
+
+	return RENAME;
+}
+
+
+int invalid_command(Client *client){
+	char help_msg[] = "SERVER: Invalid command. Available commands are:\n\t> /ping\n\t> /nickname <new name>\n\t> /join <channel name>\n\t> /mute <user>\n\t> /unmute <user>\n\t> /kick <user>\n\t> /whois <user>\n\t/mode (+|-)<modes>\n\t/invite <user>\n\t/stats\n\t> /quit\n";
+	client_send(client, help_msg);
+	return NO_CMD;
+}
+
+
+/* Sums up every worker's metrics into total */
+void collect_metrics(Metrics *total){
+	memset(total, 0, sizeof(Metrics));
+
+	int i;
+	for (i = 0; i < n_shards; i++)
+		metrics_merge(total, &(shards[i].metrics));
+}
+
+
+/* Returns the number of connected users and channels, for the gauges */
+void count_users_and_channels(int *users, int *n_channels){
+	pthread_mutex_lock(&clients_lock);
+	*users = current_users;
+	pthread_mutex_unlock(&clients_lock);
+
+	pthread_rwlock_rdlock(&channels_lock);
+	*n_channels = name_table_size(channels);
+	pthread_rwlock_unlock(&channels_lock);
+}
+
+
+int stats_command(Client *client, char *arg, int arg_len){
+
+	if (!is_admin(client, client->channel)){
+		char not_admin_msg[] = "SERVER: Only admins can use this command.";
+		client_send(client, not_admin_msg);
+		return STATS;
+	}
+
+	Metrics total;
+	collect_metrics(&total);
+
+	int users, n_channels;
+	count_users_and_channels(&users, &n_channels);
+
+	Histogram *fanouts = total.histograms + FANOUT_SIZE;
+	Histogram *depths = total.histograms + QUEUE_DEPTH;
+	Histogram *latencies = total.histograms + DELIVERY_LATENCY;
+
+	char msg[MAX_MSG_LEN];
+	sprintf(msg, "SERVER: Stats\n\t> %d users, %d channels, %d workers"\
+			"\n\t> in: %lu messages, %lu bytes\n\t> out: %lu messages, %lu bytes, %lu send retries"\
+			"\n\t> disconnects: %lu quit, %lu lost, %lu dropped"\
+			"\n\t> slow consumers: %lu disconnected, %lu trimmed (%lu messages dropped)"\
+			"\n\t> fanout p50/p99: %lu/%lu\n\t> queue depth p50/p99: %lu/%lu"\
+			"\n\t> delivery latency p50/p99/p999: %lu/%lu/%lu us",
+			users, n_channels, n_shards,
+			(unsigned long)total.counters[MESSAGES_IN], (unsigned long)total.counters[BYTES_IN],
+			(unsigned long)total.counters[MESSAGES_OUT], (unsigned long)total.counters[BYTES_OUT],
+			(unsigned long)total.counters[SEND_RETRIES], (unsigned long)total.counters[QUITS],
+			(unsigned long)total.counters[CONNECTIONS_LOST], (unsigned long)total.counters[CLIENTS_DROPPED],
+			(unsigned long)total.counters[SLOW_DISCONNECTED], (unsigned long)total.counters[SLOW_TRIMMED],
+			(unsigned long)total.counters[SLOW_MESSAGES_DROPPED],
+			(unsigned long)histogram_percentile(fanouts, 0.5), (unsigned long)histogram_percentile(fanouts, 0.99),
+			(unsigned long)histogram_percentile(depths, 0.5), (unsigned long)histogram_percentile(depths, 0.99),
+			(unsigned long)histogram_percentile(latencies, 0.5), (unsigned long)histogram_percentile(latencies, 0.99),
+			(unsigned long)histogram_percentile(latencies, 0.999));
+
+	client_send(client, msg);
+
+	return STATS;
+}
+
+
+/* Command handlers, each in the slot COMMAND_HASH gives its name */
+static const Command COMMAND_TABLE[COMMAND_SLOTS] = {
+	{ NULL, 0, NULL },
+	{ QUIT_CMD, sizeof(QUIT_CMD) - 1, quit_command },	/* 1 */
+	{ PING_CMD, sizeof(PING_CMD) - 1, ping_command },	/* 2 */
+	{ NULL, 0, NULL },
+	{ JOIN_CMD, sizeof(JOIN_CMD) - 1, join_command },	/* 4 */
+	{ MUTE_CMD, sizeof(MUTE_CMD) - 1, mute_command },	/* 5 */
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ STATS_CMD, sizeof(STATS_CMD) - 1, stats_command },	/* 13 */
+	{ NULL, 0, NULL },
+	{ UNMUTE_CMD, sizeof(UNMUTE_CMD) - 1, unmute_command },	/* 15 */
+	{ NULL, 0, NULL },
+	{ WHOIS_CMD, sizeof(WHOIS_CMD) - 1, whois_command },	/* 17 */
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ RENAME_CMD, sizeof(RENAME_CMD) - 1, rename_command },	/* 20 */
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ MODE_CMD, sizeof(MODE_CMD) - 1, mode_command },	/* 25 */
+	{ NULL, 0, NULL },
+	{ INVITE_CMD, sizeof(INVITE_CMD) - 1, invite_command },	/* 27 */
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ KICK_CMD, sizeof(KICK_CMD) - 1, kick_command }		/* 31 */
+};
+
+
+/*
+	Splits a command message in place: the name runs
+	up to the first blank, and the argument from the
+	next non-blank up to the end of the line, less
+	any trailing blanks.
+*/
+void tokenize_command(char *buffer, CommandLine *line){
+
+	char *c = buffer;
+	while (*c != '\0' && *c != ' ' && *c != '\t' && *c != '\n') c++;
+	line->name = buffer;
+	line->name_len = c - buffer;
+
+	while (*c == ' ' || *c == '\t') c++;
+	line->arg = c;
+
+	while (*c != '\0' && *c != '\n') c++;
+	while (c > line->arg && (c[-1] == ' ' || c[-1] == '\t')) c--;
+	*c = '\0';
+	line->arg_len = c - line->arg;
+}
+
+
+/*
+	Function that interprets all available
+	commands, given a tokenized command line.
+	The name must match a command exactly,
+	e.g. /joinfoo is not /join.
+
+	returns an integer indicating which command
+	was interpreted.
+*/
+int interpret_command(Client *client, CommandLine *line){
+
+	if (line->name_len >= 3){
+		const Command *command = &COMMAND_TABLE[COMMAND_HASH(line->name, line->name_len)];
+
+		if (command->name_len == line->name_len && !memcmp(command->name, line->name, line->name_len))
+			return command->handler(client, line->arg, line->arg_len);
+	}
+
+	return invalid_command(client);
+}
+
+
+/*
+	Returns the sequence number of the last message
+	of its channel the client was fully sent: the one
+	before the oldest still (even partly) in its queue.
+	Those of channels it left are passed over.
+*/
+uint64_t delivered_cursor(Client *client){
+	OutQueue *out = &(client->out);
+
+	int i;
+	for (i = 0; i < out->count; i++){
+		Payload *pending = out->entries[(out->head + i) % out->capacity];
+		if (pending->seq != 0 && pending->seq >> CHANNEL_SEQ_SHIFT == client->incarnation)
+			return pending->seq - 1;
+	}
+
+	return client->last_seq;
+}
+
+
+/* Fills the client's token with random hex digits and sends it */
+void issue_token(Client *client){
+	unsigned char bytes[RESUME_TOKEN_LEN/2];
+
+	if (getrandom(bytes, sizeof(bytes), 0) != sizeof(bytes)){
+		warn_log("issue_token: Could not generate a token for %s", client->username);
+		client->token[0] = '\0';
+		return;
+	}
+
+	int i;
+	for (i = 0; i < sizeof(bytes); i++)
+		sprintf(client->token + 2*i, "%02x", bytes[i]);
+
+	Payload *token_msg = payload_create("SERVER: Your resume token is %s", client->token);
+	client_send_payload(client, token_msg);
+	payload_unref(token_msg);
+}
+
+
+/*
+	Keeps what the lost client needs to resume, and
+	its nickname taken, for the grace period.
+
+	Returns 1 on success and 0 if sessions are off,
+	the client has no token or there are already
+	max_users sessions.
+
+	NOTE: this function uses clients_lock.
+*/
+int save_session(Client *client){
+	if (config.resume_grace <= 0 || client->token[0] == '\0') return 0;
+
+	Session *session = (Session *)malloc(sizeof(Session));
+	if (session == NULL) return 0;
+
+	strcpy(session->token, client->token);
+	strcpy(session->username, client->username);
+	strncpy(session->channel, client->channel->name, MAX_CHANNEL_LEN);
+	session->cursor = delivered_cursor(client);
+	session->expires = metrics_now() + (uint64_t)config.resume_grace*1000000;
+	session->next = NULL;
+
+	pthread_mutex_lock(&clients_lock);
+	session->prev = sessions_tail;
+
+	int saved = n_sessions < config.max_users && name_table_put(sessions_by_token, session->token, session);
+	if (saved){
+		/* The client still holds the name, so nobody else could have taken it */
+		name_table_put(sessions_by_name, session->username, session);
+
+		if (sessions_tail != NULL) sessions_tail->next = session;
+		else sessions_head = session;
+		sessions_tail = session;
+		n_sessions++;
+	}
+
+	pthread_mutex_unlock(&clients_lock);
+
+	if (!saved) free(session);
+	return saved;
+}
+
+
+/*
+	Unlinks session from the list and both indexes.
+
+	NOTE: the caller must hold clients_lock.
+*/
+void unlink_session(Session *session){
+	name_table_remove(sessions_by_token, session->token);
+	name_table_remove(sessions_by_name, session->username);
+
+	if (session->prev != NULL) session->prev->next = session->next;
+	else sessions_head = session->next;
+
+	if (session->next != NULL) session->next->prev = session->prev;
+	else sessions_tail = session->prev;
+
+	n_sessions--;
+}
+
+
+/*
+	Tells everyone that the users whose sessions
+	expired are gone, as if they had just been lost,
+	and frees the sessions. Runs on the first worker.
+
+	NOTE: this function uses clients_lock, channels_lock
+		  and the channels' locks.
+*/
+void expire_sessions(void){
+	uint64_t now = metrics_now();
+	Session *expired = NULL;
+
+	/* Sessions expire in the order they were saved */
+	pthread_mutex_lock(&clients_lock);
+	while (sessions_head != NULL && sessions_head->expires <= now){
+		Session *session = sessions_head;
+		unlink_session(session);
+		session->next = expired;
+		expired = session;
+	}
+	pthread_mutex_unlock(&clients_lock);
+
+	while (expired != NULL){
+		Session *session = expired;
+		expired = session->next;
+
+		pthread_rwlock_rdlock(&channels_lock);
+		Channel *channel = find_channel(session->channel);
+		if (channel != NULL){
+			Payload *leave_msg = payload_create("SERVER: %s left the channel.", session->username);
+			broadcast(leave_msg, channel);
+			payload_unref(leave_msg);
+		}
+		pthread_rwlock_unlock(&channels_lock);
+
+		link_event(LINK_QUIT " %s", session->username);
+
+		Payload *msg = payload_create("SERVER: %s disconnected.", session->username);
+		broadcast(msg, NULL);
+		payload_unref(msg);
+
+		free(session);
+	}
+}
+
+
+/* Runs when the sweep timer fires */
+void sweep_timer_fired(Shard *shard){
+	uint64_t expirations;
+	if (read(shard->sweep_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		warn_log("sweep_timer_fired: Could not read timer");
+
+	expire_sessions();
+}
+
+
+/*
+	Gives the client, which sent "/resume <token>"
+	instead of a nickname, back the nickname and
+	channel of the session with that token, along
+	with the messages it missed, in one burst and
+	without telling anyone.
+
+	Returns 0 if there is no such session (it may
+	have expired), and 1 otherwise.
+
+	NOTE: this function uses clients_lock, channels_lock
+		  and the channel's lock.
+*/
+int resume_session(Client *client, char *token){
+
+	pthread_mutex_lock(&clients_lock);
+	Session *session = (Session *)name_table_get(sessions_by_token, token);
+	int full = session != NULL && current_users >= config.max_users;
+
+	/* In one hold of the lock, so that nobody can claim the name the session held */
+	if (session != NULL && !full){
+		unlink_session(session);
+		strncpy(client->username, session->username, MAX_NAME_LEN + 1);
+		register_client(client);
+	}
+
+	pthread_mutex_unlock(&clients_lock);
+
+	if (session == NULL) return 0;
+
+	if (full){
+		/* The session stays, to be resumed later within the grace period */
+		warn_log("resume_session: did not resume user. Max users online.");
+		char full_msg[] = "SERVER: Server is full. Try again later.";
+		client_send(client, full_msg);
+		client->state = QUITTING;
+		return 1;
+	}
+
+	add_to_shard(client);
+	client->state = CHATTING;
+
+	int slot;
+	Channel *channel = add_to_channel(session->channel, client, &slot, session->cursor);
+	if (channel != NULL){
+		client->channel = channel;
+		client->member_slot = slot;
+		link_event(LINK_JOIN " %s %s", client->username, channel->name);
+	} else {
+		join_channel(lobby->name, client);	/* E.g. it became invite-only meanwhile */
+	}
+
+	Payload *resumed_msg = payload_create("SERVER: Session resumed. Welcome back, %s.", client->username);
+	client_send_payload(client, resumed_msg);
+	payload_unref(resumed_msg);
+
+	debug_log("resume_session: %s resumed on channel %s", client->username, client->channel->name);
+	free(session);
+
+	/* Tokens are good for one resume only */
+	issue_token(client);
+
+	return 1;
+}
+
+
+/*
+	Handles the nickname handshake, which is the
+	first message sent by every client. If the
+	nickname starts with ':' the client did not
+	choose one, so it keeps the default "user_<id>".
+*/
+void greet_client(Client *client, char *nickname){
+
+	if (!strncmp(nickname, RESUME_CMD " ", sizeof(RESUME_CMD))){
+		if (resume_session(client, nickname + sizeof(RESUME_CMD))) return;
+
+		char expired_msg[] = "SERVER: Could not resume the session. It may have expired.";
+		client_send(client, expired_msg);
+		nickname[0] = ':';	/* Goes on with the default nickname */
+	}
+
+	nickname[MAX_NAME_LEN] = '\0';
+
+	/* Checked like a rename: links split on blanks, and default names have '@' */
+	char name[MAX_NAME_LEN + 1];
+
+	if (nickname[0] != ':'){
+		if (!parse_name(nickname, name)){
+			char invalid[MAX_MSG_LEN];
+			sprintf(invalid, "SERVER: the username %s is not valid. Assigning default nickname %s (try /nickname)", nickname, client->username);
+			client_send(client, invalid);
+		} else if (unique_name(name)){
+			strncpy(client->username, name, MAX_NAME_LEN + 1);
+		} else {
+			char not_unique[MAX_MSG_LEN];
+			sprintf(not_unique, "SERVER: the username %s is already taken. Assigning default nickname %s (try /nickname)", nickname, client->username);
+			client_send(client, not_unique);
+		}
+	}
+
+	if (!add_client(client)){
+		char full_msg[] = "SERVER: Server is full. Try again later.";
+		client_send(client, full_msg);
+		client->state = QUITTING;
+		return;
+	}
+
+	client->state = CHATTING;
+	join_channel("lobby", client);
+
+	char ip[64];
+	socket_ip(client->socket, ip);
+
+	Payload *welcome_msg = payload_create("SERVER: %s connected to chat!", client->username);
+	broadcast(welcome_msg, NULL);
+	payload_unref(welcome_msg);
+
+	char HELP_MSG[] = "SERVER: Type /help to see available commands.";
+	client_send(client, HELP_MSG);
+
+	if (config.resume_grace > 0) issue_token(client);
+}
+
+
+/*
+	Drops a message the client sent over its budget,
+	or its channel's, telling it so once for each run
+	of dropped messages.
+*/
+void throttle(Client *client, int counter, Payload *notice){
+	metrics_count(counter, 1);
+
+	if (!client->throttled){
+		client->throttled = 1;
+		client_send_payload(client, notice);
+	}
+}
+
+
+/*
+	Interprets a single message sent by the
+	client while chatting: either a command
+	or a regular message to its channel.
+	Either is dropped if it goes over budget,
+	before anything is formatted or fanned out.
+*/
+void chat(Client *client, char *buffer){
+
+	/* When the message was read: the clock isn't read again */
+	uint64_t now = client->shard->received;
+
+	if (buffer[0] == '/'){
+		CommandLine line;
+		tokenize_command(buffer, &line);
+
+		/* Quitting is never throttled, but only /quit itself is quitting */
+		int quitting = line.name_len == sizeof(QUIT_CMD) - 1 && !memcmp(line.name, QUIT_CMD, line.name_len);
+
+		if (!quitting && !token_bucket_take(&(client->command_budget), now)){
+			throttle(client, COMMANDS_THROTTLED, flood_notice);
+			return;
+		}
+
+		client->throttled = 0;
+		if (interpret_command(client, &line) == QUIT){
+			metrics_count(QUITS, 1);
+			remove_client(client);
+			client->state = QUITTING;
+		}
+
+	} else if (!token_bucket_take(&(client->chat_budget), now)){
+		throttle(client, CHAT_THROTTLED, flood_notice);
+
+	} else {
+		/* Send regular message */
+		Channel *channel = client->channel;
+		pthread_mutex_lock(&(channel->lock));
+
+		int muted = is_muted(client->id, channel);
+		int within_budget = muted || token_bucket_take(&(channel->budget), now);
+
+		if (!muted && within_budget){
+			/* Formatted once, shared by every member's queue */
+			Payload *msg = payload_create("%s: (@%s) %s", client->username, channel->name, buffer);
+			msg->received = client->shard->received;
+			msg->seq = ++channel->seq;
+			fanout(msg, channel);
+			history_push(&(channel->history), msg);
+			journal_append(msg);
+			payload_unref(msg);
+		}
+
+		pthread_mutex_unlock(&(channel->lock));
+
+		if (muted)
+			client_send(client, "SERVER: You are currently muted on this channel.");
+		else if (!within_budget)
+			throttle(client, CHANNEL_THROTTLED, busy_notice);
+		else
+			client->throttled = 0;
+	}
+}
+
+
+/*
+	Advances the client's state machine with
+	one complete message.
+*/
+void handle_message(Client *client, char *buffer){
+	switch (client->state){
+		case AWAITING_NICKNAME:
+		greet_client(client, buffer);
+		break;
+
+		case CHATTING:
+		chat(client, buffer);
+		break;
+	}
+}
+
+
+/*
+	Cleans up after a client whose connection
+	dropped without a quit command.
+*/
+void connection_lost(Client *client){
+
+	if (client->state == AWAITING_NICKNAME || client->state == CHATTING)
+		metrics_count(client->dropped ? CLIENTS_DROPPED : CONNECTIONS_LOST, 1);
+
+	/* With a session saved, nobody hears of it unless it expires */
+	if (client->state == CHATTING && save_session(client)){
+		debug_log("User %s disconnected unpredictably, keeping the session", client->username);
+		leave_channel(client, 0);
+		remove_client(client);
+	}
+
+	else if (client->state == CHATTING){
+		debug_log("User disconnected unpredictably!");
+		leave_channel(client, 1);
+		remove_client(client);
+
+		Payload *msg = payload_create("SERVER: %s disconnected.", client->username);
+		broadcast(msg, NULL);
+		payload_unref(msg);
+	}
+
+	client->state = DISCONNECTED;
+}
+
+
+/*
+	Stops watching the client's socket and
+	frees it. The client must already have
+	left its channel and the clients array.
+
+	With io_uring, the client is only freed
+	once its last request completes.
+*/
+void close_client(Client *client){
+
+	if (client->shard->ring == NULL){
+		epoll_ctl(client->shard->epoll_fd, EPOLL_CTL_DEL, client->socket->sockfd, NULL);
+		unflag_client(client);
+		client_free(client);
+		return;
+	}
+
+	/* Ends the pending recv (and send), if any */
+	client->closing = 1;
+	socket_shutdown(client->socket, SHUT_RDWR);
+	release_client(client);
+}
+
+
+/* Handles each complete message buffered in the client's reader */
+void handle_frames(Client *client){
+
+	int msg_len = FRAME_INCOMPLETE;
+	char buffer[MAX_MSG_LEN + 1];
+
+	/* Delivery latency is timed from here */
+	client->shard->received = metrics_now();
+
+	while ((client->state == AWAITING_NICKNAME || client->state == CHATTING) &&\
+		   (msg_len = frame_reader_next(&(client->reader), buffer, sizeof(buffer))) >= 0){
+		if (msg_len == 0) continue;		/* Empty messages are skipped, as socket_receive does */
+
+		metrics_count(MESSAGES_IN, 1);
+		metrics_count(BYTES_IN, FRAME_HEADER_LEN + msg_len);
+		handle_message(client, buffer);
+	}
+
+	if (msg_len == FRAME_TOO_LONG){
+		warn_log("handle_frames: Message from %s is too long.", client->username);
+		drop_client(client);
+		connection_lost(client);
+	}
+}
+
+
+/*
+	Flushes the client's pending messages, then
+	reads everything available on its socket (the
+	reactor is edge-triggered) and handles each
+	complete message in it.
+*/
+void handle_client_events(Client *client){
+
+	int received_bytes;
+
+	if (out_queue_flush(&(client->out), client->socket) < 0)
+		connection_lost(client);
+
+	while (client->state == AWAITING_NICKNAME || client->state == CHATTING){
+		received_bytes = frame_reader_fill(&(client->reader), client->socket);
+
+		if (received_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;		/* Drained, wait for the next edge */
+
+		if (received_bytes <= 0){
+			connection_lost(client);
+			break;
+		}
+
+		handle_frames(client);
+	}
+
+	/* Once a quitting client's last messages are out, it can go */
+	if (client->state == QUITTING && out_queue_flush(&(client->out), client->socket) != 0)
+		client->state = DISCONNECTED;
+
+	if (client->state == DISCONNECTED)
+		close_client(client);
+}
+
+
+/* Registers fd in the current worker's reactor. data is handed back with its events */
+void watch_fd(int fd, void *data){
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	event.data.ptr = data;
+
+	if (epoll_ctl(current_shard->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		exit_error("watch_fd: Could not watch file descriptor");
+}
+
+
+/* Registers socket in the current worker's reactor. data is handed back with its events */
+void watch_socket(Socket *socket, void *data){
+	watch_fd(socket->sockfd, data);
+}
+
+
+/*
+	Turns away a connection there is no client slot
+	for. The notice goes through an out queue like
+	any other frame, but it is flushed just once,
+	without blocking: a fresh socket's buffer takes
+	it whole, and a peer that can't is not waited on.
+*/
+void reject_connection(Socket *socket){
+
+	OutQueue out;
+	out_queue_init(&out, MAX_FRAME_LEN);
+
+	Payload *full_msg = payload_create("SERVER: Server is full. Try again later.");
+	out_queue_push(&out, full_msg);
+	payload_unref(full_msg);
+
+	if (socket_set_nonblocking(socket) >= 0)
+		out_queue_flush(&out, socket);
+
+	out_queue_clear(&out);
+	socket_free(socket);
+}
+
+
+/*
+	Accepts every pending connection on the
+	worker's (non-blocking) listening socket and
+	hands the new clients over to its reactor.
+*/
+void accept_clients(Shard *shard){
+
+	Client *current_client;
+	Socket *current_client_socket;
+
+	while ((current_client_socket = socket_try_accept(shard->listener)) != NULL){
+		current_client = client_create(current_client_socket);
+
+		if (current_client == NULL){
+			warn_log("accept_clients: did not accept user. Max users online.");
+			reject_connection(current_client_socket);
+			continue;
+		}
+
+		socket_set_nonblocking(current_client_socket);
+		watch_socket(current_client_socket, current_client);
+	}
+}
+
+
+/* Carries out mail posted by another worker, then frees it */
+void deliver_mail(Mail *mail){
+
+	Channel *channel;
+	Client *client;
+
+	switch (mail->type){
+		case CHANNEL_MAIL:
+		/* The channel may be gone by now: its handle is then stale */
+		pthread_rwlock_rdlock(&channels_lock);
+		channel = (Channel *)slab_get(channel_slab, mail->channel);
+
+		if (channel != NULL){
+			pthread_mutex_lock(&(channel->lock));
+			fanout_local(mail->payload, channel);
+			pthread_mutex_unlock(&(channel->lock));
+		}
+
+		pthread_rwlock_unlock(&channels_lock);
+		break;
+
+		case GLOBAL_MAIL:
+		broadcast_local(mail->payload);
+		break;
+
+		case DIRECT_MAIL:
+		if (get_shard(mail->client) == current_shard)
+			client_send_payload(get_client(mail->client), mail->payload);
+		break;
+
+		case KICK_MAIL:
+		client = get_shard(mail->client) == current_shard ? get_client(mail->client) : NULL;
+		kick_client(client, mail->channel, mail->sender);
+		break;
+
+		case YIELD_MAIL:
+		if (get_shard(mail->client) == current_shard)
+			yield_nickname(get_client(mail->client));
+		break;
+	}
+
+	if (mail->payload != NULL) payload_unref(mail->payload);
+	free(mail);
+}
+
+
+/* Takes all mail in the worker's mailbox */
+void read_mail(Shard *shard){
+
+	uint64_t posted;
+	if (read(shard->wake_fd, &posted, sizeof(posted)) < 0 && errno != EAGAIN)
+		warn_log("read_mail: Could not read wakeup");
+
+	/* Rearmed first: mail posted from now on wakes the worker up again */
+	mailbox_rearm(&(shard->mailbox));
+
+	MailNode *node;
+	while ((node = mailbox_take(&(shard->mailbox))) != NULL)
+		deliver_mail((Mail *)node);
+}
+
+
+/*
+	Event loop that owns every socket of a worker.
+	The listening socket is registered with NULL
+	data, the mailbox's eventfd with the worker
+	itself, the flush timer with its own fd, and
+	client sockets with their Client.
+*/
+void run_epoll_reactor(Shard *shard){
+
+	struct epoll_event events[MAX_EVENTS];
+	int i, n_events;
+
+	shard->epoll_fd = epoll_create1(0);
+	if (shard->epoll_fd < 0)
+		exit_error("run_reactor: Could not create epoll instance");
+
+	watch_socket(shard->listener, NULL);
+	watch_fd(shard->wake_fd, shard);
+	watch_fd(shard->flush_timer_fd, &(shard->flush_timer_fd));
+	if (shard->sweep_timer_fd >= 0) watch_fd(shard->sweep_timer_fd, &(shard->sweep_timer_fd));
+
+	while (1){
+		n_events = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, -1);
+
+		if (n_events < 0){
+			if (errno == EINTR) continue;
+			exit_error("run_reactor: Could not wait for events");
+		}
+
+		for (i = 0; i < n_events; i++){
+			if (events[i].data.ptr == NULL) accept_clients(shard);
+			else if (events[i].data.ptr == shard) read_mail(shard);
+			else if (events[i].data.ptr == &(shard->flush_timer_fd)) flush_window_passed(shard);
+			else if (events[i].data.ptr == &(shard->sweep_timer_fd)) sweep_timer_fired(shard);
+			else handle_client_events((Client *)events[i].data.ptr);
+		}
+
+		if (config.flush_policy == FLUSH_LOOP || shard->flush_due)
+			flush_clients(shard);
+	}
+}
+
+
+/* Arms a multishot recv on the client's socket */
+void start_receiving(Client *client){
+	ring_prep_recv(ring_get_sqe(client->shard->ring), client->socket->sockfd,\
+				   URING_BUFFER_GROUP, URING_USER_DATA(RECV_REQUEST, client));
+	client->receiving = 1;
+	client->requests++;
+}
+
+
+/*
+	Frees a closing client once it has no requests
+	in flight: their completions refer to it.
+*/
+void release_client(Client *client){
+
+	if (!client->closing || client->requests > 0) return;
+
+	unflag_client(client);
+	client_free(client);
+}
+
+
+/*
+	Moves the client along after one of its requests
+	completed: a quitting client goes once its last
+	messages are out, and a disconnected one is closed.
+*/
+void settle_client(Client *client){
+
+	if (client->state == QUITTING && client->out.count == 0 && !client->sending)
+		client->state = DISCONNECTED;
+
+	if (client->state == DISCONNECTED && !client->closing)
+		close_client(client);
+	else
+		release_client(client);
+}
+
+
+/*
+	Submits a gathering send of the client's pending
+	frames, unless one is in flight already: only one
+	at a time, so that frames stay in order.
+*/
+void submit_send(Client *client){
+
+	if (client->sending || client->closing || client->dropped) return;
+
+	int n_iov = out_queue_gather(&(client->out), client->send_iov, OUT_QUEUE_MAX_IOV);
+	if (n_iov == 0) return;
+
+	memset(&(client->send_msg), 0, sizeof(client->send_msg));
+	client->send_msg.msg_iov = client->send_iov;
+	client->send_msg.msg_iovlen = n_iov;
+
+	ring_prep_sendmsg(ring_get_sqe(client->shard->ring), client->socket->sockfd,\
+					  &(client->send_msg), URING_USER_DATA(SEND_REQUEST, client));
+	client->sending = 1;
+	client->requests++;
+}
+
+
+/*
+	Submits a send for every flagged client. They all
+	go to the kernel with a single syscall.
+*/
+void submit_sends(Shard *shard){
+
+	int i;
+	for (i = 0; i < shard->flushes; i++){
+		shard->to_flush[i]->flagged = 0;
+		submit_send(shard->to_flush[i]);
+	}
+
+	shard->flushes = 0;
+	shard->flush_due = 0;
+}
+
+
+/* Turns a connection accepted by io_uring into a client */
+void accept_connection(Shard *shard, int sockfd){
+
+	Socket *client_socket = socket_adopt(sockfd);
+	if (client_socket == NULL){
+		close(sockfd);
+		return;
+	}
+
+	Client *client = client_create(client_socket);
+
+	if (client == NULL){
+		warn_log("accept_connection: did not accept user. Max users online.");
+		reject_connection(client_socket);
+		return;
+	}
+
+	start_receiving(client);
+}
+
+
+/*
+	Handles data (or its end) received by a client's
+	multishot recv. The kernel picked the buffer, which
+	goes back to it once the data is handled.
+*/
+void handle_recv(Shard *shard, Client *client, struct io_uring_cqe *cqe){
+
+	int reading = client->state == AWAITING_NICKNAME || client->state == CHATTING;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER){
+		int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		char *data = ring_buffer(shard->ring, id);
+		int len = cqe->res;
+
+		while (len > 0 && (client->state == AWAITING_NICKNAME || client->state == CHATTING)){
+			int copied = frame_reader_feed(&(client->reader), data, len);
+			data += copied;
+			len -= copied;
+			handle_frames(client);
+		}
+
+		ring_recycle_buffer(shard->ring, id);
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)){
+		client->receiving = 0;
+		client->requests--;
+	}
 
-#define VALID_NAME_CHAR(c) (c != '<' && c != '>' && c != ':' && c != '@' && c != ' ' && c != '\n')
-#define VALID_CHANNEL_CHAR(c) (c != ' ' && c != ',' && c != 7)
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)){
+		if (reading) connection_lost(client);
+	}
 
+	/* Multishot recv ends if it runs out of buffers, for instance */
+	else if (!client->receiving && !client->closing)
+		start_receiving(client);
 
-pthread_mutex_t clients_lock;
-pthread_mutex_t channels_lock;
+	settle_client(client);
+}
 
-Client *clients[MAX_USERS];
-int current_users = 0;
 
-Channel *channels[MAX_CHANNELS];
-int current_channels = 0;
+/* Handles the completion of the client's send */
+void handle_send(Client *client, struct io_uring_cqe *cqe){
 
+	client->sending = 0;
+	client->requests--;
 
-struct client {
-    Socket *socket;
-    int id;
-    pthread_t thread;
-    char username[MAX_NAME_LEN + 1];
-    Channel *channel;
-};
+	if (client->dropped){
+		out_queue_clear(&(client->out));
+	} else if (cqe->res < 0){
+		drop_client(client);
+	} else {
+		int i, requested = 0;
+		for (i = 0; i < client->send_msg.msg_iovlen; i++)
+			requested += client->send_iov[i].iov_len;
+		if (cqe->res < requested) metrics_count(SEND_RETRIES, 1);
+
+		/* The rest was due already: it doesn't wait for another window */
+		out_queue_consume(&(client->out), cqe->res);
+		submit_send(client);
+	}
 
+	settle_client(client);
+}
 
-struct channel {
-    int muted_users[MAX_USERS];
-    int current_mutes;
 
-    int admin;
-    int current_users;
+/* Dispatches a completion to its handler, by request type */
+void handle_completion(Shard *shard, struct io_uring_cqe *cqe){
 
-    uint8_t private;	/* Boolean 	*/
-    int current_allowed;
-    int allowed_users[MAX_USERS];
+	Ring *ring = shard->ring;
 
-    Client *users[MAX_USERS];
-    char name[MAX_CHANNEL_LEN];
-};
+	switch (URING_TYPE(cqe->user_data)){
+		case ACCEPT_REQUEST:
+		if (cqe->res >= 0) accept_connection(shard, cqe->res);
+		else warn_log("handle_completion: Could not accept connection");
 
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			ring_prep_accept(ring_get_sqe(ring), shard->listener->sockfd,\
+							 URING_USER_DATA(ACCEPT_REQUEST, NULL));
+		break;
 
-enum COMMANDS {
-    QUIT, PING, RENAME, JOIN, KICK, MUTE, UNMUTE, WHOIS, MODE, INVITE, NO_CMD
-};
+		case WAKE_REQUEST:
+		read_mail(shard);
 
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			ring_prep_poll(ring_get_sqe(ring), shard->wake_fd, URING_USER_DATA(WAKE_REQUEST, NULL));
+		break;
 
+		case RECV_REQUEST:
+		handle_recv(shard, (Client *)URING_PTR(cqe->user_data), cqe);
+		break;
 
-/*
-	Creates an empty channel with the given name and admin.
-	Admin should only be NULL for the initial Lobby chat.
-	The channel is set by default to be public.
-*/
-Channel *channel_create(char name[MAX_CHANNEL_LEN], Client *admin){
+		case SEND_REQUEST:
+		handle_send((Client *)URING_PTR(cqe->user_data), cqe);
+		break;
 
-	Channel *c = (Channel *)malloc(sizeof(Channel));
+		case TIMER_REQUEST:
+		flush_window_passed(shard);
 
-	memset(c->muted_users, -1, sizeof(c->muted_users));
-	memset(c->users, 0, sizeof(c->users));
-	strncpy(c->name, name, MAX_CHANNEL_LEN);
-	
-	c->current_users = 0;
-	c->current_allowed = 1;
-	c->current_mutes = 0;
-	c->private = 0;
-	c->admin = (admin == NULL) ? LOBBY : admin->id;
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			ring_prep_poll(ring_get_sqe(ring), shard->flush_timer_fd, URING_USER_DATA(TIMER_REQUEST, NULL));
+		break;
 
-	if (admin != NULL) c->allowed_users[0] = admin->id;
+		case SWEEP_REQUEST:
+		sweep_timer_fired(shard);
 
-	return c;
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			ring_prep_poll(ring_get_sqe(ring), shard->sweep_timer_fd, URING_USER_DATA(SWEEP_REQUEST, NULL));
+		break;
+	}
 }
 
 
-/* Does not free the channel's users */
-void channel_free(Channel *c){
-	free(c);
+/*
+	Event loop of a worker running on io_uring:
+	multishot accept on the listening socket,
+	multishot polls on the mailbox's eventfd and
+	the flush timer, and a multishot recv per client,
+	all reading into buffers the kernel picks from
+	the worker's ring. Sends of every client are
+	batched into the one syscall that also waits
+	for completions.
+*/
+void run_uring_reactor(Shard *shard){
+
+	Ring *ring = shard->ring;
+	struct io_uring_cqe *cqe, done;
+
+	ring_prep_accept(ring_get_sqe(ring), shard->listener->sockfd, URING_USER_DATA(ACCEPT_REQUEST, NULL));
+	ring_prep_poll(ring_get_sqe(ring), shard->wake_fd, URING_USER_DATA(WAKE_REQUEST, NULL));
+	ring_prep_poll(ring_get_sqe(ring), shard->flush_timer_fd, URING_USER_DATA(TIMER_REQUEST, NULL));
+	if (shard->sweep_timer_fd >= 0)
+		ring_prep_poll(ring_get_sqe(ring), shard->sweep_timer_fd, URING_USER_DATA(SWEEP_REQUEST, NULL));
+
+	while (1){
+		/* Immediate can't be had here: it behaves like the end of the iteration */
+		if (config.flush_policy != FLUSH_WINDOW || shard->flush_due)
+			submit_sends(shard);
+
+		if (ring_submit(ring, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			exit_error("run_uring_reactor: Could not submit requests");
+
+		while ((cqe = ring_peek_cqe(ring)) != NULL){
+			/* Handlers may submit, so the entry is handed back first */
+			done = *cqe;
+			ring_cqe_seen(ring);
+			handle_completion(shard, &done);
+		}
+	}
 }
 
 
-Channel *find_channel(char channel_name[MAX_CHANNEL_LEN]){
-	int i;
-	for (i = 0; i < current_channels; i++){
-		if (!strcmp(channel_name, channels[i]->name)) return channels[i];
+/*
+	Runs the worker's event loop on io_uring if it
+	was asked for and the kernel supports it, and
+	on epoll otherwise.
+*/
+void run_reactor(Shard *shard){
+
+	current_shard = shard;
+	metrics_attach(&(shard->metrics));
+
+	/* A ring belongs to the thread that creates it */
+	if (config.backend == URING_BACKEND){
+		shard->ring = ring_create(URING_ENTRIES);
+
+		if (shard->ring != NULL &&\
+			ring_setup_buffers(shard->ring, URING_BUFFER_GROUP, URING_BUFFERS, URING_BUFFER_SIZE) < 0){
+			ring_free(shard->ring);
+			shard->ring = NULL;
+		}
+
+		if (shard->ring == NULL)
+			console_log("run_reactor: io_uring unsupported, worker %d falls back to epoll", shard->index);
 	}
 
+	if (shard->ring != NULL) run_uring_reactor(shard);
+	else run_epoll_reactor(shard);
+}
+
+
+void *reactor_thread(void *shard){
+	run_reactor((Shard *)shard);
 	return NULL;
 }
 
 
-int invalid_channel_name(char channel_name[MAX_CHANNEL_LEN]){
-	int i;
-	for (i = 0; i < strlen(channel_name); i++)
-		if (!VALID_CHANNEL_CHAR(channel_name[i])) return 1;
+/*
+	Sets up the index-th worker, with its own listening
+	socket and mailbox. Its reactor is not started.
+*/
+void shard_init(Shard *shard, int index){
+
+	shard->index = index;
+	shard->clients = NULL;
+	shard->current_users = 0;
+	shard->clients_capacity = 0;
+	shard->to_flush = NULL;
+	shard->flushes = 0;
+	shard->flush_capacity = 0;
+	shard->timer_armed = 0;
+	shard->flush_due = 0;
+	shard->ring = NULL;
+	mailbox_init(&(shard->mailbox));
+
+	shard->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (shard->wake_fd < 0)
+		exit_error("shard_init: Could not create eventfd");
+
+	shard->flush_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (shard->flush_timer_fd < 0)
+		exit_error("shard_init: Could not create flush timer");
+
+	/* One worker is enough to expire the sessions of all */
+	shard->sweep_timer_fd = -1;
+	if (index == 0 && config.resume_grace > 0){
+		struct itimerspec sweep = { { SESSION_SWEEP_INTERVAL, 0 }, { SESSION_SWEEP_INTERVAL, 0 } };
+
+		shard->sweep_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+		if (shard->sweep_timer_fd < 0 || timerfd_settime(shard->sweep_timer_fd, 0, &sweep, NULL) < 0)
+			exit_error("shard_init: Could not create session timer");
+	}
 
-	return 0;
+	shard->listener = socket_create();
+	if (n_shards > 1 && socket_set_reuseport(shard->listener) < 0)
+		exit_error("shard_init: Could not share the server port");
+
+	socket_bind(shard->listener, config.port, INADDR_ANY);
+	socket_listen(shard->listener);
+	socket_set_nonblocking(shard->listener);
 }
 
 
 /*
-	Sends msg to all clients on a channel.
-	To send to all clients regardles of channel,
-	set channel to NULL
+	Posts header (if any) and payload to the link
+	thread, to go over the link with the given index
+	or, with ALL_LINKS, over every link that is up.
 */
-void send_to_clients(char msg[], Channel *channel){
-	
-	int j, status, send_retries;
-	
-	if (channel == NULL){
-		for (j = 0; j < current_users; j++){
-
-			send_retries = 0;
-			status = socket_send(clients[j]->socket, msg, WHOLE_MSG_LEN);
-			
-			while (status < 0 && send_retries < MAX_RETRIES){
-				send_retries++;
-				console_log("chat_worker: Error sending message to client %s. Attempt %d", clients[j]->username, send_retries);
-				status = socket_send(clients[j]->socket, msg, WHOLE_MSG_LEN);
-			}
+void post_link_mail(int link, Payload *header, Payload *payload){
 
-			if (send_retries >= MAX_RETRIES){
-				console_log("chat_worker: Client %s unresponsive. Disconnecting.", clients[j]->username);
-				remove_client(clients[j]);
-			}
-		}
+	Mail *mail = mail_create(LINK_MAIL);
+	mail->link = link;
+	mail->header = header != NULL ? payload_ref(header) : NULL;
+	mail->payload = payload_ref(payload);
+
+	if (mailbox_post(&link_mailbox, &(mail->node))){
+		uint64_t wake = 1;
+		if (write(link_wake_fd, &wake, sizeof(wake)) < 0)
+			warn_log("post_link_mail: Could not wake up the link thread");
 	}
+}
 
-	else {
 
-		for (j = 0; j < channel->current_users; j++){
+/*
+	Tells every linked server about a change to the
+	users of this one: a link message, formatted as
+	in printf. Does nothing if there are no links.
+*/
+void link_event(const char *format, ...){
+	if (!linking) return;
 
-			int send_retries = 0;
-			status = socket_send(channel->users[j]->socket, msg, WHOLE_MSG_LEN);
-			
-			while (status < 0 && send_retries < MAX_RETRIES){
-				send_retries++;
-				console_log("chat_worker: Error sending message to client %s. Attempt %d", channel->users[j]->username, send_retries);
-				status = socket_send(channel->users[j]->socket, msg, WHOLE_MSG_LEN);
-			}
+	char event[WHOLE_MSG_LEN + 1];
+	va_list args;
 
-			if (send_retries >= MAX_RETRIES){
-				console_log("chat_worker: Client %s unresponsive. Disconnecting.", channel->users[j]->username);
-				
-				leave_channel(channel->users[j]);
-				remove_client(channel->users[j]);
-			}
-		}
+	va_start(args, format);
+	vsnprintf(event, sizeof(event), format, args);
+	va_end(args);
 
-	}
+	Payload *payload = payload_create("%s", event);
+	post_link_mail(ALL_LINKS, NULL, payload);
+	payload_unref(payload);
 }
 
 
 /*
-	Removes client from current channel.
-
-	If the client is the only one in the
-	channel, also deletes the channel from the
-	list (except for the lobby).
-	
-	Returns 0 on failure, 1 on success.
+	Has payload, which was fanned out to the channel's
+	members on this server, sent once to every linked
+	server where the channel has members too.
 
-	NOTE: this function uses channels_lock.
+	NOTE: the caller must hold the channel's lock.
 */
-int leave_channel(Client *client){
-	
-	pthread_mutex_lock(&channels_lock);
-	
-	Channel *current_channel = client->channel;
+void relay_to_channel(Payload *payload, Channel *channel){
+	if (!linking) return;
 
-	int i, j;
-	for (i = 0; i < current_channel->current_users; i++){
-		if (current_channel->users[i]->id == client->id){
-			for (j = i; j < current_channel->current_users - 1; j++){
-				current_channel->users[j] = current_channel->users[j + 1];
-			}
-		}
-	}
+	Payload *header = NULL;
+	int i;
 
-	current_channel->current_users--;
-	console_log("Channel %s has %d users", current_channel->name, current_channel->current_users);
-
-	char leave_msg[50 + MAX_NAME_LEN];
-	sprintf(leave_msg, "SERVER: %s left the channel.", client->username);
-
-	pthread_mutex_unlock(&channels_lock);
-	send_to_clients(leave_msg, client->channel);
-	pthread_mutex_lock(&channels_lock);
-
-	if (current_channel->current_users == 0 && strcmp(current_channel->name, "lobby")){
-		/* Remove channel from list */
-		console_log("Removing channel %s", current_channel->name);
-		for (i = 0; i < current_channels; i++){
-			if (!strcmp(current_channel->name, channels[i]->name)){
-				for (j = i; j < current_channels - 1; j++){
-					channels[j] = channels[j + 1];
-				}
-			}
-		}
+	pthread_rwlock_rdlock(&links_lock);
+
+	for (i = 0; i < n_links; i++){
+		if (name_table_get(links[i].channels, channel->name) == NULL) continue;
 
-		channel_free(current_channel);
-		current_channels--;
-		console_log("Current channels: %d", current_channels);
+		/* Channel messages (unlike notices) are numbered and kept on the other end too */
+		if (header == NULL)
+			header = payload_create("%s %s", payload->seq != 0 ? LINK_MSG : LINK_NOTICE, channel->name);
+		post_link_mail(i, header, payload);
 	}
 
-	pthread_mutex_unlock(&channels_lock);
-	return 1;
+	pthread_rwlock_unlock(&links_lock);
+
+	if (header != NULL) payload_unref(header);
 }
 
 
 /*
-	Adds client to the list of users of channel
-	with channel_name, leaving previous channel.
+	Returns the lowest id among the linked servers
+	with a user named name, or -1 if there is none.
 
-	If no channel with the name exists, it is created
-	and client becomes its admin. If the channel
-	name is invalid, does nothing.
+	NOTE: this function uses links_lock.
+*/
+int remote_name_owner(const char *name){
+	if (!linking) return -1;
 
-	Returns 0 on failure, 1 on success.
+	int owner = -1, i;
+
+	pthread_rwlock_rdlock(&links_lock);
+
+	for (i = 0; i < n_links; i++)
+		if ((owner < 0 || links[i].peer_id < owner) && name_table_get(links[i].users, name) != NULL)
+			owner = links[i].peer_id;
+
+	pthread_rwlock_unlock(&links_lock);
+
+	return owner;
+}
+
+
+/*
+	Gives the client its default nickname if a linked
+	server with a lower id has a user with the same
+	one: that server keeps it (see settle_clash).
+
+	NOTE: must run on the worker that owns client.
 */
-int join_channel(char channel_name[MAX_CHANNEL_LEN], Client *client){
+void yield_nickname(Client *client){
+	if (client == NULL || client->state != CHATTING) return;
 
-	if (invalid_channel_name(channel_name)) return 0;
+	char old_name[MAX_NAME_LEN + 1];
+	strcpy(old_name, client->username);
 
-	if (client->channel != NULL &&\
-		!strcmp(channel_name, client->channel->name)) return 0;
+	pthread_mutex_lock(&clients_lock);
 
-	pthread_mutex_lock(&channels_lock);
-	
-	/* Adding client to new channel, possibly creating it */
-	Channel *new_channel = find_channel(channel_name);
+	int owner = remote_name_owner(client->username);
+	int yields = owner >= 0 && owner < config.server_id;
 
-	if (new_channel == NULL){
-		new_channel = channel_create(channel_name, client);
-		channels[current_channels++] = new_channel;
+	if (yields){
+		name_table_remove(clients_by_name, client->username);
+		default_name(client);
+		name_table_put(clients_by_name, client->username, client);
 	}
 
-	/* If channel is private, must be invited to it */
-	if (new_channel->private && !is_invited(new_channel, client->id)){
-		pthread_mutex_unlock(&channels_lock);
+	pthread_mutex_unlock(&clients_lock);
 
-		char invite_msg[] = "SERVER: You are not invited to this channel";
-		socket_send(client->socket, invite_msg, MAX_MSG_LEN);
+	if (!yields) return;
 
-		return 0;
-	}
-	
-	new_channel->users[new_channel->current_users++] = client;
+	debug_log("yield_nickname: %s is taken on server %d, renamed to %s", old_name, owner, client->username);
+	link_event(LINK_NICK " %s %s", old_name, client->username);
 
-	pthread_mutex_unlock(&channels_lock);
+	/* The other servers have a user by the old name: only this one hears of it */
+	Payload *msg = payload_create("SERVER: User %s renamed to %s, a user of another server has that name.",\
+								  old_name, client->username);
+	broadcast_shards(msg);
+	payload_unref(msg);
+}
 
-	/* Remove client from current channel, deleting it if necessary */	
-	if (client->channel != NULL)
-		leave_channel(client);
 
-	client->channel = new_channel;
+/* Queues payload on the link, which is dropped if it fell too far behind */
+void send_on_link(Link *link, Payload *payload){
+	if (link->dropped) return;
 
-	char join_msg[50 + MAX_NAME_LEN + MAX_CHANNEL_LEN];
-	sprintf(join_msg, "SERVER: %s joined channel %s.", client->username, client->channel->name);
-	send_to_clients(join_msg, client->channel);
+	if (out_queue_push(&(link->out), payload) < 0){
+		warn_log("send_on_link: Link with server %d is too far behind. Dropping it.", link->peer_id);
+		link->dropped = 1;
 
-	return 1;
+		/* The link thread then sees it hang up, and closes it */
+		socket_shutdown(link->socket, SHUT_RDWR);
+	}
 }
 
 
-/*
-	Removes client from the clients array.
-	The array to the left of the removed
-	client is shifted to occupy the vacant
-	position.
-	Mutex is used to prevent thread usage
-	inconsistencies.
-	Client must be freed outside this function.
-	Alters current_users value
+/* Queues a link message, formatted as in printf, on the link */
+void link_printf(Link *link, const char *format, ...){
 
-	Returns boolean whether or not the insertion
-	was successful.
-*/
-int remove_client(Client *client){
-	pthread_mutex_lock(&clients_lock);
-	
+	char msg[WHOLE_MSG_LEN + 1];
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+
+	Payload *payload = payload_create("%s", msg);
+	send_on_link(link, payload);
+	payload_unref(payload);
+}
+
+
+/* Queues the mail's frames on its link, or on every link that is up */
+void relay_mail(Mail *mail){
 	int i;
-	for (i = 0; i < current_users; i++){
-		if (clients[i]->id == client->id) break;
-	}
+	for (i = 0; i < n_links; i++){
+		Link *link = links + i;
+		if (link->state != LINK_UP || (mail->link != ALL_LINKS && mail->link != i)) continue;
 
-	if (i >= current_users){
-		console_log("remove_client: Client not found.");
-		pthread_mutex_unlock(&clients_lock);
-		return 0;
+		if (mail->header != NULL) send_on_link(link, mail->header);
+		send_on_link(link, mail->payload);
 	}
+}
 
-	for (i = i; i < current_users - 1; i++){
-		clients[i] = clients[i + 1];
-	}
 
-	clients[current_users - 1] = NULL;	/* Small safety feature */
+/* Takes all mail in the link thread's mailbox */
+void read_link_mail(void){
 
-	current_users--;
-	console_log("remove_client: Current users: %d", current_users);
+	uint64_t posted;
+	if (read(link_wake_fd, &posted, sizeof(posted)) < 0 && errno != EAGAIN)
+		warn_log("read_link_mail: Could not read wakeup");
 
-	pthread_mutex_unlock(&clients_lock);
+	mailbox_rearm(&link_mailbox);
 
-	return 1;
+	MailNode *node;
+	while ((node = mailbox_take(&link_mailbox)) != NULL){
+		Mail *mail = (Mail *)node;
+		relay_mail(mail);
+
+		if (mail->header != NULL) payload_unref(mail->header);
+		payload_unref(mail->payload);
+		free(mail);
+	}
 }
 
 
-void disconnect_clients(){
-	char CLOSE_MSG[] = "SERVER: Closing server. Terminating connection.";
-	send_to_clients(CLOSE_MSG, NULL);
-	char QUIT_MSG[] = "SERVER: /quit";
-	send_to_clients(QUIT_MSG, NULL);
+/*
+	Moves a user of the link's server to the channel
+	named channel_name (to none if it is empty),
+	keeping count of the channel's members there.
+
+	NOTE: the caller must hold links_lock for writing.
+*/
+void move_remote_user(Link *link, RemoteUser *user, const char *channel_name){
+
+	RemoteChannel *channel;
+
+	if (user->channel[0] != '\0'){
+		channel = (RemoteChannel *)name_table_get(link->channels, user->channel);
+
+		/* Only channels with members are kept: they are the ones relayed to */
+		if (channel != NULL && --channel->members == 0){
+			name_table_remove(link->channels, channel->name);
+			free(channel);
+		}
+	}
 
-	while (current_users > 0){
-		remove_client(clients[0]);
+	strncpy(user->channel, channel_name, MAX_CHANNEL_LEN - 1);
+	if (user->channel[0] == '\0') return;
+
+	channel = (RemoteChannel *)name_table_get(link->channels, user->channel);
+	if (channel == NULL){
+		channel = (RemoteChannel *)calloc(1, sizeof(RemoteChannel));
+		if (channel == NULL)
+			exit_error("move_remote_user: Could not allocate channel");
+
+		strcpy(channel->name, user->channel);
+		name_table_put(link->channels, channel->name, channel);
 	}
+
+	channel->members++;
 }
 
 
-void handle_interrupt(int sig){
-	if (current_users > 0){
-		printf("\nCan't terminate because users are still connected\n");
-	} else exit(0);
+/*
+	Forgets a user of the link's server.
+
+	NOTE: the caller must hold links_lock for writing.
+*/
+void remove_remote_user(Link *link, RemoteUser *user){
+	move_remote_user(link, user, "");
+	name_table_remove(link->users, user->username);
+	free(user);
 }
 
 
-/* Creates a client with temporary username "user_<id>" and NULL channel */
-Client *client_create(int id, Socket *socket){
-	Client *client = (Client *)malloc(sizeof(Client));
+/*
+	Settles a clash between the name the link's server
+	just gave one of its users and a local user or lost
+	session with the same name, if there is one: the
+	server with the lower id keeps the name. If that is
+	the other one, the local user is renamed by its
+	worker and the session is given up.
+
+	NOTE: this function uses clients_lock.
+*/
+void settle_clash(Link *link, const char *name){
 
-	client->id = id;
-	client->socket = socket;
-	client->channel = NULL;
-	sprintf(client->username, "user_%d", id);
+	/* Otherwise the other end does the same, and yields */
+	if (config.server_id < link->peer_id) return;
 
-	return client;
-}
+	pthread_mutex_lock(&clients_lock);
 
+	Client *client = (Client *)name_table_get(clients_by_name, name);
+	Shard *shard = client != NULL ? client->shard : NULL;
+	int64_t id = client != NULL ? client->id : NO_HANDLE;
 
-void client_free(Client *client){
-	socket_free(client->socket);
-	free(client);
+	Session *session = (Session *)name_table_get(sessions_by_name, name);
+	if (session != NULL) unlink_session(session);
+
+	pthread_mutex_unlock(&clients_lock);
+
+	if (shard != NULL){
+		Mail *mail = mail_create(YIELD_MAIL);
+		mail->client = id;
+		post_mail(shard, mail, NULL);
+	}
+
+	if (session != NULL){
+		debug_log("settle_clash: Giving up the session of %s, taken on server %d", name, link->peer_id);
+		link_event(LINK_QUIT " %s", session->username);
+		free(session);
+	}
 }
 
 
 /*
-	Adds client to the last available position
-	in the clients array. Mutex is used to
-	prevent thread usage inconsistencies.
-	Alters current_users value
+	Records a new user of the link's server, or its
+	new name, unless the link knows the name already.
+	Returns the user, or NULL if the name was known.
 
-	Returns boolean whether or not the insertion
-	was successful.
+	NOTE: the caller must hold links_lock for writing.
 */
-int add_client(Client *client){
-	pthread_mutex_lock(&clients_lock);
+RemoteUser *add_remote_user(Link *link, const char *name, RemoteUser *user){
 
-	if (current_users >= MAX_USERS){
-		console_log("add_client: did not add user. Max users online.");
-		pthread_mutex_unlock(&clients_lock);
-		return 0;
+	if (name_table_get(link->users, name) != NULL) return NULL;
+
+	if (user == NULL){
+		user = (RemoteUser *)calloc(1, sizeof(RemoteUser));
+		if (user == NULL)
+			exit_error("add_remote_user: Could not allocate user");
 	}
-	
-	clients[current_users++] = client;
-	console_log("add_client: Current users: %d", current_users);
 
-	pthread_mutex_unlock(&clients_lock);
+	strncpy(user->username, name, MAX_NAME_LEN);
+	name_table_put(link->users, user->username, user);
 
-	return 1;
+	return user;
 }
 
 
 /*
-	Given a username, return whether
-	it is unique among the connected users.
+	Delivers a message relayed over the link to the
+	users of this server: to the members of its
+	channel, or to everyone.
 */
-int unique_name(char *name){
+void deliver_relay(Link *link, char *msg){
 
-	int i;
-	for (i = 0; i < current_users; i++)
-		if (!strcmp(name, clients[i]->username)) return 0;
+	Payload *payload = payload_create("%s", msg);
+	payload->received = metrics_now();
 
-	return 1;
+	if (link->relaying == RELAY_ALL){
+		broadcast_shards(payload);
+	} else {
+		pthread_rwlock_rdlock(&channels_lock);
+		Channel *channel = find_channel(link->relay_channel);
+
+		if (channel != NULL){
+			pthread_mutex_lock(&(channel->lock));
+
+			if (link->relaying == RELAY_MESSAGE)
+				payload->seq = ++channel->seq;
+			fanout_shards(payload, channel);
+
+			/* Kept and recorded like local chat */
+			if (link->relaying == RELAY_MESSAGE){
+				history_push(&(channel->history), payload);
+				journal_append(payload);
+			}
+
+			pthread_mutex_unlock(&(channel->lock));
+		}
+
+		pthread_rwlock_unlock(&channels_lock);
+	}
+
+	payload_unref(payload);
 }
 
 
 /*
-	Given a rename command, writes the
-	parsed name to name and returns 1.
-	If the chosen name is invalid, returns
-	0 and name is altered.
-	
-	The contents of the name buffer are
-	unpredictable if 0 is returned.
+	Tells the server at the other end of a new link
+	about every local user: its name, and its channel
+	if it is in one. Changes made meanwhile follow,
+	through the link thread's mailbox.
 
-	The name buffer should have at least
-	MAX_NAME_LEN + 1 bytes.
+	NOTE: this function uses clients_lock, channels_lock
+		  and every channel's lock.
 */
-int parse_name(char *buffer, char *name){
+void send_burst(Link *link){
 
-	buffer += strlen(RENAME_CMD) + 1;	/* Skips rename command */
-	memset(name, 0, (MAX_NAME_LEN + 1)*sizeof(char));
+	Client *client;
+	Session *session;
+	Channel *channel;
+	int position = 0, i, j;
 
-	int i;
-	for (i = 0; i <= MAX_NAME_LEN; i++){
-		if (VALID_NAME_CHAR(buffer[i])) name[i] = buffer[i];
-		else return 0;
-		if (name[i] == '\0') break;
+	pthread_mutex_lock(&clients_lock);
+
+	while ((client = (Client *)name_table_next(clients_by_name, &position)) != NULL)
+		link_printf(link, LINK_USER " %s", client->username);
+
+	/* Their names are taken too */
+	position = 0;
+	while ((session = (Session *)name_table_next(sessions_by_name, &position)) != NULL)
+		link_printf(link, LINK_USER " %s", session->username);
+
+	pthread_mutex_unlock(&clients_lock);
+
+	pthread_rwlock_rdlock(&channels_lock);
+
+	position = 0;
+	while ((channel = (Channel *)name_table_next(channels, &position)) != NULL){
+		pthread_mutex_lock(&(channel->lock));
+		pthread_mutex_lock(&clients_lock);	/* Members may be renamed meanwhile */
+
+		for (i = 0; i < n_shards; i++)
+			for (j = 0; j < channel->members[i].count; j++)
+				link_printf(link, LINK_JOIN " %s %s", channel->members[i].users[j]->username, channel->name);
+
+		pthread_mutex_unlock(&clients_lock);
+		pthread_mutex_unlock(&(channel->lock));
 	}
 
-	return i <= MAX_NAME_LEN;	/* If name is smaller than max, return 1. 0 otherwise */
+	pthread_rwlock_unlock(&channels_lock);
 }
 
 
-int is_admin(Client *client, Channel *channel){
-	if (channel == NULL || client == NULL) return 0;
-	return client->id == channel->admin;
+/* Returns the link that is up with the server of the given id, or NULL */
+Link *find_link(int peer_id){
+
+	int i;
+	for (i = 0; i < n_links; i++)
+		if (links[i].state == LINK_UP && links[i].peer_id == peer_id) return links + i;
+
+	return NULL;
 }
 
 
-/* Given a username, return its ID, or -1 if it doesn't exist */
-int get_id(char *username){
-	int i;
-	for (i = 0; i < current_users; i++){
-		Client *current_client = clients[i];
-		if (!strcmp(current_client->username, username))
-			return current_client->id;
+/*
+	Completes the link once the server at the other
+	end says hello, unless it has this server's id,
+	and sends it the burst.
+
+	Two servers that list each other both open a link.
+	Both ends keep the one opened by the lower id (the
+	one up already, if the same server opened both),
+	and the other isn't reopened while it stands.
+*/
+void accept_peer(Link *link, int peer_id){
+
+	if (peer_id == config.server_id || peer_id < 0){
+		warn_log("accept_peer: Server at the other end has id %d. Each needs an id of its own (-i).", peer_id);
+		close_link(link);
+		return;
 	}
 
-	return -1;
-}
+	Link *twin = find_link(peer_id);
+	if (twin != NULL){
+		int opener = link->peer != NULL ? config.server_id : peer_id;
+		int twin_opener = twin->peer != NULL ? config.server_id : peer_id;
+		Link *closed = twin_opener <= opener ? link : twin;
 
+		debug_log("accept_peer: Linked twice with server %d. Keeping the link opened by server %d.",\
+					peer_id, closed == link ? twin_opener : opener);
+		close_link(closed);
+		closed->yielded_to = peer_id;
 
-int is_invited(Channel *channel, int id){
-	int i;
-	for (i = 0; i < channel->current_allowed; i++)
-		if (channel->allowed_users[i] == id) return 1;
+		if (closed == link) return;
+	}
 
-	return 0;
+	pthread_rwlock_wrlock(&links_lock);
+	link->peer_id = peer_id;
+	link->state = LINK_UP;
+	link->yielded_to = -1;
+	pthread_rwlock_unlock(&links_lock);
+
+	console_log("Linked with server %d", peer_id);
+	send_burst(link);
 }
 
 
-int is_muted(int client_id, Channel *channel){
-	int i;
-	for (i = 0; i < channel->current_mutes; i++)
-		if (channel->muted_users[i] == client_id) return 1;
+/*
+	Returns 1 if the secret given in a hello is the
+	link secret, taking the same time wherever they
+	differ, so that it can't be guessed byte by byte.
+*/
+int secret_matches(const char *given){
+	size_t len = strlen(link_secret), given_len = strlen(given);
+	unsigned char differ = given_len != len;
+
+	size_t i;
+	for (i = 0; i < len; i++)
+		differ |= link_secret[i] ^ (i < given_len ? given[i] : 0);
 
-	return 0;
+	return !differ;
 }
 
 
-Client *get_client(int id){
-	int i;
-	for (i = 0; i < current_users; i++){
-		Client *current_client = clients[i];
-		if (current_client->id == id) return current_client;
-	}
+/* Splits word off at its first blank, returning what follows it ("" if nothing) */
+char *split_word(char *word){
+	char *rest = strchr(word, ' ');
+	if (rest == NULL) return word + strlen(word);
 
-	return NULL;
+	*rest = '\0';
+	return rest + 1;
 }
 
 
-/* Set channel mode to either private (mode = '+'') or public (mode = '-') */
-void set_public(Channel *channel, char mode){
-	channel->private = (mode == '+') ? 1 : 0;
-}
+/*
+	Acts on a message from the server at the other
+	end of the link: its hello, a relay verb, the
+	message relayed, or a change to its users.
+*/
+void handle_link_message(Link *link, char *msg){
 
+	if (link->relaying != RELAY_NONE){
+		deliver_relay(link, msg);
+		link->relaying = RELAY_NONE;
+		return;
+	}
 
-int invite_command(Client *client, char *buffer){
+	/* A verb, then up to two words */
+	char *first = split_word(msg);
+	char *second = split_word(first);
 
-	if (!is_admin(client, client->channel)){
-		char not_admin_msg[] = "SERVER: Only admins can use this command.";
-		socket_send(client->socket, not_admin_msg, MAX_MSG_LEN);
-		return INVITE;
+	if (link->state == LINK_HANDSHAKE){
+		if (!strcmp(msg, LINK_SERVER) && first[0] != '\0' && secret_matches(second)){
+			accept_peer(link, atoi(first));
+		} else {
+			warn_log("handle_link_message: Server at the other end of a link failed the handshake. Closing it.");
+			close_link(link);
+		}
+		return;
 	}
 
-	if (!client->channel->private){
-		char bad_mode[] = "SERVER: Command unavailable to public channels.";
-		socket_send(client->socket, bad_mode, MAX_MSG_LEN);
-		return INVITE;
+	if (!strcmp(msg, LINK_MSG) || !strcmp(msg, LINK_NOTICE) || !strcmp(msg, LINK_ALL)){
+		link->relaying = !strcmp(msg, LINK_MSG) ? RELAY_MESSAGE : !strcmp(msg, LINK_NOTICE) ? RELAY_NOTICE : RELAY_ALL;
+		strncpy(link->relay_channel, first, MAX_CHANNEL_LEN - 1);
+		return;
 	}
 
-	char invited_user[MAX_NAME_LEN];
-	int status = sscanf(buffer, "%*s %[^\n]%*c", invited_user);
+	char *clash = NULL;		/* A name the other end just took */
 
-	if (status != 1){
-		char bad_syntax[] = "SERVER: Incorrect syntax. Usage is /invite <username>";
-		socket_send(client->socket, bad_syntax, MAX_MSG_LEN);
-		return INVITE;
+	pthread_rwlock_wrlock(&links_lock);
+	RemoteUser *user = (RemoteUser *)name_table_get(link->users, first);
+
+	if (!strcmp(msg, LINK_USER)){
+		if (add_remote_user(link, first, NULL) != NULL) clash = first;
 	}
 
-	int invited_user_id = get_id(invited_user);
-	if (invited_user_id == -1){
-		char bad_username[] = "SERVER: Could not find user.";
-		socket_send(client->socket, bad_username, MAX_MSG_LEN);
-		return INVITE;
+	else if (user == NULL){
+		debug_log("handle_link_message: Server %d has no user %s", link->peer_id, first);
 	}
 
-	if (is_invited(client->channel, invited_user_id)){
-		char bad_username[] = "SERVER: User is already invited.";
-		socket_send(client->socket, bad_username, MAX_MSG_LEN);
-		return INVITE;
+	else if (!strcmp(msg, LINK_NICK)){
+		/* The table points at the username itself, so it must be re-keyed */
+		name_table_remove(link->users, user->username);
+		if (add_remote_user(link, second, user) != NULL){
+			clash = second;
+		} else {
+			move_remote_user(link, user, "");
+			free(user);
+		}
 	}
 
-	client->channel->allowed_users[client->channel->current_allowed++] = invited_user_id;
+	else if (!strcmp(msg, LINK_JOIN)) move_remote_user(link, user, second);
+	else if (!strcmp(msg, LINK_PART)) move_remote_user(link, user, "");
+	else if (!strcmp(msg, LINK_QUIT)) remove_remote_user(link, user);
 
-	Client *invited_client = get_client(invited_user_id);
-	if (invited_client != NULL){
-		char invite_msg[MAX_NAME_LEN + 2*MAX_CHANNEL_LEN + 64];
-		sprintf(invite_msg, "SERVER: %s has invited you to channel %s. Join with /join %s.",\
-			client->username, client->channel->name, client->channel->name);
-		
-		socket_send(invited_client->socket, invite_msg, MAX_NAME_LEN + MAX_CHANNEL_LEN + 64);
-	}
+	pthread_rwlock_unlock(&links_lock);
 
-	return INVITE;
+	if (clash != NULL) settle_clash(link, clash);
 }
 
 
-int mode_command(Client *client, char *buffer){
+/*
+	Reads everything available on the link and acts
+	on each complete message in it. A link whose other
+	end hung up or sent too long a frame is closed.
+*/
+void read_link(Link *link){
 
-	if (!is_admin(client, client->channel)){
-		char not_admin_msg[] = "SERVER: Only admins can use this command.";
-		socket_send(client->socket, not_admin_msg, MAX_MSG_LEN);
-		return MODE;
-	}
+	char msg[WHOLE_MSG_LEN + 1];
+	int received_bytes, msg_len = FRAME_INCOMPLETE;
 
-	char modes[MAX_MSG_LEN] = "";
-	int status = sscanf(buffer, "%*s %s", modes);
+	while (link->state == LINK_HANDSHAKE || link->state == LINK_UP){
+		received_bytes = frame_reader_fill(&(link->reader), link->socket);
 
-	if (status == 0 || (modes[0] != '+' && modes[0] != '-')){
-		char bad_syntax[] = "SERVER: Incorrect syntax. Try /mode (+|-)<modes>";
-		socket_send(client->socket, bad_syntax, MAX_MSG_LEN);
-		return MODE;
-	}
+		if (received_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
 
-	int i;
-	for (i = 1; i < strlen(modes); i++){
-		switch (modes[i]){
-			case 'i':
-			set_public(client->channel, modes[0]);
+		if (received_bytes <= 0){
+			close_link(link);
 			break;
 		}
-	}
 
+		while ((link->state == LINK_HANDSHAKE || link->state == LINK_UP) &&\
+			   (msg_len = frame_reader_next(&(link->reader), msg, sizeof(msg))) >= 0)
+			handle_link_message(link, msg);
 
-	return MODE;
+		if (msg_len == FRAME_TOO_LONG){
+			warn_log("read_link: Message from server %d is too long.", link->peer_id);
+			close_link(link);
+		}
+	}
 }
 
 
-int whois_command(Client *client, char *buffer){
+/*
+	Closes the link and forgets the users of the server
+	at the other end, telling local users they are gone.
+	Links this server opened are reopened after a while.
+*/
+void close_link(Link *link){
 
-	if (!is_admin(client, client->channel)){
-		char not_admin_msg[] = "SERVER: Only admins can use this command.";
-		socket_send(client->socket, not_admin_msg, MAX_MSG_LEN);
-		return WHOIS;
-	}
+	if (link->state == LINK_UP)
+		console_log("Lost link with server %d", link->peer_id);
 
-	char whois_name[MAX_NAME_LEN];
-	int status = sscanf(buffer, "%*s %[^\n]%*c", whois_name);
+	pthread_rwlock_wrlock(&links_lock);
 
-	if (status != 1){
-		char bad_syntax[] = "SERVER: Incorrect syntax. Try /whois <user_name>";
-		socket_send(client->socket, bad_syntax, MAX_MSG_LEN);
-		return WHOIS;
-	}
+	NameTable *users = link->users, *remote_channels = link->channels;
+	link->users = name_table_create(0);
+	link->channels = name_table_create(0);
+	link->state = LINK_DOWN;
+	link->peer_id = -1;
 
-	int whois_client_id = get_id(whois_name);
-	if (whois_client_id == -1){
-		char bad_username[] = "SERVER: Could not find user.";
-		socket_send(client->socket, bad_username, MAX_MSG_LEN);
-		return WHOIS;
-	}
+	pthread_rwlock_unlock(&links_lock);
 
-	char ip[65], msg[WHOLE_MSG_LEN];
-	Client *whois_client = get_client(whois_client_id);
-	
-	if (whois_client != NULL){
-		socket_ip(whois_client->socket, ip);
+	RemoteUser *user;
+	RemoteChannel *channel;
+	int position = 0;
 
-		sprintf(msg, "SERVER: %s IP is %s", whois_client->username, ip);
-		socket_send(client->socket, msg, WHOLE_MSG_LEN);
+	while ((user = (RemoteUser *)name_table_next(users, &position)) != NULL){
+		Payload *msg = payload_create("SERVER: %s disconnected.", user->username);
+		broadcast_shards(msg);
+		payload_unref(msg);
+		free(user);
 	}
 
-	return WHOIS;
+	position = 0;
+	while ((channel = (RemoteChannel *)name_table_next(remote_channels, &position)) != NULL)
+		free(channel);
+
+	name_table_free(users);
+	name_table_free(remote_channels);
+
+	if (link->socket != NULL) socket_free(link->socket);
+	else if (link->fd >= 0) close(link->fd);
+
+	link->socket = NULL;
+	link->fd = -1;
+	link->dropped = 0;
+	link->relaying = RELAY_NONE;
+	frame_reader_init(&(link->reader));
+	out_queue_clear(&(link->out));
+	out_queue_init(&(link->out), LINK_QUEUED_BYTES);
+
+	link->retry_at = metrics_now() + LINK_RETRY_INTERVAL*1000000;
 }
 
 
-int kick_command(Client *client, char *buffer){
+/* Takes over the link's connected socket, fd, and says hello to the other end */
+void start_link(Link *link, int fd){
 
-	if (!is_admin(client, client->channel)){
-		char not_admin_msg[] = "SERVER: Only admins can use this command.";
-		socket_send(client->socket, not_admin_msg, MAX_MSG_LEN);
-		return KICK;
+	link->fd = fd;
+	link->socket = socket_adopt(fd);
+
+	if (link->socket == NULL){
+		close_link(link);
+		return;
 	}
 
-	char kicked_name[MAX_NAME_LEN];
-	int status = sscanf(buffer, "%*s %[^\n]%*c", kicked_name);
+	link->state = LINK_HANDSHAKE;
+	link_printf(link, LINK_SERVER " %d %s", config.server_id, link_secret);
+}
 
-	if (status != 1){
-		char bad_syntax[] = "SERVER: Incorrect syntax. Try /kick <user_name>";
-		socket_send(client->socket, bad_syntax, MAX_MSG_LEN);
-		return KICK;
-	}
 
-	int kicked_client_id = get_id(kicked_name);
-	if (kicked_client_id == -1){
-		char bad_username[] = "SERVER: Could not find user.";
-		socket_send(client->socket, bad_username, MAX_MSG_LEN);
-		return KICK;
+/* Starts connecting to the link's peer, without waiting for it */
+void open_link(Link *link){
+
+	char ip[64];
+	int port;
+	sscanf(link->peer, "%63[^:]:%d", ip, &port);
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = inet_addr(ip);
+	address.sin_port = htons(port);
+
+	link->retry_at = metrics_now() + LINK_RETRY_INTERVAL*1000000;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0){
+		warn_log("open_link: Could not create socket");
+		return;
 	}
 
-	
-	pthread_mutex_lock(&channels_lock);
-	Channel *channel = client->channel;
-	int i;
-	for (i = 0; i < channel->current_users && channel->users[i]->id != kicked_client_id; i++);
-	pthread_mutex_unlock(&channels_lock);
-
-	if (i < channel->current_users){
-		Client *kicked_client = get_client(kicked_client_id);
-		
-		if (kicked_client != NULL){
-			join_channel("lobby", kicked_client);
-	
-			char kicked_msg[] = "SERVER: You have been kicked from the channel. Returning to lobby.";
-			socket_send(kicked_client->socket, kicked_msg, MAX_MSG_LEN);
-		} else {
-			char bad_username[] = "SERVER: User is not in channel.";
-			socket_send(client->socket, bad_username, MAX_MSG_LEN);
-		}
-	} else {
-		char bad_username[] = "SERVER: User is not in channel.";
-		socket_send(client->socket, bad_username, MAX_MSG_LEN);
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS){
+		debug_log("open_link: Could not link to %s", link->peer);
+		close(fd);
+		return;
 	}
-	
-	return KICK;
+
+	link->fd = fd;
+	link->state = LINK_CONNECTING;
 }
 
 
-int unmute_command(Client *client, char *buffer){
+/* Called once the link's connection is made, or fails */
+void finish_connect(Link *link){
 
-	if (!is_admin(client, client->channel)){
-		char not_admin_msg[] = "SERVER: Only admins can use this command.";
-		socket_send(client->socket, not_admin_msg, MAX_MSG_LEN);
-		return UNMUTE;
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(link->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0){
+		debug_log("finish_connect: Could not link to %s: %s", link->peer, strerror(error));
+		close_link(link);
+		return;
 	}
 
-	char muted_name[MAX_NAME_LEN];
-	int status = sscanf(buffer, "%*s %[^\n]%*c", muted_name);
+	start_link(link, link->fd);
+}
 
-	if (status != 1){
-		char bad_syntax[] = "SERVER: Incorrect syntax. Try /unmute <user_name>";
-		socket_send(client->socket, bad_syntax, MAX_MSG_LEN);
-		return UNMUTE;
-	}
 
-	int muted_client_id = get_id(muted_name);
-	if (muted_client_id == -1 || !is_muted(muted_client_id, client->channel)){
-		char bad_username[] = "SERVER: Could not find user or user is already unmuted.";
-		socket_send(client->socket, bad_username, MAX_MSG_LEN);
-		return UNMUTE;
-	}
+/* Returns a free slot for a link another server opens, or NULL if there is none */
+Link *free_link(void){
 
-	/* Removing client from muted list */
-	pthread_mutex_lock(&channels_lock);
-	Channel *channel = client->channel;
-	
 	int i;
-	for (i = 0; i < channel->current_mutes && channel->muted_users[i] != muted_client_id; i++);
-	for ( ; i < channel->current_mutes - 1; i++)
-		channel->muted_users[i] = channel->muted_users[i + 1];
+	for (i = 0; i < MAX_LINKS; i++){
+		if (links[i].peer != NULL || links[i].state != LINK_DOWN) continue;
 
-	if (i < channel->current_mutes)
-		channel->muted_users[channel->current_mutes--] = -1;
+		if (i >= n_links){
+			pthread_rwlock_wrlock(&links_lock);
+			n_links = i + 1;
+			pthread_rwlock_unlock(&links_lock);
+		}
 
-	pthread_mutex_unlock(&channels_lock);
+		return links + i;
+	}
 
-	return UNMUTE;
+	return NULL;
 }
 
 
-int mute_command(Client *client, char *buffer){
+/* Accepts every pending link from another server */
+void accept_links(void){
 
-	if (!is_admin(client, client->channel)){
-		char not_admin_msg[] = "SERVER: Only admins can use this command.";
-		socket_send(client->socket, not_admin_msg, MAX_MSG_LEN);
-		return MUTE;
-	}
+	int fd;
+	while ((fd = accept4(link_listener->sockfd, NULL, NULL, SOCK_NONBLOCK)) >= 0){
+		Link *link = free_link();
 
-	char muted_name[MAX_NAME_LEN];
-	int status = sscanf(buffer, "%*s %[^\n]%*c", muted_name);
+		if (link == NULL){
+			warn_log("accept_links: Too many links. Closing the new one.");
+			close(fd);
+			continue;
+		}
 
-	if (status != 1){
-		char bad_syntax[] = "SERVER: Incorrect syntax. Try /mute <user_name>";
-		socket_send(client->socket, bad_syntax, MAX_MSG_LEN);
-		return MUTE;
+		start_link(link, fd);
 	}
+}
 
-	int muted_client_id = get_id(muted_name);
-	if (muted_client_id == -1 || is_muted(muted_client_id, client->channel)){
-		char bad_username[] = "SERVER: Could not find user or user is already muted.";
-		socket_send(client->socket, bad_username, MAX_MSG_LEN);
-		return MUTE;		
-	}
 
-	/* Adding client to muted list */
-	pthread_mutex_lock(&channels_lock);
-	Channel *channel = client->channel;
-	channel->muted_users[channel->current_mutes++] = muted_client_id;
-	pthread_mutex_unlock(&channels_lock);
+/*
+	Body of the link thread, which owns every link:
+	it waits on them, on the listening socket and on
+	its mailbox, writes what was queued on each link
+	once per iteration, and reopens the links this
+	server opened when they are lost.
+*/
+void *run_links(void *arg){
 
-	return MUTE;
-}
+	struct pollfd fds[MAX_LINKS + 2];
+	int i;
+
+	while (1){
+		fds[0].fd = link_wake_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = link_listener != NULL ? link_listener->sockfd : -1;
+		fds[1].events = POLLIN;
+
+		for (i = 0; i < MAX_LINKS; i++){
+			Link *link = links + i;
+			fds[2 + i].fd = link->fd;
+			fds[2 + i].events = POLLIN;
+			if (link->state == LINK_CONNECTING || link->out.count > 0) fds[2 + i].events |= POLLOUT;
+		}
 
+		if (poll(fds, MAX_LINKS + 2, LINK_RETRY_INTERVAL*1000) < 0){
+			if (errno == EINTR) continue;
+			exit_error("run_links: Could not wait for events");
+		}
 
-int join_command(Client *client, char *buffer){
+		if (fds[0].revents != 0) read_link_mail();
+		if (fds[1].revents != 0) accept_links();
 
-	char channel_name[MAX_CHANNEL_LEN];
-	int status = sscanf(buffer, "%*s %[^\n]%*c", channel_name);
+		for (i = 0; i < MAX_LINKS; i++){
+			if (fds[2 + i].revents == 0) continue;
 
-	if (status != 1){
-		char bad_syntax[] = "SERVER: Incorrect syntax. Try /join <channel_name>";
-		socket_send(client->socket, bad_syntax, MAX_MSG_LEN);
-		return JOIN;
-	}
+			if (links[i].state == LINK_CONNECTING) finish_connect(links + i);
+			else read_link(links + i);
+		}
 
-	console_log("Attempting to join channel %s...", channel_name);
+		for (i = 0; i < n_links; i++){
+			Link *link = links + i;
 
-	join_channel(channel_name, client);
+			if (link->socket != NULL && link->out.count > 0 && out_queue_flush(&(link->out), link->socket) < 0)
+				close_link(link);
 
-	return JOIN;
+			if (link->peer != NULL && link->state == LINK_DOWN && metrics_now() >= link->retry_at &&\
+				find_link(link->yielded_to) == NULL)
+				open_link(link);
+		}
+	}
+
+	return NULL;
 }
 
 
-int quit_command(Client *client){
+/*
+	Starts the link thread: it listens for other
+	servers on link_port (if set) and links to each
+	peer given, relinking whenever a link is lost.
+*/
+void links_start(void){
 
-	const char QUIT_MSG[] = "SERVER: /quit";
-	char msg[WHOLE_MSG_LEN];
-	int send_retries = 0;
+	mailbox_init(&link_mailbox);
+	link_wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (link_wake_fd < 0)
+		exit_error("links_start: Could not create eventfd");
 
-	/* Sends quit command to client */
-	int status = socket_send(client->socket, QUIT_MSG, WHOLE_MSG_LEN);
+	links = (Link *)calloc(MAX_LINKS, sizeof(Link));
+	if (links == NULL)
+		exit_error("links_start: Could not allocate links");
 
-	while (status < 0 && send_retries < MAX_RETRIES){
-		send_retries++;
-		console_log("interpret_command: attemtping to resend quit message to user. Attempt %d", send_retries);
-		status = socket_send(client->socket, QUIT_MSG, WHOLE_MSG_LEN);
+	int i;
+	for (i = 0; i < MAX_LINKS; i++){
+		Link *link = links + i;
+		link->index = i;
+		link->state = LINK_DOWN;
+		link->peer = i < config.n_peers ? config.peers[i] : NULL;
+		link->fd = -1;
+		link->socket = NULL;
+		link->peer_id = -1;
+		link->dropped = 0;
+		link->retry_at = 0;
+		link->yielded_to = -1;
+		link->relaying = RELAY_NONE;
+		frame_reader_init(&(link->reader));
+		out_queue_init(&(link->out), LINK_QUEUED_BYTES);
+		link->users = name_table_create(0);
+		link->channels = name_table_create(0);
 	}
 
-	if (send_retries < MAX_RETRIES){
-		console_log("User disconnected correctly.");
-		sprintf(msg, "SERVER: %s disconnected.", client->username);
-		send_to_clients(msg, client->channel);
-		leave_channel(client);
+	n_links = config.n_peers;
+
+	if (config.link_port > 0){
+		link_listener = socket_create();
+
+		/* Links a restarted server had may linger: they mustn't keep it from listening */
+		int reuse = 1;
+		if (setsockopt(link_listener->sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+			exit_error("links_start: Could not reuse link port");
+
+		socket_bind(link_listener, config.link_port, config.link_address);
+		socket_listen(link_listener);
+		socket_set_nonblocking(link_listener);
 	}
 
-	return QUIT;
-}
+	linking = 1;
 
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, run_links, NULL) != 0)
+		exit_error("links_start: Could not start link thread");
+}
 
-int ping_command(Client *client){
 
-	const char PING_MSG[] = "SERVER: pong";
-	int send_retries = 0;
+/*
+	Renders every metric, and the gauges, in the
+	Prometheus text format. Returns its length.
+*/
+int format_stats(char *out, int size){
 
-	int status = socket_send(client->socket, PING_MSG, WHOLE_MSG_LEN);
+	Metrics total;
+	collect_metrics(&total);
 
-	while (status < 0 && send_retries < MAX_RETRIES){
-		send_retries++;
-		console_log("interpret_command: attempt %d to ping back client %s", send_retries, client->username);
-		status = socket_send(client->socket, PING_MSG, WHOLE_MSG_LEN);
-	}
+	int users, n_channels;
+	count_users_and_channels(&users, &n_channels);
 
-	if (send_retries >= MAX_RETRIES)
-		console_log("interpret_command: could not ping back user %s", client->username);
-	else
-		console_log("interpret_command: successfully pinged user %s", client->username);
+	int len = metrics_format(&total, out, size);
+	len += snprintf(out + len, size - len, "# TYPE irc_users gauge\nirc_users %d\n"\
+					"# TYPE irc_channels gauge\nirc_channels %d\n"\
+					"# TYPE irc_workers gauge\nirc_workers %d\n", users, n_channels, n_shards);
 
-	return PING;
+	return len < size ? len : size - 1;
 }
 
 
-int rename_command(Client *client, char *buffer){
-	
-	int RENAME_LEN = strlen(RENAME_CMD);
+/*
+	Opens the stats endpoint: a UNIX socket if it
+	is a path, and otherwise a TCP port that only
+	listens on the loopback interface.
+*/
+int stats_listen(const char *endpoint){
 
-	if (strlen(buffer) <= RENAME_LEN || buffer[RENAME_LEN] != ' '){
-		char msg[] = "SERVER: Rename syntax is not correct. Usage is: /nickname <new name>";
-		socket_send(client->socket, msg, WHOLE_MSG_LEN);
-		return RENAME;
+	int fd;
+
+	if (strchr(endpoint, '/') != NULL){
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, endpoint, sizeof(address.sun_path) - 1);
+
+		unlink(endpoint);	/* Left behind by an earlier run */
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+			exit_error("stats_listen: Could not bind stats socket");
+	} else {
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons(atoi(endpoint));
+
+		int reuse = 1;
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||\
+			bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+			exit_error("stats_listen: Could not bind stats port");
 	}
 
-	/* This message gets overwritten if the rename is successful */
-	char RENAME_MSG[MAX_MSG_LEN + 64] = "SERVER: Failed to rename. Make sure your name does not exceed the maximum character limit, contain special symbols and is unique.";
+	if (listen(fd, 16) < 0)
+		exit_error("stats_listen: Could not listen for stats");
 
-	char new_name[MAX_NAME_LEN + 1];
+	return fd;
+}
 
-	int is_valid = parse_name(buffer, new_name) && unique_name(new_name);
 
-	if (!is_valid){
-		socket_send(client->socket, RENAME_MSG, WHOLE_MSG_LEN);
-		return RENAME;
-	}
+/*
+	Body of the stats thread: answers every
+	connection to the endpoint with the metrics,
+	as an HTTP response, whatever it asks for.
+	It runs apart so that scrapes never hold up
+	a worker.
+*/
+void *serve_stats(void *arg){
 
-	sprintf(RENAME_MSG, "SERVER: User %s renamed to %s", client->username, new_name);
-	strncpy(client->username, new_name, MAX_NAME_LEN + 1);
-	send_to_clients(RENAME_MSG, NULL);
+	int listener = *(int *)arg;
+	char request[1024], body[STATS_TEXT_LEN], header[128];
+	struct timeval timeout = { 1, 0 };
 
-	return RENAME;
-}
+	while (1){
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) continue;
 
+		/* The request itself doesn't matter, but a silent peer can't stall the thread */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		recv(fd, request, sizeof(request), 0);
 
-int invalid_command(Client *client){
-	char help_msg[] = "SERVER: Invalid command. Available commands are:\n\t> /ping\n\t> /nickname <new name>\n\t> /join <channel name>\n\t> /mute <user>\n\t> /unmute <user>\n\t> /kick <user>\n\t> /whois <user>\n\t/mode (+|-)<modes>\n\t/invite <user>\n\t> /quit\n";
-	socket_send(client->socket, help_msg, MAX_MSG_LEN);
-	return NO_CMD;
+		int body_len = format_stats(body, sizeof(body));
+		int header_len = sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"\
+								 "Content-Length: %d\r\n\r\n", body_len);
+
+		if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len)
+			send(fd, body, body_len, MSG_NOSIGNAL);
+		close(fd);
+	}
+
+	return NULL;
 }
 
 
 /*
-	Function that interprets all available
-	commands.
-
-	returns an integer indicating which command
-	was interpreted.
+	Reads the link secret from the first line of the
+	file at path, which keeps it out of the process
+	list. It can't be empty or have blanks in it.
 */
-int interpret_command(Client *client, char *buffer){
+void read_link_secret(const char *path){
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+		exit_error("read_link_secret: Could not open secret file");
 
-	if (!strncmp(buffer, QUIT_CMD, strlen(QUIT_CMD))){
-		return quit_command(client);
-	}
+	if (fgets(link_secret, sizeof(link_secret), file) == NULL)
+		link_secret[0] = '\0';
+	fclose(file);
 
-	if (!strncmp(buffer, PING_CMD, strlen(PING_CMD))){
-		return ping_command(client);
-	}
+	link_secret[strcspn(link_secret, "\r\n")] = '\0';
 
-	if (!strncmp(buffer, RENAME_CMD, strlen(RENAME_CMD))){
-		return rename_command(client, buffer);
+	if (link_secret[0] == '\0' || strpbrk(link_secret, " \t") != NULL){
+		fprintf(stderr, "read_link_secret: The secret must be one line, without blanks\n");
+		exit(EXIT_FAILURE);
 	}
+}
 
-	if (!strncmp(buffer, JOIN_CMD, strlen(JOIN_CMD))){
-		return join_command(client, buffer);
-	}
 
-	if (!strncmp(buffer, MUTE_CMD, strlen(MUTE_CMD))){
-		return mute_command(client, buffer);
-	}
+void usage(char *program){
+	printf("Usage: %s [-u max_users] [-c max_channels] [-w workers] [-b epoll|uring] [-f flush_policy] [-l log_level] [-m port|path]\n"\
+		   "\t[-r history_messages] [-R history_bytes] [-j journal_dir] [-J batch|none|<ms>]\n"\
+		   "\t[-g resume_grace_seconds] [-p port] [-i server_id] [-L [address:]link_port] [-C ip:port]... [-K secret_file]\n"\
+		   "\t[-t chat_rate[:burst]] [-T command_rate[:burst]] [-z channel_rate[:burst]]\n"\
+		   "\t[-s disconnect|drop] [-q high_water[:low_water]]\n", program);
+	printf("\t-w 0 runs one worker per core\n");
+	printf("\t-b uring falls back to epoll if the kernel lacks support\n");
+	printf("\t-f immediate|loop|<microseconds> sets when queued messages are written\n");
+	printf("\t-l debug|info|warn|error|off (default info)\n");
+	printf("\t-m serves metrics on a loopback port or a UNIX socket path\n");
+	printf("\t-r and -R bound the messages each channel replays to those who join (-r 0 disables it)\n");
+	printf("\t-j records every channel message in journal_dir, -J sets when it is synced to disk\n");
+	printf("\t-g sets how long lost clients can resume their sessions (-g 0 disables it)\n");
+	printf("\t-L accepts links from other servers on link_port (of address, 127.0.0.1 by default),\n");
+	printf("\t   -C links to the one at ip:port (up to %d) and -K names the file with their shared secret\n", MAX_LINKS);
+	printf("\t-i gives linked servers distinct ids: the lowest wins nickname clashes\n");
+	printf("\t-t and -T limit the lines and commands each client sends per second, -z the lines each channel takes\n");
+	printf("\t   (bursts default to twice the rate, and 0 lifts a limit)\n");
+	printf("\t-s chooses what happens to a client with high_water bytes queued: disconnect it (the default)\n");
+	printf("\t   or drop its oldest messages, down to low_water bytes (half of high_water by default)\n");
+	exit(EXIT_FAILURE);
+}
 
-	if (!strncmp(buffer, UNMUTE_CMD, strlen(UNMUTE_CMD))){
-		return unmute_command(client, buffer);
-	}
 
-	if (!strncmp(buffer, KICK_CMD, strlen(KICK_CMD))){
-		return kick_command(client, buffer);
-	}
+/* Fills in config from the command line */
+void parse_args(int argc, char *argv[]){
+	int option, fields;
+	char *colon;
+	while ((option = getopt(argc, argv, "u:c:w:b:f:l:m:r:R:j:J:g:p:i:L:C:K:t:T:z:s:q:")) != -1){
+		switch (option){
+			case 'u':
+			config.max_users = atoi(optarg);
+			break;
 
-	if (!strncmp(buffer, WHOIS_CMD, strlen(WHOIS_CMD))){
-		return whois_command(client, buffer);
-	}
+			case 'c':
+			config.max_channels = atoi(optarg);
+			break;
 
-	if (!strncmp(buffer, MODE_CMD, strlen(MODE_CMD))){
-		return mode_command(client, buffer);
-	}
+			case 'w':
+			config.workers = atoi(optarg);
+			if (config.workers == 0) config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+			break;
 
-	if (!strncmp(buffer, INVITE_CMD, strlen(INVITE_CMD))){
-		return invite_command(client, buffer);
-	}
+			case 'b':
+			if (!strcmp(optarg, "epoll")) config.backend = EPOLL_BACKEND;
+			else if (!strcmp(optarg, "uring")) config.backend = URING_BACKEND;
+			else usage(argv[0]);
+			break;
 
-	return invalid_command(client);
-}
+			case 'f':
+			if (!strcmp(optarg, "immediate")) config.flush_policy = FLUSH_IMMEDIATE;
+			else if (!strcmp(optarg, "loop")) config.flush_policy = FLUSH_LOOP;
+			else {
+				config.flush_policy = FLUSH_WINDOW;
+				config.flush_window = atoi(optarg);
+				if (config.flush_window <= 0) usage(argv[0]);
+			}
+			break;
 
+			case 'l':
+			log_level = log_level_parse(optarg);
+			if (log_level < 0) usage(argv[0]);
+			break;
 
-/*
-	Thread that handles a client connection.
-	It reads the designated client's messages
-	and interprets its commands.
+			case 'm':
+			config.stats_endpoint = optarg;
+			break;
 
-	This function terminates when its client
-	sends a quit command, or when there is
-	an unexpected disconnect by its client.
-*/
-void *chat_worker(void *args){
+			case 'r':
+			config.history_count = atoi(optarg);
+			break;
 
-	/* Disable this thread from handling SIGINT */
-	sigset_t sigmask;
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, SIGINT);
-	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+			case 'R':
+			config.history_bytes = atoi(optarg);
+			break;
 
-	Client *client = (Client *)args;
+			case 'j':
+			config.journal_dir = optarg;
+			break;
 
-	char nickname[3*MAX_NAME_LEN];
-	socket_receive(client->socket, nickname, MAX_MSG_LEN);
+			case 'J':
+			config.journal_sync = journal_sync_parse(optarg, &(config.journal_interval));
+			if (config.journal_sync < 0) usage(argv[0]);
+			break;
 
-	if (nickname[0] != ':'){
-		if (unique_name(nickname)){
-			strncpy(client->username, nickname, MAX_NAME_LEN + 1);
-		} else {
-			char not_unique[MAX_MSG_LEN];
-			sprintf(not_unique, "SERVER: the username %s is already taken. Assigning default nickname %s (try /nickname)", nickname, client->username);
-			socket_send(client->socket, not_unique, MAX_MSG_LEN);
-		}
-	}
+			case 'g':
+			config.resume_grace = atoi(optarg);
+			break;
 
-	add_client(client);
-	join_channel("lobby", client);
+			case 'p':
+			config.port = atoi(optarg);
+			break;
 
-	char ip[64];
-	socket_ip(client->socket, ip);
+			case 'i':
+			config.server_id = atoi(optarg);
+			break;
 
-	char welcome_msg[3*MAX_NAME_LEN];
-	sprintf(welcome_msg, "SERVER: %s connected to chat!", client->username);
-	send_to_clients(welcome_msg, NULL);
+			case 'L':
+			colon = strrchr(optarg, ':');
+			if (colon != NULL){
+				struct in_addr address;
+				*colon = '\0';
+				if (inet_pton(AF_INET, optarg, &address) != 1) usage(argv[0]);
+				config.link_address = ntohl(address.s_addr);
+				optarg = colon + 1;
+			}
+			config.link_port = atoi(optarg);
+			break;
 
-	char HELP_MSG[] = "SERVER: Type /help to see available commands.";
-	socket_send(client->socket, HELP_MSG, MAX_MSG_LEN);
+			case 'K':
+			read_link_secret(optarg);
+			break;
 
-	int msg_len, command;
-	char buffer[MAX_MSG_LEN + 1] = {0};
-	char msg[WHOLE_MSG_LEN];
+			case 'C':
+			if (config.n_peers >= MAX_LINKS || strchr(optarg, ':') == NULL) usage(argv[0]);
+			config.peers[config.n_peers++] = optarg;
+			break;
 
-	while (strcmp(buffer, QUIT_CMD)){
-		msg_len = socket_receive(client->socket, buffer, MAX_MSG_LEN);
+			case 't':
+			if (!token_bucket_parse(optarg, &(config.chat_rate), &(config.chat_burst))) usage(argv[0]);
+			break;
 
-		if (msg_len <= 0){
-			console_log("User disconnected unpredictably!");
-			sprintf(msg,"SERVER: %s disconnected.", client->username);
-			send_to_clients(msg, NULL);
-			leave_channel(client);
+			case 'T':
+			if (!token_bucket_parse(optarg, &(config.command_rate), &(config.command_burst))) usage(argv[0]);
+			break;
+
+			case 'z':
+			if (!token_bucket_parse(optarg, &(config.channel_rate), &(config.channel_burst))) usage(argv[0]);
 			break;
-		}
 
-		if (buffer[0] == '/'){
-			command = interpret_command(client, buffer);
-			if (command == QUIT) break;
+			case 's':
+			if (!strcmp(optarg, "disconnect")) config.slow_policy = SLOW_DISCONNECT;
+			else if (!strcmp(optarg, "drop")) config.slow_policy = SLOW_DROP_OLDEST;
+			else usage(argv[0]);
+			break;
 
-		} else {
-			/* Send regular message */
-			if (!is_muted(client->id, client->channel)){
-				sprintf(msg, "%s: (@%s) %s", client->username, client->channel->name, buffer);
-				send_to_clients(msg, client->channel);
-			} else {
-				sprintf(msg, "SERVER: You are currently muted on this channel.");
-				socket_send(client->socket, msg, WHOLE_MSG_LEN);
-			}
+			case 'q':
+			fields = sscanf(optarg, "%d:%d", &(config.high_water), &(config.low_water));
+			if (fields == 1) config.low_water = config.high_water/2;
+			else if (fields != 2) usage(argv[0]);
+			break;
+
+			default:
+			usage(argv[0]);
 		}
 	}
 
-	remove_client(client);
-	client_free(client);
-
-	return NULL;
-}
+	if (config.max_users <= 0 || config.max_channels <= 0 || config.workers <= 0 || config.resume_grace < 0) usage(argv[0]);
 
+	if (config.port <= 0 || config.server_id < 0 || config.link_port < 0) usage(argv[0]);
 
-void *accept_clients(void *args){
+	/* Links are never opened or accepted without a secret */
+	if ((config.link_port > 0 || config.n_peers > 0) && link_secret[0] == '\0') usage(argv[0]);
 
-	/* Disable this thread from handling SIGINT */
-	sigset_t sigmask;
-	sigemptyset(&sigmask);
-	sigaddset(&sigmask, SIGINT);
-	pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
+	/* Any message has to fit in a client's queue */
+	if (config.high_water < MAX_FRAME_LEN || config.low_water < 0 || config.low_water >= config.high_water)
+		usage(argv[0]);
 
-	Socket *socket = (Socket *)args;
+	/* A replay has to fit in a new member's queue, with room to spare */
+	if (config.history_count < 0 || config.history_bytes < 0 || config.history_bytes > config.high_water/2)
+		usage(argv[0]);
+}
 
-	unsigned int current_id = 1;
-	Client *current_client;
-	Socket *current_client_socket;
 
-	do {
-		current_client_socket = socket_accept(socket);
-		current_client = client_create(current_id++, current_client_socket);
-		
-		pthread_create(&(current_client->thread), NULL, chat_worker, current_client);
-	} while (1);
+int main(int argc, char *argv[]){
 
-	return NULL;
-}
+	parse_args(argc, argv);
 
+	/* Workers only ever hand their logs to the flusher thread */
+	logger_start();
 
-int main(){
+	/* Likewise, channel messages to the journal's writer */
+	if (config.journal_dir != NULL)
+		journal_start(config.journal_dir, config.journal_sync, config.journal_interval);
 
 	/* Handle SIGINT */
 	struct sigaction signal;
@@ -1009,21 +4113,52 @@ int main(){
 	signal.sa_flags = 0;
 	sigaction(SIGINT, &signal, NULL);
 
-	Socket *socket = socket_create();
-	socket_bind(socket, SERVER_PORT, INADDR_ANY);
-	socket_listen(socket);
+	n_shards = config.workers;
+	shards = (Shard *)calloc(n_shards, sizeof(Shard));
+	if (shards == NULL)
+		exit_error("main: Could not allocate workers");
+
+	int i;
+	for (i = 0; i < n_shards; i++)
+		shard_init(shards + i, i);
 
 	pthread_mutex_init(&clients_lock, NULL);
-	pthread_mutex_init(&channels_lock, NULL);
+	pthread_rwlock_init(&channels_lock, NULL);
+	pthread_rwlock_init(&links_lock, NULL);
+
+	/* Handshaking connections take up client slots too */
+	client_slab = slab_create(sizeof(Client), config.max_users);
+	channel_slab = slab_create(sizeof(Channel), config.max_channels);
+	clients_by_name = name_table_create(0);
+	sessions_by_token = name_table_create(0);
+	sessions_by_name = name_table_create(0);
+
+	channels = name_table_create(0);
+	lobby = channel_create("lobby", NULL);
+	flood_notice = payload_create("SERVER: You are sending too fast. Messages are being dropped.");
+	busy_notice = payload_create("SERVER: This channel is too busy. Messages are being dropped.");
+	name_table_put(channels, lobby->name, lobby);
+
+	/* Links are up to a thread of their own, like stats */
+	if (config.link_port > 0 || config.n_peers > 0)
+		links_start();
+
+	static int stats_fd;
+	pthread_t stats_thread;
+
+	if (config.stats_endpoint != NULL){
+		stats_fd = stats_listen(config.stats_endpoint);
+		if (pthread_create(&stats_thread, NULL, serve_stats, &stats_fd) != 0)
+			exit_error("main: Could not start stats thread");
+	}
 
-	channels[0] = channel_create("lobby", NULL);
-	current_channels = 1;
-	
-	pthread_t acc_daemon;
-	pthread_create(&acc_daemon, NULL, accept_clients, socket);
+	/* The main thread runs the first worker */
+	for (i = 1; i < n_shards; i++)
+		if (pthread_create(&(shards[i].thread), NULL, reactor_thread, shards + i) != 0)
+			exit_error("main: Could not start worker");
 
-	pthread_join(acc_daemon, NULL);
+	console_log("Running %d worker(s)", n_shards);
+	run_reactor(shards);
 
-	socket_free(socket);
 	return 0;
 }
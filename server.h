@@ -2,21 +2,30 @@
 
 #define SERVER_H
 
-#define MAX_USERS 32
-#define MAX_RETRIES 5
-#define N_THREADS MAX_USERS
-
-#define MAX_CHANNELS 32
+#define DEFAULT_MAX_USERS 1024
+#define DEFAULT_MAX_CHANNELS 1024
+#define DEFAULT_WORKERS 1
+#define DEFAULT_HISTORY_COUNT 20		/* Messages replayed to those who join a channel */
+#define DEFAULT_HISTORY_BYTES 8192	/* Bytes of them, at most 						*/
+#define DEFAULT_JOURNAL_INTERVAL 100	/* Milliseconds between journal syncs 			*/
+#define DEFAULT_RESUME_GRACE 30		/* Seconds a lost client can resume its session for */
+#define DEFAULT_CHAT_RATE 20		/* Lines per second a client can send its channel 	*/
+#define DEFAULT_COMMAND_RATE 10		/* Commands per second a client can send 			*/
+#define DEFAULT_CHANNEL_RATE 0		/* Lines per second a channel takes, 0 for no limit */
 
 typedef struct client Client;
 typedef struct channel Channel;
+typedef struct members Members;
+typedef struct shard Shard;
+typedef struct mail Mail;
+typedef struct command_line CommandLine;
+typedef struct session Session;
+typedef struct remote_user RemoteUser;
+typedef struct remote_channel RemoteChannel;
+typedef struct link Link;
 
-#define VALID_NAME_CHAR(c) (c != '<' && c != '>' && c != ':' && c != '@' && c != ' ' && c != '\n')
-#define VALID_CHANNEL_CHAR(c) (c != ' ' && c != ',' && c != 7)
-
-#define VALID_NAME_CHAR(c) (c != '<' && c != '>' && c != ':' && c != '@' && c != ' ' && c != '\n')
-#define VALID_CHANNEL_CHAR(c) (c != ' ' && c != ',' && c != 7)
 
+void *reserve(void *array, int *capacity, int needed, size_t element_size);
 
 Channel *channel_create(char name[MAX_CHANNEL_LEN], Client *admin);
 
@@ -24,11 +33,50 @@ void channel_free(Channel *c);
 
 Channel *find_channel(char channel_name[MAX_CHANNEL_LEN]);
 
-int invalid_channel_name(char channel_name[MAX_CHANNEL_LEN]);
+int client_send_payload(Client *client, Payload *payload);
+
+int shed_load(Client *client, Payload *payload);
+int schedule_flush(Client *client, int was_empty);
+
+void replay_history(Client *client, Channel *channel, uint64_t after);
+
+void flag_for_flush(Client *client);
+
+void unflag_client(Client *client);
+
+void flush_window_passed(Shard *shard);
+
+void flush_clients(Shard *shard);
+
+int client_send(Client *client, const char msg[]);
+
+void post_mail(Shard *shard, Mail *mail, Payload *payload);
+
+Mail *mail_create(int type);
+
+void broadcast_local(Payload *payload);
+
+void fanout_local(Payload *payload, Channel *channel);
+
+void fanout_shards(Payload *payload, Channel *channel);
+
+void fanout(Payload *payload, Channel *channel);
+
+void broadcast_shards(Payload *payload);
+
+void broadcast(Payload *payload, Channel *channel);
+
+void send_to_id(int64_t id, Payload *payload);
 
 void send_to_clients(char msg[], Channel *channel);
 
-int leave_channel(Client *client);
+void drop_client(Client *client);
+
+void delete_if_empty(int64_t channel_handle);
+
+int leave_channel(Client *client, int announce);
+
+Channel *add_to_channel(char channel_name[MAX_CHANNEL_LEN], Client *client, int *slot, uint64_t after);
 
 int join_channel(char channel_name[MAX_CHANNEL_LEN], Client *client);
 
@@ -38,54 +86,208 @@ void disconnect_clients();
 
 void handle_interrupt(int sig);
 
-Client *client_create(int id, Socket *socket);
+Client *client_create(Socket *socket);
 
 void client_free(Client *client);
 
 int add_client(Client *client);
 
-int unique_name(char *name);
+int register_client(Client *client);
+
+void add_to_shard(Client *client);
+
+int name_taken(const char *name);
+
+void default_name(Client *client);
 
-int parse_name(char *buffer, char *name);
+int unique_name(char *name);
 
 int is_admin(Client *client, Channel *channel);
 
-int get_id(char *username);
+int64_t get_id(char *username);
+
+int is_connected(int64_t id);
+
+int prune_ids(IdSet *ids);
+
+int is_invited(Channel *channel, int64_t id);
 
-int is_invited(Channel *channel, int id);
+int is_muted(int64_t client_id, Channel *channel);
 
-int is_muted(int client_id, Channel *channel);
+Client *get_client(int64_t id);
 
-Client *get_client(int id);
+Shard *get_shard(int64_t id);
 
 void set_public(Channel *channel, char mode);
 
-int invite_command(Client *client, char *buffer);
+int invite_command(Client *client, char *arg, int arg_len);
 
-int mode_command(Client *client, char *buffer);
+int mode_command(Client *client, char *arg, int arg_len);
 
-int whois_command(Client *client, char *buffer);
+int whois_command(Client *client, char *arg, int arg_len);
 
-int kick_command(Client *client, char *buffer);
+int kick_command(Client *client, char *arg, int arg_len);
 
-int unmute_command(Client *client, char *buffer);
+void kick_client(Client *kicked, int64_t channel_handle, int64_t kicker_id);
 
-int mute_command(Client *client, char *buffer);
+int unmute_command(Client *client, char *arg, int arg_len);
 
-int join_command(Client *client, char *buffer);
+int mute_command(Client *client, char *arg, int arg_len);
 
-int quit_command(Client *client);
+int join_command(Client *client, char *arg, int arg_len);
 
-int ping_command(Client *client);
+int quit_command(Client *client, char *arg, int arg_len);
 
-int rename_command(Client *client, char *buffer);
+int ping_command(Client *client, char *arg, int arg_len);
+
+int rename_command(Client *client, char *arg, int arg_len);
 
 int invalid_command(Client *client);
 
-int interpret_command(Client *client, char *buffer);
+void throttle(Client *client, int counter, Payload *notice);
+
+void collect_metrics(Metrics *total);
+
+void count_users_and_channels(int *users, int *n_channels);
+
+int stats_command(Client *client, char *arg, int arg_len);
+
+void tokenize_command(char *buffer, CommandLine *line);
+
+int interpret_command(Client *client, CommandLine *line);
+
+uint64_t delivered_cursor(Client *client);
+
+void issue_token(Client *client);
+
+int save_session(Client *client);
+
+void unlink_session(Session *session);
+
+void expire_sessions(void);
+
+void sweep_timer_fired(Shard *shard);
+
+int resume_session(Client *client, char *token);
+
+void greet_client(Client *client, char *nickname);
+
+void chat(Client *client, char *buffer);
+
+void handle_message(Client *client, char *buffer);
+
+void connection_lost(Client *client);
+
+void close_client(Client *client);
+
+void handle_frames(Client *client);
+
+void handle_client_events(Client *client);
+
+void watch_fd(int fd, void *data);
+
+void watch_socket(Socket *socket, void *data);
+
+void reject_connection(Socket *socket);
+
+void accept_clients(Shard *shard);
+
+void deliver_mail(Mail *mail);
+
+void read_mail(Shard *shard);
+
+void run_epoll_reactor(Shard *shard);
+
+void start_receiving(Client *client);
+
+void release_client(Client *client);
+
+void settle_client(Client *client);
+
+void submit_send(Client *client);
+
+void submit_sends(Shard *shard);
+
+void accept_connection(Shard *shard, int sockfd);
+
+void handle_recv(Shard *shard, Client *client, struct io_uring_cqe *cqe);
+
+void handle_send(Client *client, struct io_uring_cqe *cqe);
+
+void handle_completion(Shard *shard, struct io_uring_cqe *cqe);
+
+void run_uring_reactor(Shard *shard);
+
+void run_reactor(Shard *shard);
+
+void *reactor_thread(void *shard);
+
+void shard_init(Shard *shard, int index);
+
+void post_link_mail(int link, Payload *header, Payload *payload);
+
+void link_event(const char *format, ...);
+
+void relay_to_channel(Payload *payload, Channel *channel);
+
+int remote_name_owner(const char *name);
+
+void yield_nickname(Client *client);
+
+void send_on_link(Link *link, Payload *payload);
+
+void link_printf(Link *link, const char *format, ...);
+
+void relay_mail(Mail *mail);
+
+void read_link_mail(void);
+
+void move_remote_user(Link *link, RemoteUser *user, const char *channel_name);
+
+void remove_remote_user(Link *link, RemoteUser *user);
+
+void settle_clash(Link *link, const char *name);
+
+RemoteUser *add_remote_user(Link *link, const char *name, RemoteUser *user);
+
+void deliver_relay(Link *link, char *msg);
+
+void send_burst(Link *link);
+
+Link *find_link(int peer_id);
+
+void accept_peer(Link *link, int peer_id);
+
+char *split_word(char *word);
+
+void handle_link_message(Link *link, char *msg);
+
+void read_link(Link *link);
+
+void close_link(Link *link);
+
+void start_link(Link *link, int fd);
+
+void open_link(Link *link);
+
+void finish_connect(Link *link);
+
+Link *free_link(void);
+
+void accept_links(void);
+
+void *run_links(void *arg);
+
+void links_start(void);
+
+int format_stats(char *out, int size);
+
+int stats_listen(const char *endpoint);
+
+void *serve_stats(void *arg);
 
-void *chat_worker(void *args);
+void usage(char *program);
 
-void *accept_clients(void *args);
+void parse_args(int argc, char *argv[]);
 
 #endif
\ No newline at end of file
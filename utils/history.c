@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <history.h>
+
+
+void history_init(History *history, int max_count, int max_bytes){
+	history->entries = NULL;
+	history->head = 0;
+	history->count = 0;
+	history->bytes = 0;
+	history->max_count = max_count;
+	history->max_bytes = max_bytes;
+}
+
+
+/* Drops the oldest message */
+void history_evict(History *history){
+	Payload *oldest = history->entries[history->head];
+
+	history->head = (history->head + 1) % history->max_count;
+	history->count--;
+	history->bytes -= oldest->len;
+
+	payload_release(oldest);
+}
+
+
+void history_clear(History *history){
+	while (history->count > 0)
+		history_evict(history);
+
+	free(history->entries);
+	history_init(history, history->max_count, history->max_bytes);
+}
+
+
+void history_push(History *history, Payload *payload){
+
+	if (history->max_count <= 0 || payload->len > history->max_bytes) return;
+
+	if (history->entries == NULL){
+		history->entries = (Payload **)malloc(history->max_count*sizeof(Payload *));
+		if (history->entries == NULL)
+			exit_error("history_push: Could not allocate history");
+	}
+
+	while (history->count == history->max_count || history->bytes + payload->len > history->max_bytes)
+		history_evict(history);
+
+	history->entries[(history->head + history->count) % history->max_count] = payload_retain(payload);
+	history->count++;
+	history->bytes += payload->len;
+}
+
+
+Payload *history_get(History *history, int i){
+	return history->entries[(history->head + i) % history->max_count];
+}
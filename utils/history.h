@@ -0,0 +1,45 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <irc_utils.h>
+#include <payload.h>
+
+
+/*
+	A channel's most recent messages, oldest first,
+	kept as the payloads that were broadcast. The
+	oldest are dropped once there are more than
+	max_count of them or they add up to more than
+	max_bytes, so its memory stays bounded.
+*/
+typedef struct history{
+	Payload **entries;	/* Ring of max_count slots, allocated on the first push */
+	int head;			/* Index of the oldest entry */
+	int count;
+	int bytes;			/* Of all entries' frames */
+	int max_count;
+	int max_bytes;
+} History;
+
+
+/* Initializes an empty history. Either limit being 0 keeps nothing */
+void history_init(History *history, int max_count, int max_bytes);
+
+
+/* Drops every message and frees the history's memory */
+void history_clear(History *history);
+
+
+/*
+	Appends payload, retaining it (see payload_retain),
+	and drops the oldest messages that no longer fit.
+	A payload larger than max_bytes is not kept.
+*/
+void history_push(History *history, Payload *payload);
+
+
+/* Returns the i-th oldest message, for 0 <= i < count */
+Payload *history_get(History *history, int i);
+
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <irc_utils.h>
+#include <id_set.h>
+
+#define MIN_SLOTS 8
+
+#define EMPTY_ID -1
+#define DELETED_ID -2	/* Probing goes on past deleted slots */
+
+
+/* Spreads the bits of id, since handles differ mostly in the low ones (and a generation above) */
+uint32_t hash_id(int64_t id){
+	uint32_t hash = (uint32_t)(id ^ (id >> 32))*2654435761u;
+	return hash ^ (hash >> 16);
+}
+
+
+/*
+	Returns the slot holding id or, if id isn't
+	in the set, the slot where it should be inserted.
+	The set must have at least one free slot.
+*/
+int64_t *find_slot(IdSet *set, int64_t id){
+
+	uint32_t mask = set->capacity - 1;
+	uint32_t i = hash_id(id) & mask;
+	int64_t *free_slot = NULL;
+
+	while (1){
+		int64_t *slot = set->slots + i;
+
+		if (*slot == EMPTY_ID)
+			return free_slot != NULL ? free_slot : slot;
+
+		if (*slot == DELETED_ID){
+			if (free_slot == NULL) free_slot = slot;
+		} else if (*slot == id){
+			return slot;
+		}
+
+		i = (i + 1) & mask;
+	}
+}
+
+
+/* Rehashes every id into the given number of slots, dropping deleted ones */
+void rehash_ids(IdSet *set, int capacity){
+
+	int64_t *old_slots = set->slots;
+	int i, old_capacity = set->capacity;
+
+	set->slots = (int64_t *)malloc(capacity*sizeof(int64_t));
+	if (set->slots == NULL)
+		exit_error("id_set: Could not allocate slots");
+
+	for (i = 0; i < capacity; i++) set->slots[i] = EMPTY_ID;
+	set->capacity = capacity;
+	set->used = set->size;
+
+	for (i = 0; i < old_capacity; i++)
+		if (old_slots[i] >= 0)
+			*find_slot(set, old_slots[i]) = old_slots[i];
+
+	free(old_slots);
+}
+
+
+void id_set_init(IdSet *set){
+	set->slots = NULL;
+	set->capacity = 0;
+	set->size = 0;
+	set->used = 0;
+}
+
+
+void id_set_clear(IdSet *set){
+	free(set->slots);
+	id_set_init(set);
+}
+
+
+int id_set_contains(IdSet *set, int64_t id){
+	if (set->size == 0) return 0;
+	return *find_slot(set, id) == id;
+}
+
+
+int id_set_add(IdSet *set, int64_t id){
+
+	if (set->capacity == 0) rehash_ids(set, MIN_SLOTS);
+
+	int64_t *slot = find_slot(set, id);
+	if (*slot == id) return 0;
+
+	if (*slot == EMPTY_ID){
+		/* Uses up an empty slot, so keeps the load factor under 3/4 */
+		if ((set->used + 1)*4 > set->capacity*3){
+			rehash_ids(set, (set->size + 1)*2 > set->capacity ? 2*set->capacity : set->capacity);
+			slot = find_slot(set, id);
+		}
+		set->used++;
+	}
+
+	*slot = id;
+	set->size++;
+
+	return 1;
+}
+
+
+int id_set_remove(IdSet *set, int64_t id){
+
+	if (set->size == 0) return 0;
+
+	int64_t *slot = find_slot(set, id);
+	if (*slot != id) return 0;
+
+	*slot = DELETED_ID;
+	set->size--;
+
+	return 1;
+}
+
+
+int id_set_prune(IdSet *set, int (*keep)(int64_t id)){
+
+	int i, removed = 0;
+	for (i = 0; i < set->capacity; i++){
+		if (set->slots[i] >= 0 && !keep(set->slots[i])){
+			set->slots[i] = DELETED_ID;
+			removed++;
+		}
+	}
+
+	set->size -= removed;
+	return removed;
+}
+
+
+int id_set_size(IdSet *set){
+	return set->size;
+}
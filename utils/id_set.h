@@ -0,0 +1,60 @@
+#ifndef ID_SET_H
+#define ID_SET_H
+
+#include <stdint.h>
+
+
+/*
+	Set of non-negative ids (e.g. slab handles),
+	using open addressing with linear probing, so
+	membership tests are O(1) no matter how many
+	ids it holds. An empty set doesn't allocate,
+	and a test against it is a single comparison.
+
+	A zeroed IdSet is a valid empty set.
+*/
+typedef struct id_set{
+	int64_t *slots;	/* Holds ids, EMPTY_ID or DELETED_ID 	*/
+	int capacity;	/* 0 or a power of 2 					*/
+	int size;		/* Ids in the set 						*/
+	int used;		/* Ids plus deleted slots 				*/
+} IdSet;
+
+
+/* Makes set empty, without allocating */
+void id_set_init(IdSet *set);
+
+
+/* Frees the set's slots, leaving it empty */
+void id_set_clear(IdSet *set);
+
+
+/* Returns whether id is in the set */
+int id_set_contains(IdSet *set, int64_t id);
+
+
+/*
+	Adds id to the set. Exits if the allocation fails.
+
+	Returns 1 on success and 0 if id was already in the set.
+*/
+int id_set_add(IdSet *set, int64_t id);
+
+
+/* Removes id, returning 1 if it was in the set and 0 otherwise */
+int id_set_remove(IdSet *set, int64_t id);
+
+
+/*
+	Removes every id for which keep returns 0.
+
+	Returns how many were removed.
+*/
+int id_set_prune(IdSet *set, int (*keep)(int64_t id));
+
+
+/* Returns the number of ids in the set */
+int id_set_size(IdSet *set);
+
+
+#endif
@@ -1,7 +1,11 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 
 #include <sys/socket.h>
@@ -152,33 +156,134 @@ Socket *socket_accept(Socket *server_socket){
 	if (connected_fd < 0)
 		exit_error("accept_connection: Invalid connection");
 
-	console_log("Connection established!");
+	debug_log("Connection established!");
 
 	return create_custom_socket(connected_fd, peer_addr);
 }
 
 
+int socket_set_nonblocking(Socket *socket){
+	int flags = fcntl(socket->sockfd, F_GETFL, 0);
+	if (flags < 0) return -1;
+
+	return fcntl(socket->sockfd, F_SETFL, flags | O_NONBLOCK) < 0 ? -1 : 1;
+}
+
+
+int socket_set_reuseport(Socket *socket){
+	int enable = 1;
+	return setsockopt(socket->sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0 ? -1 : 1;
+}
+
+
+Socket *socket_try_accept(Socket *server_socket){
+
+	sockaddr_in peer_addr;
+	socklen_t addr_size = sizeof(peer_addr);
+
+	int connected_fd = accept(server_socket->sockfd,\
+							  (sockaddr *)&peer_addr, &addr_size);
+
+	if (connected_fd < 0){
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			warn_log("socket_try_accept: Invalid connection");
+		return NULL;
+	}
+
+	debug_log("Connection established!");
+
+	return create_custom_socket(connected_fd, peer_addr);
+}
+
+
+Socket *socket_adopt(int sockfd){
+
+	sockaddr_in peer_addr;
+	socklen_t addr_size = sizeof(peer_addr);
+
+	if (getpeername(sockfd, (sockaddr *)&peer_addr, &addr_size) < 0){
+		warn_log("socket_adopt: Invalid connection");
+		return NULL;
+	}
+
+	debug_log("Connection established!");
+
+	return create_custom_socket(sockfd, peer_addr);
+}
+
+
 int min(int a, int b){
 	return a < b ? a : b;
 }
 
 
+/*
+	Receives exactly len bytes, unless the connection
+	is closed (returns 0) or fails (returns -1).
+	Returns 1 on success.
+*/
+int receive_exactly(Socket *socket, char buffer[], int len){
+	int received_bytes = 0, status;
+	while (received_bytes < len){
+		status = recv(socket->sockfd, buffer + received_bytes, len - received_bytes, 0);
+		if (status < 0 && errno == EINTR) continue;
+		if (status <= 0) return status;
+		received_bytes += status;
+	}
+
+	return 1;
+}
+
+
 int socket_receive(Socket *socket, char buffer[], int buffer_size){
-	int received_bytes = recv(socket->sockfd, buffer, buffer_size, 0);
-	if (received_bytes < 0)
-		console_log("socket_receive: Error reading message");
-	
+
+	unsigned char header[FRAME_HEADER_LEN];
+	char discarded[256];
+	int msg_len, kept_len, skipped_len, status;
+
+	buffer[0] = '\0';
+
+	do {
+		status = receive_exactly(socket, (char *)header, FRAME_HEADER_LEN);
+		if (status <= 0) break;
+
+		msg_len = (header[0] << 8) | header[1];
+		kept_len = min(msg_len, buffer_size - 1);
+
+		status = receive_exactly(socket, buffer, kept_len);
+		if (status <= 0) break;
+		buffer[kept_len] = '\0';
+
+		/* Skips what did not fit in the buffer */
+		for (skipped_len = kept_len; status > 0 && skipped_len < msg_len; skipped_len += sizeof(discarded))
+			status = receive_exactly(socket, discarded, min(sizeof(discarded), msg_len - skipped_len));
+	} while (status > 0 && msg_len == 0);	/* Empty messages are skipped */
+
+	if (status < 0)
+		warn_log("socket_receive: Error reading message");
+
+	return status > 0 ? min(msg_len, buffer_size - 1) : status;
+}
+
+
+int socket_try_receive(Socket *socket, char buffer[], int buffer_size){
+	int received_bytes = recv(socket->sockfd, buffer, buffer_size, MSG_DONTWAIT);
+	if (received_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		warn_log("socket_try_receive: Error reading message");
+
 	return received_bytes;
 }
 
 
 int socket_send(Socket *socket, const char msg[], int buffer_size){
-	int msg_len = min(strlen(msg), buffer_size);
+	char frame[MAX_FRAME_LEN];
+	int msg_len = min(min(strlen(msg), buffer_size), WHOLE_MSG_LEN);
+	int frame_len = frame_encode(frame, msg, msg_len);
 
 	int sent_bytes = 0, error;
-	while (sent_bytes < msg_len){
-		error = send(socket->sockfd, msg + sent_bytes,\
-						   buffer_size - sent_bytes, MSG_NOSIGNAL);
+	while (sent_bytes < frame_len){
+		error = send(socket->sockfd, frame + sent_bytes,\
+						   frame_len - sent_bytes, MSG_NOSIGNAL);
 		
 		if (error < 0) return -1;
 		sent_bytes += error;
@@ -188,10 +293,102 @@ int socket_send(Socket *socket, const char msg[], int buffer_size){
 }
 
 
+int frame_encode(char frame[], const char msg[], int msg_len){
+	frame[0] = (msg_len >> 8) & 0xFF;
+	frame[1] = msg_len & 0xFF;
+	memcpy(frame + FRAME_HEADER_LEN, msg, msg_len);
+
+	return FRAME_HEADER_LEN + msg_len;
+}
+
+
+void frame_reader_init(FrameReader *reader){
+	reader->start = 0;
+	reader->end = 0;
+}
+
+
+/* Moves the partial frame to the front to make room */
+void frame_reader_compact(FrameReader *reader){
+	if (reader->start > 0){
+		memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+	}
+}
+
+
+int frame_reader_fill(FrameReader *reader, Socket *socket){
+
+	frame_reader_compact(reader);
+
+	int received_bytes = socket_try_receive(socket, reader->buffer + reader->end,\
+											MAX_FRAME_LEN - reader->end);
+	if (received_bytes > 0) reader->end += received_bytes;
+
+	return received_bytes;
+}
+
+
+int frame_reader_feed(FrameReader *reader, const char *data, int len){
+
+	frame_reader_compact(reader);
+
+	int copied = min(len, MAX_FRAME_LEN - reader->end);
+	memcpy(reader->buffer + reader->end, data, copied);
+	reader->end += copied;
+
+	return copied;
+}
+
+
+int frame_reader_next(FrameReader *reader, char msg[], int msg_size){
+
+	unsigned char *header = (unsigned char *)reader->buffer + reader->start;
+	int available = reader->end - reader->start;
+
+	if (available < FRAME_HEADER_LEN) return FRAME_INCOMPLETE;
+
+	int msg_len = (header[0] << 8) | header[1];
+	if (msg_len > msg_size - 1 || msg_len > WHOLE_MSG_LEN) return FRAME_TOO_LONG;
+	if (available < FRAME_HEADER_LEN + msg_len) return FRAME_INCOMPLETE;
+
+	memcpy(msg, reader->buffer + reader->start + FRAME_HEADER_LEN, msg_len);
+	msg[msg_len] = '\0';
+	reader->start += FRAME_HEADER_LEN + msg_len;
+
+	return msg_len;
+}
+
+
+int parse_name(char *buffer, char *name){
+
+	memset(name, 0, (MAX_NAME_LEN + 1)*sizeof(char));
+
+	int i;
+	for (i = 0; i <= MAX_NAME_LEN; i++){
+		if (VALID_NAME_CHAR(buffer[i])) name[i] = buffer[i];
+		else return 0;
+		if (name[i] == '\0') break;
+	}
+
+	return i <= MAX_NAME_LEN;	/* If name is smaller than max, return 1. 0 otherwise */
+}
+
+
+int invalid_channel_name(char channel_name[MAX_CHANNEL_LEN]){
+	int i;
+	for (i = 0; i < strlen(channel_name); i++)
+		if (!VALID_CHANNEL_CHAR(channel_name[i])) return 1;
+
+	return 0;
+}
+
+
 void socket_ip(Socket *socket, char ipv4[64]){
 	struct in_addr ip_addr = socket->address.sin_addr;
 	inet_ntop(AF_INET, &ip_addr, ipv4, 64);
-	console_log("Returning address %s", ipv4);
+	debug_log("Returning address %s", ipv4);
 }
 
 
@@ -5,8 +5,14 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+#include <logger.h>
+
+/* Filtered by the runtime log_level before anything is formatted */
 #define PRINT_LOG 1
-#define console_log(s, args...) do{ if(PRINT_LOG) printf(s "\n", ##args); }while(0)
+#define log_at(level, s, args...) do{ if(PRINT_LOG && (level) >= log_level) log_write(s "\n", ##args); }while(0)
+#define debug_log(s, args...) log_at(LOG_DEBUG, s, ##args)
+#define console_log(s, args...) log_at(LOG_INFO, s, ##args)
+#define warn_log(s, args...) log_at(LOG_WARN, s, ##args)
 #define exit_error(msg) do{ perror(msg); exit(EXIT_FAILURE); }while(0)
 
 #define MAX_MSG_LEN 4096
@@ -14,9 +20,23 @@
 #define MAX_CHANNEL_LEN 200
 #define WHOLE_MSG_LEN MAX_MSG_LEN + MAX_NAME_LEN + MAX_CHANNEL_LEN + 16
 
+#define VALID_NAME_CHAR(c) (c != '<' && c != '>' && c != ':' && c != '@' && c != ' ' && c != '\n')
+#define VALID_CHANNEL_CHAR(c) (c != ' ' && c != ',' && c != 7)
+
+/*
+	Every message travels as a frame: a 2-byte
+	big-endian payload length followed by exactly
+	that many bytes (no \0 terminator).
+*/
+#define FRAME_HEADER_LEN 2
+#define MAX_FRAME_LEN (FRAME_HEADER_LEN + WHOLE_MSG_LEN)
+
+#define FRAME_INCOMPLETE -1
+#define FRAME_TOO_LONG -2
+
 
 #define SERVER_PORT 8888
-#define MAX_BACKLOG 6
+#define MAX_BACKLOG 128
 
 
 typedef struct socket_{
@@ -26,6 +46,18 @@ typedef struct socket_{
 } Socket;
 
 
+/*
+	Reassembles frames out of a byte stream.
+	One read may hold several frames, and one
+	frame may be split across several reads.
+*/
+typedef struct frame_reader{
+	int start;	/* First byte not yet parsed */
+	int end;	/* One past the last byte read */
+	char buffer[MAX_FRAME_LEN];
+} FrameReader;
+
+
 /*
 	Creates TCP/IP socket. Its address is
 	NULL until a call to socket_bind is made.
@@ -82,25 +114,81 @@ Socket *socket_accept(Socket *server_socket);
 
 
 /*
-	Fills buffer with messages sent by
-	the client socket.
-	Returns number of bytes read, and -1
-	if failed.
+	Puts the socket in non-blocking mode, so that
+	calls that would block fail with errno set to
+	EAGAIN instead.
+
+	Returns 1 on success and -1 on failure.
+*/
+int socket_set_nonblocking(Socket *socket);
+
+
+/*
+	Lets several sockets bind to the same port, with
+	the kernel spreading incoming connections among
+	the listening ones. Must be called before binding.
+
+	Returns 1 on success and -1 on failure.
+*/
+int socket_set_reuseport(Socket *socket);
+
+
+/*
+	Accepts a single connection without blocking.
+
+	Returns NULL if there are no pending connections
+	or if accepting failed. Otherwise, behaves just
+	like socket_accept.
+
+	NOTE: server_socket must be in non-blocking mode.
+*/
+Socket *socket_try_accept(Socket *server_socket);
+
+
+/*
+	Wraps a connection accepted elsewhere (e.g. by
+	io_uring) in a Socket, filling in the peer's
+	address. Returns NULL if sockfd is not connected.
+*/
+Socket *socket_adopt(int sockfd);
+
+
+/*
+	Fills buffer with the next message sent
+	through the socket, \0-terminated. If the
+	message does not fit, it is truncated to
+	buffer_size - 1 bytes.
+
+	Returns number of bytes of the message, 0 if
+	the connection was closed and -1 if failed.
 
 	NOTE: This function blocks the thread until
-		  a message is available.
+		  a whole message is available.
 */
 int socket_receive(Socket *socket, char buffer[], int buffer_size);
 
 
 /*
-	Sends \0-terminated message to the socket.
+	Reads whatever bytes are already available on
+	the socket, without blocking.
+
+	Returns number of bytes read, 0 if the peer closed
+	the connection and -1 on failure. If there was
+	nothing to read, -1 is returned and errno is set
+	to EAGAIN or EWOULDBLOCK.
+*/
+int socket_try_receive(Socket *socket, char buffer[], int buffer_size);
+
+
+/*
+	Sends \0-terminated message to the socket
+	as a single frame.
 
 	This function guarantees that the whole
 	message will be sent, so long as it ends
 	with \0. That is, it will send strlen(msg)
 	bytes OR buffer_size bytes, whichever is
-	lesser.
+	lesser, and nothing past them.
 
 	Returns 1 on success and -1 on failure.
 
@@ -110,6 +198,71 @@ int socket_receive(Socket *socket, char buffer[], int buffer_size);
 int socket_send(Socket *socket, const char msg[], int buffer_size);
 
 
+/*
+	Writes msg_len bytes of msg as a frame into
+	frame, which must hold at least
+	FRAME_HEADER_LEN + msg_len bytes.
+
+	Returns the size of the whole frame.
+*/
+int frame_encode(char frame[], const char msg[], int msg_len);
+
+
+/* Empties the reader, e.g. for a new connection */
+void frame_reader_init(FrameReader *reader);
+
+
+/*
+	Reads whatever bytes are available on the
+	socket into the reader, without blocking.
+
+	Returns the same as socket_try_receive.
+*/
+int frame_reader_fill(FrameReader *reader, Socket *socket);
+
+
+/*
+	Copies as much of the len bytes in data as fits
+	into the reader, for bytes that were received
+	elsewhere (e.g. by io_uring). Take the complete
+	messages out with frame_reader_next, and feed
+	the rest again.
+
+	Returns how many bytes were copied.
+*/
+int frame_reader_feed(FrameReader *reader, const char *data, int len);
+
+
+/*
+	Copies the next complete message buffered
+	in the reader into msg, \0-terminated.
+
+	Returns the message length, FRAME_INCOMPLETE
+	if no whole message was buffered yet, or
+	FRAME_TOO_LONG if the next message does not fit
+	in msg_size - 1 bytes (the stream is then unusable).
+*/
+int frame_reader_next(FrameReader *reader, char msg[], int msg_size);
+
+
+/*
+	Given a nickname as typed by a user, writes
+	the parsed name to name and returns 1.
+	If the chosen name is invalid, returns 0.
+	
+	The contents of the name buffer are
+	unpredictable if 0 is returned.
+
+	The name buffer should have at least
+	MAX_NAME_LEN + 1 bytes.
+*/
+int parse_name(char *buffer, char *name);
+
+
+/* Returns 1 if the channel name has a forbidden character, 0 otherwise */
+int invalid_channel_name(char channel_name[MAX_CHANNEL_LEN]);
+
+
 /*
 	Fills ipv4 buffer with the IPv4 address of socket
 */
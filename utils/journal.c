@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <journal.h>
+#include <metrics.h>
+
+#define JOURNAL_BATCH 1024		/* Messages written between syncs, at most */
+#define SEGMENT_NAME "journal-%08u.log"
+
+
+/* A queued message. Its sequence number works as in the logger's ring */
+typedef struct journal_slot{
+	uint64_t seq;
+	uint64_t time;		/* µs since the epoch */
+	Payload *payload;
+} JournalSlot;
+
+
+/* The segment being written, by the writer thread only */
+typedef struct segment{
+	int fd;
+	unsigned int number;
+	char *map;
+	size_t used;
+	size_t synced;		/* Bytes known to be on disk */
+} Segment;
+
+
+static JournalSlot *slots = NULL;
+static uint64_t tail = 0;		/* Next position to claim, by producers */
+static uint64_t head = 0;		/* Next position to write, writer only 	*/
+static uint64_t dropped = 0;	/* Messages lost to a full queue 		*/
+static int running = 0;
+static int idle = 0;			/* Set while the writer waits for messages 	*/
+static int wake_fd = -1;		/* eventfd, written to wake the writer up 	*/
+static pthread_t writer;
+
+static char journal_dir[PATH_MAX];
+static int policy;
+static int interval;		/* ms, for JOURNAL_SYNC_INTERVAL */
+static Segment segment;
+
+
+/* Claims the next free slot, or returns NULL if the queue is full */
+JournalSlot *claim_journal_slot(uint64_t *position){
+
+	uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+	while (1){
+		JournalSlot *slot = slots + (pos & (JOURNAL_SLOTS - 1));
+		uint64_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+
+		if (seq == pos){
+			if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				*position = pos;
+				return slot;
+			}
+		} else if (seq < pos){
+			return NULL;	/* The writer hasn't taken it yet */
+		} else {
+			pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+int journal_append(Payload *payload){
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return 0;
+
+	uint64_t pos;
+	JournalSlot *slot = claim_journal_slot(&pos);
+
+	if (slot == NULL){
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		metrics_count(JOURNAL_DROPPED, 1);
+		return 0;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	slot->time = (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+	slot->payload = payload_retain(payload);
+	__atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+
+	/*
+		Pairs with the fence in wait_for_messages: either
+		the writer sees this slot before blocking, or we
+		see it idle and wake it up (only one of us does).
+	*/
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&idle, __ATOMIC_RELAXED) && __atomic_exchange_n(&idle, 0, __ATOMIC_RELAXED)){
+		uint64_t wake = 1;
+		if (write(wake_fd, &wake, sizeof(wake)) < 0)
+			warn_log("journal: Could not wake up the writer");
+	}
+
+	return 1;
+}
+
+
+/* Makes what was written so far durable */
+void sync_segment(void){
+	if (segment.synced == segment.used) return;
+
+	/* msync takes page-aligned ranges */
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = segment.synced - segment.synced % page;
+
+	if (msync(segment.map + start, segment.used - start, MS_SYNC) < 0)
+		warn_log("journal: Could not sync segment %u", segment.number);
+
+	segment.synced = segment.used;
+}
+
+
+/* Syncs the segment and cuts it to its records, so no end marker is needed */
+void close_segment(void){
+	if (segment.map == NULL) return;
+
+	sync_segment();
+	munmap(segment.map, JOURNAL_SEGMENT_SIZE);
+
+	if (ftruncate(segment.fd, segment.used) < 0 || fsync(segment.fd) < 0)
+		warn_log("journal: Could not trim segment %u", segment.number);
+
+	close(segment.fd);
+	segment.map = NULL;
+}
+
+
+/*
+	Creates, preallocates and maps the segment with
+	the given number. Returns 1 on success and -1 on
+	failure, with errno set.
+*/
+int open_segment(unsigned int number){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/" SEGMENT_NAME, journal_dir, number);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0640);
+	if (fd < 0) return -1;
+
+	/* Allocating every block now keeps page faults from extending the file later */
+	int error = posix_fallocate(fd, 0, JOURNAL_SEGMENT_SIZE);
+	if (error != 0){
+		close(fd);
+		errno = error;
+		return -1;
+	}
+
+	char *map = (char *)mmap(NULL, JOURNAL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED){
+		close(fd);
+		return -1;
+	}
+
+	/* The new file's name is durable too */
+	int dir_fd = open(journal_dir, O_RDONLY | O_DIRECTORY);
+	if (dir_fd >= 0){
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	segment.fd = fd;
+	segment.number = number;
+	segment.map = map;
+	segment.used = 0;
+	segment.synced = 0;
+
+	return 1;
+}
+
+
+/* Returns the number after the highest segment in the journal directory */
+unsigned int next_segment_number(void){
+	unsigned int next = 0, number;
+
+	DIR *dir = opendir(journal_dir);
+	if (dir == NULL) return 0;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+		if (sscanf(entry->d_name, SEGMENT_NAME, &number) == 1 && number >= next)
+			next = number + 1;
+
+	closedir(dir);
+	return next;
+}
+
+
+/* Appends a record to the segment, moving on to a new one if it doesn't fit */
+void write_record(uint64_t time, Payload *payload){
+
+	size_t len = JOURNAL_RECORD_HEADER_LEN + payload->len;
+
+	if (segment.map != NULL && segment.used + len > JOURNAL_SEGMENT_SIZE){
+		unsigned int number = segment.number + 1;
+		close_segment();
+
+		if (open_segment(number) < 0)
+			warn_log("journal: Could not open segment %u: %s", number, strerror(errno));
+	}
+
+	if (segment.map == NULL) return;	/* Lost, with the segment */
+
+	char *record = segment.map + segment.used;
+	int i;
+	for (i = 0; i < JOURNAL_RECORD_HEADER_LEN; i++)
+		record[i] = (time >> (8*(JOURNAL_RECORD_HEADER_LEN - 1 - i))) & 0xFF;
+
+	memcpy(record + JOURNAL_RECORD_HEADER_LEN, payload->frame, payload->len);
+	segment.used += len;
+}
+
+
+/*
+	Blocks the writer until a message is queued, the
+	journal is stopped or timeout ms pass (-1 waits
+	for as long as it takes).
+*/
+void wait_for_messages(int timeout){
+
+	__atomic_store_n(&idle, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	JournalSlot *slot = slots + (head & (JOURNAL_SLOTS - 1));
+	if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != head + 1 && __atomic_load_n(&running, __ATOMIC_ACQUIRE)){
+		struct pollfd wake = { wake_fd, POLLIN, 0 };
+		poll(&wake, 1, timeout);
+	}
+
+	__atomic_store_n(&idle, 0, __ATOMIC_RELAXED);
+
+	/* A wake up that raced with the check above is spent here, not on the next wait */
+	uint64_t posted;
+	if (read(wake_fd, &posted, sizeof(posted)) < 0 && errno != EAGAIN)
+		warn_log("journal: Could not read wake ups");
+}
+
+
+/*
+	Body of the writer thread: copies queued messages
+	into the segment in batches, syncing per the policy,
+	and blocks whenever the queue is empty.
+*/
+void *write_journal(void *arg){
+
+	uint64_t last_sync = metrics_now();
+
+	while (1){
+		int stopping = !__atomic_load_n(&running, __ATOMIC_ACQUIRE);
+		int written = 0;
+
+		while (written < JOURNAL_BATCH){
+			JournalSlot *slot = slots + (head & (JOURNAL_SLOTS - 1));
+			if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != head + 1) break;
+
+			write_record(slot->time, slot->payload);
+			payload_release(slot->payload);
+
+			/* Hands the slot back to producers, a lap later */
+			__atomic_store_n(&(slot->seq), head + JOURNAL_SLOTS, __ATOMIC_RELEASE);
+			head++;
+			written++;
+		}
+
+		uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+		if (lost > 0)
+			warn_log("journal: %lu messages dropped, the queue was full", (unsigned long)lost);
+
+		uint64_t now = metrics_now();
+		if ((policy == JOURNAL_SYNC_BATCH && written > 0) ||\
+			(policy == JOURNAL_SYNC_INTERVAL && now - last_sync >= (uint64_t)interval*1000)){
+			sync_segment();
+			last_sync = now;
+		}
+
+		if (written > 0) continue;
+		if (stopping) break;
+
+		/* Unsynced records put a deadline on the wait */
+		int timeout = -1;
+		if (policy == JOURNAL_SYNC_INTERVAL && segment.synced != segment.used)
+			timeout = (last_sync + (uint64_t)interval*1000 - now + 999)/1000;
+
+		wait_for_messages(timeout);
+	}
+
+	close_segment();
+	return NULL;
+}
+
+
+void journal_start(const char *dir, int sync_policy, int sync_interval){
+
+	if (running) return;
+
+	strncpy(journal_dir, dir, sizeof(journal_dir) - 1);
+	policy = sync_policy;
+	interval = sync_interval;
+
+	if (open_segment(next_segment_number()) < 0)
+		exit_error("journal_start: Could not create segment");
+
+	slots = (JournalSlot *)malloc(JOURNAL_SLOTS*sizeof(JournalSlot));
+	if (slots == NULL)
+		exit_error("journal_start: Could not allocate queue");
+
+	uint64_t i;
+	for (i = 0; i < JOURNAL_SLOTS; i++)
+		slots[i].seq = i;
+
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (wake_fd < 0)
+		exit_error("journal_start: Could not create eventfd");
+
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&writer, NULL, write_journal, NULL) != 0)
+		exit_error("journal_start: Could not create writer thread");
+
+	atexit(journal_stop);
+}
+
+
+void journal_stop(void){
+
+	if (!__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL)) return;
+
+	uint64_t wake = 1;
+	if (write(wake_fd, &wake, sizeof(wake)) < 0)
+		warn_log("journal: Could not wake up the writer");
+
+	pthread_join(writer, NULL);
+	close(wake_fd);
+}
+
+
+int journal_sync_parse(const char *name, int *sync_interval){
+	if (!strcmp(name, "batch")) return JOURNAL_SYNC_BATCH;
+	if (!strcmp(name, "none")) return JOURNAL_SYNC_NONE;
+
+	*sync_interval = atoi(name);
+	return *sync_interval > 0 ? JOURNAL_SYNC_INTERVAL : -1;
+}
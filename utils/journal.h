@@ -0,0 +1,62 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include <irc_utils.h>
+#include <payload.h>
+
+#define JOURNAL_SLOTS 65536					/* Messages the queue holds, a power of 2 	*/
+#define JOURNAL_SEGMENT_SIZE (64 << 20)		/* Bytes preallocated per segment file 		*/
+#define JOURNAL_RECORD_HEADER_LEN 8
+
+/*
+	The journal is a directory of segment files,
+	journal-<sequence>.log, each holding records back
+	to back: an 8-byte big-endian timestamp (µs since
+	the epoch) followed by the message's frame, as it
+	was sent. A zero timestamp ends a segment whose
+	preallocated space was not used up; segments
+	that were closed cleanly are cut to their records.
+*/
+
+
+/* When the writer makes what it wrote durable */
+enum JOURNAL_SYNC_POLICIES {
+	JOURNAL_SYNC_BATCH,		/* After every batch it takes from the queue (group commit) */
+	JOURNAL_SYNC_INTERVAL,	/* At most every sync_interval milliseconds 				*/
+	JOURNAL_SYNC_NONE		/* Whenever the kernel writes the pages back 				*/
+};
+
+
+/*
+	Opens a new segment in dir (after any that are
+	already there) and starts the writer thread. The
+	journal is closed before the program exits.
+
+	Exits if the directory can't be written to.
+*/
+void journal_start(const char *dir, int sync_policy, int sync_interval);
+
+
+/*
+	Queues payload to be journaled, retaining it
+	(see payload_retain) until it is written, and
+	never blocks. If the queue is full the message
+	is dropped instead.
+
+	Returns 1 if queued, 0 if dropped or the
+	journal was not started.
+*/
+int journal_append(Payload *payload);
+
+
+/* Writes out every queued message, syncs and closes the journal */
+void journal_stop(void);
+
+
+/* Returns the JOURNAL_SYNC_POLICIES value named name ("batch", "none" or milliseconds), or -1 */
+int journal_sync_parse(const char *name, int *sync_interval);
+
+
+#endif
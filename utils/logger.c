@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <irc_utils.h>
+#include <logger.h>
+
+#define LOG_BATCH_LEN (64*LOG_LINE_LEN)		/* Bytes written per syscall, at most */
+
+
+/*
+	A line in the ring. Its sequence number tells
+	whose turn it is: producers claim the slot when
+	it equals their position, and the flusher reads
+	it once it is one past that (Vyukov's bounded
+	queue, with a single consumer).
+*/
+typedef struct log_slot{
+	uint64_t seq;
+	int len;
+	char line[LOG_LINE_LEN];
+} LogSlot;
+
+
+int log_level = LOG_INFO;
+
+static LogSlot *slots = NULL;
+static uint64_t tail = 0;		/* Next position to claim, by producers 	*/
+static uint64_t head = 0;		/* Next position to write out, flusher only */
+static uint64_t dropped = 0;	/* Lines lost to a full ring 				*/
+static int running = 0;
+static int idle = 0;			/* Set while the flusher waits for lines 	*/
+static int wake_fd = -1;		/* eventfd, written to wake the flusher up 	*/
+static pthread_t flusher;
+
+
+/* Claims the next free slot, or returns NULL if the ring is full */
+LogSlot *log_claim_slot(uint64_t *position){
+
+	uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+
+	while (1){
+		LogSlot *slot = slots + (pos & (LOG_SLOTS - 1));
+		uint64_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+
+		if (seq == pos){
+			if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				*position = pos;
+				return slot;
+			}
+		} else if (seq < pos){
+			return NULL;	/* The flusher hasn't written it out yet */
+		} else {
+			pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+void log_write(const char *format, ...){
+
+	va_list args;
+	va_start(args, format);
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)){
+		vprintf(format, args);
+		va_end(args);
+		return;
+	}
+
+	uint64_t pos;
+	LogSlot *slot = log_claim_slot(&pos);
+
+	if (slot == NULL){
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		va_end(args);
+		return;
+	}
+
+	int len = vsnprintf(slot->line, LOG_LINE_LEN, format, args);
+	va_end(args);
+
+	if (len < 0) len = 0;
+	if (len >= LOG_LINE_LEN){
+		len = LOG_LINE_LEN - 1;
+		slot->line[len - 1] = '\n';		/* Truncated lines still end theirs */
+	}
+
+	slot->len = len;
+	__atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in log_wait_for_lines, so that an idle flusher is always woken up */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&idle, __ATOMIC_RELAXED) && __atomic_exchange_n(&idle, 0, __ATOMIC_RELAXED)){
+		uint64_t wake = 1;
+		if (write(wake_fd, &wake, sizeof(wake)) < 0)
+			fprintf(stderr, "log_write: Could not wake up the flusher\n");
+	}
+}
+
+
+void log_write_batch(const char *batch, size_t len){
+	while (len > 0){
+		ssize_t written = write(STDOUT_FILENO, batch, len);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) return;
+
+		batch += written;
+		len -= written;
+	}
+}
+
+
+/* Blocks the flusher until a line is logged or the logger is stopped */
+void log_wait_for_lines(void){
+
+	__atomic_store_n(&idle, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	LogSlot *slot = slots + (head & (LOG_SLOTS - 1));
+	if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != head + 1 && __atomic_load_n(&running, __ATOMIC_ACQUIRE)){
+		struct pollfd wake = { wake_fd, POLLIN, 0 };
+		poll(&wake, 1, -1);
+	}
+
+	__atomic_store_n(&idle, 0, __ATOMIC_RELAXED);
+
+	/* Spends any wake up that raced with the check above */
+	uint64_t posted;
+	if (read(wake_fd, &posted, sizeof(posted)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "logger: Could not read wake ups\n");
+}
+
+
+/*
+	Body of the flusher thread: copies out every
+	line logged so far, frees their slots, and
+	writes them with one syscall. Blocks whenever
+	the ring is empty.
+*/
+void *log_flush_ring(void *arg){
+
+	char batch[LOG_BATCH_LEN];
+
+	while (1){
+		int stopping = !__atomic_load_n(&running, __ATOMIC_ACQUIRE);
+		size_t used = 0;
+
+		while (used + LOG_LINE_LEN <= LOG_BATCH_LEN){
+			LogSlot *slot = slots + (head & (LOG_SLOTS - 1));
+			if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != head + 1) break;
+
+			memcpy(batch + used, slot->line, slot->len);
+			used += slot->len;
+
+			/* Hands the slot back to producers, a lap later */
+			__atomic_store_n(&(slot->seq), head + LOG_SLOTS, __ATOMIC_RELEASE);
+			head++;
+		}
+
+		uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+		if (lost > 0)
+			used += sprintf(batch + used, "logger: %lu lines dropped\n", (unsigned long)lost);
+
+		/* Once stopped, it still waits for slots claimed but not yet filled */
+		if (used > 0) log_write_batch(batch, used);
+		else if (stopping && head == __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) break;
+		else log_wait_for_lines();
+	}
+
+	return NULL;
+}
+
+
+void logger_start(void){
+
+	if (running) return;
+
+	slots = (LogSlot *)malloc(LOG_SLOTS*sizeof(LogSlot));
+	if (slots == NULL)
+		exit_error("logger_start: Could not allocate log ring");
+
+	int i;
+	for (i = 0; i < LOG_SLOTS; i++)
+		slots[i].seq = i;
+
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (wake_fd < 0)
+		exit_error("logger_start: Could not create eventfd");
+
+	/* Lines printed so far go out before the flusher's */
+	fflush(stdout);
+
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&flusher, NULL, log_flush_ring, NULL) != 0)
+		exit_error("logger_start: Could not create flusher thread");
+
+	atexit(logger_stop);
+}
+
+
+void logger_stop(void){
+
+	if (!__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL)) return;
+
+	uint64_t wake = 1;
+	if (write(wake_fd, &wake, sizeof(wake)) < 0)
+		fprintf(stderr, "logger_stop: Could not wake up the flusher\n");
+
+	pthread_join(flusher, NULL);
+	close(wake_fd);
+}
+
+
+int log_level_parse(const char *name){
+	const char *names[] = { "debug", "info", "warn", "error", "off" };
+
+	int i;
+	for (i = 0; i <= LOG_OFF; i++)
+		if (!strcmp(name, names[i])) return i;
+
+	return -1;
+}
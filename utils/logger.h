@@ -0,0 +1,46 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+
+#define LOG_SLOTS 4096			/* Lines the ring holds, a power of 2 	*/
+#define LOG_LINE_LEN 256		/* Longer lines are truncated 			*/
+
+
+/* Only messages at or above the current level are logged */
+enum LOG_LEVELS {
+	LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF
+};
+
+
+extern int log_level;
+
+
+/*
+	Formats a log line and hands it to the flusher
+	thread through a lock-free ring, so that the
+	caller never blocks on stdout. If the ring is
+	full the line is dropped (and counted) instead.
+
+	Before logger_start, lines are printed right away.
+*/
+void log_write(const char *format, ...);
+
+
+/*
+	Starts the flusher thread, which writes out the
+	lines logged from then on in batches. It drains
+	the ring before the program exits.
+*/
+void logger_start(void);
+
+
+/* Drains the ring and stops the flusher thread */
+void logger_stop(void);
+
+
+/* Returns the LOG_LEVELS value named name (e.g. "debug"), or -1 */
+int log_level_parse(const char *name);
+
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <irc_utils.h>
+#include <mailbox.h>
+
+
+void mailbox_init(Mailbox *box){
+	box->stub.next = NULL;
+	box->head = &(box->stub);
+	box->tail = &(box->stub);
+	box->pending = 0;
+}
+
+
+/* Links node after the last posted one */
+void push_node(Mailbox *box, MailNode *node){
+	__atomic_store_n(&(node->next), NULL, __ATOMIC_RELAXED);
+	MailNode *previous = __atomic_exchange_n(&(box->head), node, __ATOMIC_ACQ_REL);
+
+	/* Until this store, the owner can't get past previous */
+	__atomic_store_n(&(previous->next), node, __ATOMIC_RELEASE);
+}
+
+
+int mailbox_post(Mailbox *box, MailNode *node){
+	push_node(box, node);
+
+	/* Only after linking, so an owner that rearmed before this will see the node */
+	return __atomic_exchange_n(&(box->pending), 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+
+void mailbox_rearm(Mailbox *box){
+	/* An exchange, not a store: it syncs with the last post that set pending */
+	__atomic_exchange_n(&(box->pending), 0, __ATOMIC_ACQ_REL);
+}
+
+
+MailNode *mailbox_take(Mailbox *box){
+
+	MailNode *tail = box->tail;
+	MailNode *next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+
+	/* The stub is never handed out: skip it */
+	if (tail == &(box->stub)){
+		if (next == NULL) return NULL;
+		box->tail = next;
+		tail = next;
+		next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+	}
+
+	if (next != NULL){
+		box->tail = next;
+		return tail;
+	}
+
+	/* tail is the last node, unless a post is halfway done */
+	if (tail != __atomic_load_n(&(box->head), __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* Puts the stub back behind tail, so that tail can be taken */
+	push_node(box, &(box->stub));
+
+	next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+	if (next != NULL){
+		box->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+
+/* Embedded at the start of whatever is posted to a mailbox */
+typedef struct mail_node{
+	struct mail_node *next;
+} MailNode;
+
+
+/*
+	Lock-free queue that any thread may post to,
+	but only its owner takes from (an intrusive
+	multi-producer single-consumer queue). Posting
+	is a single atomic exchange, and mail from one
+	thread is taken in the order it was posted.
+
+	The owner sleeps somewhere else (e.g. in epoll),
+	so the mailbox also tracks whether it must be
+	woken up: only the first post after the owner
+	rearms the mailbox asks for a wakeup.
+*/
+typedef struct mailbox{
+	MailNode *head;		/* Last node posted, swapped by producers 	*/
+	MailNode *tail;		/* Next node to take, owner only 			*/
+	MailNode stub;		/* Keeps the queue from ever being empty 	*/
+	int pending;		/* Whether a wakeup was already asked for 	*/
+} Mailbox;
+
+
+/* Makes box empty */
+void mailbox_init(Mailbox *box);
+
+
+/*
+	Posts node to box. Safe to call from any thread.
+
+	Returns 1 if the owner must be woken up to take
+	it, and 0 if a wakeup is already on its way.
+*/
+int mailbox_post(Mailbox *box, MailNode *node);
+
+
+/*
+	Called by the owner once it wakes up, before
+	taking mail: later posts will ask for a wakeup.
+*/
+void mailbox_rearm(Mailbox *box);
+
+
+/*
+	Takes the oldest node from box. Owner only.
+
+	Returns NULL if box is empty, or if the next node
+	is still being posted (its poster then wakes the
+	owner up once it is done).
+*/
+MailNode *mailbox_take(Mailbox *box);
+
+
+#endif
@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include <irc_utils.h>
+#include <metrics.h>
+
+
+static __thread Metrics *local_metrics = NULL;
+
+
+/* Prometheus names, with their labels. Counters that share a name are listed together */
+static const char *COUNTER_NAMES[N_COUNTERS] = {
+	"irc_messages_in_total", "irc_messages_out_total",
+	"irc_bytes_in_total", "irc_bytes_out_total", "irc_send_retries_total",
+	"irc_disconnects_total{reason=\"quit\"}",
+	"irc_disconnects_total{reason=\"lost\"}",
+	"irc_disconnects_total{reason=\"dropped\"}",
+	"irc_journal_dropped_total",
+	"irc_throttled_total{limit=\"chat\"}",
+	"irc_throttled_total{limit=\"commands\"}",
+	"irc_throttled_total{limit=\"channel\"}",
+	"irc_slow_consumers_total{action=\"disconnect\"}",
+	"irc_slow_consumers_total{action=\"drop_oldest\"}",
+	"irc_slow_consumer_dropped_messages_total"
+};
+
+static const char *HISTOGRAM_NAMES[N_HISTOGRAMS] = {
+	"irc_fanout_size", "irc_queue_depth", "irc_delivery_latency_microseconds"
+};
+
+
+void metrics_attach(Metrics *metrics){
+	local_metrics = metrics;
+}
+
+
+/* Single writer: a relaxed store keeps concurrent readers from seeing torn values */
+void add_relaxed(uint64_t *value, uint64_t n){
+	__atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+
+void metrics_count(int counter, uint64_t n){
+	if (local_metrics != NULL)
+		add_relaxed(local_metrics->counters + counter, n);
+}
+
+
+int histogram_bucket(uint64_t value){
+	if (value < HISTOGRAM_SUB_BUCKETS) return (int)value;
+
+	int exponent = 63 - __builtin_clzll(value);
+	int sub_bucket = (int)(value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+
+	return (exponent - HISTOGRAM_SUB_BITS + 1)*HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+
+/* Smallest value that falls in the given bucket */
+uint64_t bucket_floor(int bucket){
+	if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+
+	int exponent = bucket/HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	uint64_t sub_bucket = bucket % HISTOGRAM_SUB_BUCKETS;
+
+	return (HISTOGRAM_SUB_BUCKETS + sub_bucket) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+
+void metrics_record(int histogram, uint64_t value){
+	if (local_metrics == NULL) return;
+
+	Histogram *h = local_metrics->histograms + histogram;
+	add_relaxed(h->buckets + histogram_bucket(value), 1);
+	add_relaxed(&(h->count), 1);
+	add_relaxed(&(h->sum), value);
+}
+
+
+void metrics_merge(Metrics *total, Metrics *metrics){
+	int i, j;
+	for (i = 0; i < N_COUNTERS; i++)
+		total->counters[i] += __atomic_load_n(metrics->counters + i, __ATOMIC_RELAXED);
+
+	for (i = 0; i < N_HISTOGRAMS; i++){
+		Histogram *from = metrics->histograms + i, *to = total->histograms + i;
+
+		for (j = 0; j < HISTOGRAM_BUCKETS; j++)
+			to->buckets[j] += __atomic_load_n(from->buckets + j, __ATOMIC_RELAXED);
+		to->count += __atomic_load_n(&(from->count), __ATOMIC_RELAXED);
+		to->sum += __atomic_load_n(&(from->sum), __ATOMIC_RELAXED);
+	}
+}
+
+
+uint64_t histogram_percentile(Histogram *histogram, double fraction){
+
+	/* Buckets are summed rather than trusting count, which may be a little ahead */
+	uint64_t samples = 0, seen = 0;
+	int i;
+	for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+		samples += histogram->buckets[i];
+
+	if (samples == 0) return 0;
+
+	uint64_t rank = (uint64_t)(fraction*samples);
+	if (rank >= samples) rank = samples - 1;
+
+	for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++){
+		seen += histogram->buckets[i];
+		if (seen > rank) break;
+	}
+
+	/* The highest value its bucket stands for */
+	return i < HISTOGRAM_BUCKETS - 1 ? bucket_floor(i + 1) - 1 : UINT64_MAX;
+}
+
+
+uint64_t metrics_now(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+
+/* Appends to out as in printf, never past size */
+void append_text(char *out, int size, int *used, const char *format, ...){
+	if (*used >= size - 1) return;
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(out + *used, size - *used, format, args);
+	va_end(args);
+
+	if (len > 0) *used += len < size - *used ? len : size - *used - 1;
+}
+
+
+int metrics_format(Metrics *metrics, char *out, int size){
+
+	const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+	int used = 0, i, j;
+	out[0] = '\0';
+
+	for (i = 0; i < N_COUNTERS; i++){
+		const char *name = COUNTER_NAMES[i];
+		int base_len = strcspn(name, "{");
+
+		if (i == 0 || strncmp(name, COUNTER_NAMES[i - 1], base_len) != 0)
+			append_text(out, size, &used, "# TYPE %.*s counter\n", base_len, name);
+
+		append_text(out, size, &used, "%s %lu\n", name, (unsigned long)metrics->counters[i]);
+	}
+
+	for (i = 0; i < N_HISTOGRAMS; i++){
+		const char *name = HISTOGRAM_NAMES[i];
+		Histogram *histogram = metrics->histograms + i;
+
+		append_text(out, size, &used, "# TYPE %s summary\n", name);
+		for (j = 0; j < sizeof(QUANTILES)/sizeof(QUANTILES[0]); j++)
+			append_text(out, size, &used, "%s{quantile=\"%g\"} %lu\n", name, QUANTILES[j],\
+						(unsigned long)histogram_percentile(histogram, QUANTILES[j]));
+
+		append_text(out, size, &used, "%s_sum %lu\n", name, (unsigned long)histogram->sum);
+		append_text(out, size, &used, "%s_count %lu\n", name, (unsigned long)histogram->count);
+	}
+
+	return used;
+}
@@ -0,0 +1,84 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+/*
+	HDR-style buckets: exact below HISTOGRAM_SUB_BUCKETS,
+	then that many linear sub-buckets per power of 2,
+	which keeps every value within 12.5% of its bucket.
+*/
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1)*HISTOGRAM_SUB_BUCKETS)
+
+
+enum COUNTERS {
+	MESSAGES_IN, MESSAGES_OUT, BYTES_IN, BYTES_OUT, SEND_RETRIES,
+	QUITS, CONNECTIONS_LOST, CLIENTS_DROPPED, JOURNAL_DROPPED,
+	CHAT_THROTTLED, COMMANDS_THROTTLED, CHANNEL_THROTTLED,
+	SLOW_DISCONNECTED, SLOW_TRIMMED, SLOW_MESSAGES_DROPPED, N_COUNTERS
+};
+
+
+enum HISTOGRAMS {
+	FANOUT_SIZE,		/* Recipients per channel message 				*/
+	QUEUE_DEPTH,		/* Frames in a client's queue, once pushed to 	*/
+	DELIVERY_LATENCY,	/* From a message's receipt to its last send, in µs */
+	N_HISTOGRAMS
+};
+
+
+typedef struct histogram{
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum;
+} Histogram;
+
+
+/*
+	A thread's own counters and histograms. Only that
+	thread writes them, with plain (relaxed) stores,
+	and any thread may read them to aggregate.
+*/
+typedef struct metrics{
+	uint64_t counters[N_COUNTERS];
+	Histogram histograms[N_HISTOGRAMS];
+} Metrics;
+
+
+/* Has the calling thread record into metrics from now on */
+void metrics_attach(Metrics *metrics);
+
+
+/* Adds n to the calling thread's counter. Does nothing on threads without metrics */
+void metrics_count(int counter, uint64_t n);
+
+
+/* Records value in the calling thread's histogram. Does nothing on threads without metrics */
+void metrics_record(int histogram, uint64_t value);
+
+
+/* Adds a snapshot of metrics, which another thread may be writing, to total */
+void metrics_merge(Metrics *total, Metrics *metrics);
+
+
+/* Returns the value below which the given fraction (e.g. 0.99) of samples falls */
+uint64_t histogram_percentile(Histogram *histogram, double fraction);
+
+
+/* Microseconds on a monotonic clock */
+uint64_t metrics_now(void);
+
+
+/*
+	Writes metrics to out in the Prometheus text format,
+	histograms as summaries. At most size bytes are
+	written, including the '\0'.
+
+	Returns the length of the text.
+*/
+int metrics_format(Metrics *metrics, char *out, int size);
+
+
+#endif
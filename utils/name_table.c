@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <irc_utils.h>
+#include <name_table.h>
+
+#define MIN_CAPACITY 8
+
+/* Marks entries whose name was removed, so that probing goes on past them */
+static const char deleted_name[] = "";
+#define DELETED deleted_name
+
+
+/* FNV-1a hash */
+uint32_t hash_name(const char *name){
+	uint32_t hash = 2166136261u;
+	while (*name != '\0'){
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+NameEntry *allocate_entries(int capacity){
+	NameEntry *entries = (NameEntry *)calloc(capacity, sizeof(NameEntry));
+	if (entries == NULL)
+		exit_error("name_table: Could not allocate entries");
+
+	return entries;
+}
+
+
+NameTable *name_table_create(int capacity){
+	NameTable *table = (NameTable *)malloc(sizeof(NameTable));
+	if (table == NULL)
+		exit_error("name_table_create: Could not allocate table");
+
+	/* Keeps the load factor under 3/4 */
+	table->capacity = MIN_CAPACITY;
+	while (table->capacity*3 < capacity*4) table->capacity *= 2;
+
+	table->entries = allocate_entries(table->capacity);
+	table->size = 0;
+	table->used = 0;
+
+	return table;
+}
+
+
+void name_table_free(NameTable *table){
+	free(table->entries);
+	free(table);
+}
+
+
+/*
+	Returns the entry holding name or, if the name
+	isn't in the table, the entry where it should be
+	inserted.
+*/
+NameEntry *find_entry(NameTable *table, const char *name, uint32_t hash){
+	
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = hash & mask;
+	NameEntry *free_entry = NULL;
+
+	while (1){
+		NameEntry *entry = table->entries + i;
+
+		if (entry->name == NULL)
+			return free_entry != NULL ? free_entry : entry;
+
+		if (entry->name == DELETED){
+			if (free_entry == NULL) free_entry = entry;
+		} else if (entry->hash == hash && !strcmp(entry->name, name)){
+			return entry;
+		}
+
+		i = (i + 1) & mask;
+	}
+}
+
+
+/* Rehashes every name into a table of the given capacity, dropping deleted entries */
+void resize(NameTable *table, int capacity){
+
+	NameEntry *old_entries = table->entries;
+	int i, old_capacity = table->capacity;
+
+	table->entries = allocate_entries(capacity);
+	table->capacity = capacity;
+	table->used = table->size;
+
+	for (i = 0; i < old_capacity; i++){
+		NameEntry *entry = old_entries + i;
+		if (entry->name != NULL && entry->name != DELETED)
+			*find_entry(table, entry->name, entry->hash) = *entry;
+	}
+
+	free(old_entries);
+}
+
+
+void *name_table_get(NameTable *table, const char *name){
+	NameEntry *entry = find_entry(table, name, hash_name(name));
+	return (entry->name == NULL || entry->name == DELETED) ? NULL : entry->value;
+}
+
+
+int name_table_put(NameTable *table, const char *name, void *value){
+
+	uint32_t hash = hash_name(name);
+	NameEntry *entry = find_entry(table, name, hash);
+
+	if (entry->name != NULL && entry->name != DELETED) return 0;
+
+	if (entry->name == NULL){
+		/* Uses up an empty entry, so the table may need room */
+		if ((table->used + 1)*4 > table->capacity*3){
+			resize(table, (table->size + 1)*2 > table->capacity ? 2*table->capacity : table->capacity);
+			entry = find_entry(table, name, hash);
+		}
+		table->used++;
+	}
+
+	entry->name = name;
+	entry->hash = hash;
+	entry->value = value;
+	table->size++;
+
+	return 1;
+}
+
+
+void *name_table_remove(NameTable *table, const char *name){
+
+	NameEntry *entry = find_entry(table, name, hash_name(name));
+	if (entry->name == NULL || entry->name == DELETED) return NULL;
+
+	entry->name = DELETED;
+	table->size--;
+
+	return entry->value;
+}
+
+
+int name_table_size(NameTable *table){
+	return table->size;
+}
+
+
+void *name_table_next(NameTable *table, int *position){
+
+	while (*position < table->capacity){
+		NameEntry *entry = table->entries + (*position)++;
+		if (entry->name != NULL && entry->name != DELETED) return entry->value;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,78 @@
+#ifndef NAME_TABLE_H
+#define NAME_TABLE_H
+
+#include <stdint.h>
+
+
+typedef struct name_entry{
+	const char *name;	/* NULL if empty */
+	uint32_t hash;
+	void *value;
+} NameEntry;
+
+
+/*
+	Hash table that maps \0-terminated names to
+	pointers, using open addressing with linear
+	probing. It grows as needed, so lookups stay
+	O(1) regardless of how many names it holds.
+
+	The table does not copy names: each name must
+	stay valid (and unchanged) until it is removed.
+	This lets a structure be indexed by a name it
+	stores itself.
+*/
+typedef struct name_table{
+	NameEntry *entries;
+	int capacity;	/* Always a power of 2 */
+	int size;		/* Names in the table */
+	int used;		/* Names plus deleted entries */
+} NameTable;
+
+
+/*
+	Creates an empty table with room for at least
+	capacity names before growing. Must be freed
+	with name_table_free.
+
+	Exits if the allocation fails.
+*/
+NameTable *name_table_create(int capacity);
+
+
+/* Frees the table (but not the names or values) */
+void name_table_free(NameTable *table);
+
+
+/* Returns the value mapped to name, or NULL if there is none */
+void *name_table_get(NameTable *table, const char *name);
+
+
+/*
+	Maps name to value.
+
+	Returns 1 on success and 0 if the name was
+	already in the table (which is not altered).
+*/
+int name_table_put(NameTable *table, const char *name, void *value);
+
+
+/* Removes name, returning its value or NULL if it wasn't in the table */
+void *name_table_remove(NameTable *table, const char *name);
+
+
+/* Returns the number of names in the table */
+int name_table_size(NameTable *table);
+
+
+/*
+	Walks the table: returns the value of the first
+	name at or after *position, which is moved past
+	it, or NULL once there are none left. Start with
+	*position set to 0. The table must not change
+	in between.
+*/
+void *name_table_next(NameTable *table, int *position);
+
+
+#endif
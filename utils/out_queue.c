@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <out_queue.h>
+#include <metrics.h>
+
+
+void out_queue_init(OutQueue *queue, int max_bytes){
+	queue->entries = NULL;
+	queue->head = 0;
+	queue->count = 0;
+	queue->capacity = 0;
+	queue->sent = 0;
+	queue->bytes = 0;
+	queue->max_bytes = max_bytes;
+}
+
+
+void out_queue_clear(OutQueue *queue){
+	int i;
+	for (i = 0; i < queue->count; i++)
+		payload_unref(queue->entries[(queue->head + i) % queue->capacity]);
+
+	free(queue->entries);
+	out_queue_init(queue, queue->max_bytes);
+}
+
+
+/* Doubles the ring's capacity, unwrapping its entries */
+void out_queue_grow(OutQueue *queue){
+	int i, new_capacity = queue->capacity > 0 ? 2*queue->capacity : OUT_QUEUE_INITIAL_CAPACITY;
+
+	Payload **entries = (Payload **)malloc(new_capacity*sizeof(Payload *));
+	if (entries == NULL)
+		exit_error("out_queue_grow: Could not allocate queue entries");
+
+	for (i = 0; i < queue->count; i++)
+		entries[i] = queue->entries[(queue->head + i) % queue->capacity];
+
+	free(queue->entries);
+	queue->entries = entries;
+	queue->capacity = new_capacity;
+	queue->head = 0;
+}
+
+
+int out_queue_push(OutQueue *queue, Payload *payload){
+
+	if (queue->bytes + payload->len > queue->max_bytes) return -1;
+
+	if (queue->count == queue->capacity) out_queue_grow(queue);
+
+	queue->entries[(queue->head + queue->count) % queue->capacity] = payload_ref(payload);
+	queue->count++;
+	queue->bytes += payload->len;
+
+	return 1;
+}
+
+
+int out_queue_trim(OutQueue *queue, int keep, int max_bytes){
+
+	if (keep == 0 && queue->sent > 0) keep = 1;
+
+	int i, dropped = 0;
+	while (keep + dropped < queue->count && queue->bytes > max_bytes){
+		Payload *payload = queue->entries[(queue->head + keep + dropped) % queue->capacity];
+		queue->bytes -= payload->len;
+		payload_unref(payload);
+		dropped++;
+	}
+
+	/* The kept frames move up to the first one left, closing the gap */
+	for (i = keep - 1; i >= 0 && dropped > 0; i--)
+		queue->entries[(queue->head + dropped + i) % queue->capacity] =\
+			queue->entries[(queue->head + i) % queue->capacity];
+
+	queue->head = (queue->head + dropped) % queue->capacity;
+	queue->count -= dropped;
+
+	return dropped;
+}
+
+
+int out_queue_flush(OutQueue *queue, Socket *socket){
+
+	int sent_bytes;
+	struct iovec iov[OUT_QUEUE_MAX_IOV];
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+
+	while (queue->count > 0){
+		/* writev can't take MSG_NOSIGNAL, sendmsg can */
+		msg.msg_iovlen = out_queue_gather(queue, iov, OUT_QUEUE_MAX_IOV);
+		sent_bytes = sendmsg(socket->sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (sent_bytes < 0){
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+			/* The rest waits for the socket to be writable again */
+			metrics_count(SEND_RETRIES, 1);
+			return 0;
+		}
+
+		out_queue_consume(queue, sent_bytes);
+	}
+
+	return 1;
+}
+
+
+int out_queue_gather(OutQueue *queue, struct iovec iov[], int max_iov){
+
+	int i, offset = queue->sent;
+	for (i = 0; i < queue->count && i < max_iov; i++){
+		Payload *payload = queue->entries[(queue->head + i) % queue->capacity];
+
+		iov[i].iov_base = payload->frame + offset;
+		iov[i].iov_len = payload->len - offset;
+		offset = 0;
+	}
+
+	return i;
+}
+
+
+void out_queue_consume(OutQueue *queue, int bytes){
+
+	metrics_count(BYTES_OUT, bytes);
+
+	while (bytes > 0 && queue->count > 0){
+		Payload *payload = queue->entries[queue->head];
+		int written = payload->len - queue->sent;
+		if (written > bytes) written = bytes;
+
+		queue->sent += written;
+		queue->bytes -= written;
+		bytes -= written;
+		if (queue->sent < payload->len) break;
+
+		payload_unref(payload);
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		queue->sent = 0;
+	}
+}
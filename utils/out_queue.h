@@ -0,0 +1,100 @@
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <sys/uio.h>
+
+#include <irc_utils.h>
+#include <payload.h>
+
+#define MAX_QUEUED_BYTES (16*MAX_FRAME_LEN)
+#define OUT_QUEUE_INITIAL_CAPACITY 4
+#define OUT_QUEUE_MAX_IOV 32		/* Frames written per syscall, at most */
+
+
+/*
+	Bounded FIFO of frames waiting to be written
+	to a non-blocking socket. The entries live in
+	a ring that grows on demand, so an idle
+	connection only pays for a few slots.
+	Frames are shared payloads, never copies.
+*/
+typedef struct out_queue{
+	Payload **entries;
+	int head;		/* Index of the oldest entry */
+	int count;
+	int capacity;
+
+	int sent;		/* Bytes of the oldest entry already written */
+	int bytes;		/* Bytes queued, not counting sent */
+	int max_bytes;
+} OutQueue;
+
+
+/*
+	Initializes an empty queue that holds at
+	most max_bytes bytes of pending frames.
+*/
+void out_queue_init(OutQueue *queue, int max_bytes);
+
+
+/* Discards all pending frames and frees the queue's memory */
+void out_queue_clear(OutQueue *queue);
+
+
+/*
+	Appends payload to the queue, taking a new
+	reference to it. The reference is dropped
+	once the payload is written or discarded.
+
+	Returns 1 on success and -1 if the queue
+	would exceed its maximum size (in which
+	case nothing is appended).
+*/
+int out_queue_push(OutQueue *queue, Payload *payload);
+
+
+/*
+	Discards the oldest pending frames until at most
+	max_bytes are queued, passing over the first keep
+	of them (e.g. handed to io_uring already) and a
+	frame that is partly written, so that the stream
+	stays whole.
+
+	Returns how many frames were discarded.
+*/
+int out_queue_trim(OutQueue *queue, int keep, int max_bytes);
+
+
+/*
+	Writes as many pending frames as the socket
+	accepts without blocking, gathering up to
+	OUT_QUEUE_MAX_IOV of them into each syscall.
+
+	Returns 1 if the queue was emptied, 0 if the
+	socket is full (wait until it is writable and
+	call again) and -1 if the connection failed.
+*/
+int out_queue_flush(OutQueue *queue, Socket *socket);
+
+
+/*
+	Points iov at the unwritten bytes of the oldest
+	pending frames, one entry per frame, for a
+	gathering write done elsewhere (e.g. by io_uring).
+	The frames stay queued until consumed.
+
+	Returns how many entries were filled in, at
+	most max_iov and 0 if the queue is empty.
+*/
+int out_queue_gather(OutQueue *queue, struct iovec iov[], int max_iov);
+
+
+/*
+	Marks the given number of pending bytes as
+	written, for writes done elsewhere (e.g. by io_uring),
+	dropping the frames that were fully written.
+*/
+void out_queue_consume(OutQueue *queue, int bytes);
+
+
+#endif
@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <payload.h>
+#include <metrics.h>
+
+
+Payload *payload_create(const char *format, ...){
+
+	char msg[WHOLE_MSG_LEN + 1];
+	va_list args;
+
+	va_start(args, format);
+	int msg_len = vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+
+	if (msg_len < 0) msg_len = 0;
+	if (msg_len > WHOLE_MSG_LEN) msg_len = WHOLE_MSG_LEN;
+
+	Payload *payload = (Payload *)malloc(sizeof(Payload) + FRAME_HEADER_LEN + msg_len);
+	if (payload == NULL)
+		exit_error("payload_create: Could not allocate payload");
+
+	payload->refs = 1;
+	payload->retained = 0;
+	payload->received = 0;
+	payload->seq = 0;
+	payload->len = frame_encode(payload->frame, msg, msg_len);
+
+	return payload;
+}
+
+
+Payload *payload_ref(Payload *payload){
+	__atomic_add_fetch(&(payload->refs), 1, __ATOMIC_RELAXED);
+	return payload;
+}
+
+
+void payload_unref(Payload *payload){
+
+	int refs = __atomic_load_n(&(payload->refs), __ATOMIC_ACQUIRE);
+
+	while (1){
+		int retained = __atomic_load_n(&(payload->retained), __ATOMIC_ACQUIRE);
+
+		/*
+			Its last queue is about to send it (or give up).
+			The time is taken while this reference still keeps
+			it alive, and only once: queues it is replayed to
+			later (e.g. from history) find it untimed.
+		*/
+		if (refs - 1 == retained){
+			uint64_t received = __atomic_exchange_n(&(payload->received), 0, __ATOMIC_ACQ_REL);
+			if (received != 0)
+				metrics_record(DELIVERY_LATENCY, metrics_now() - received);
+
+			refs = __atomic_sub_fetch(&(payload->refs), 1, __ATOMIC_ACQ_REL);
+			break;
+		}
+
+		/* Otherwise others still hold it, unless they drop it meanwhile: then it goes around again */
+		if (__atomic_compare_exchange_n(&(payload->refs), &refs, refs - 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+			refs--;
+			break;
+		}
+	}
+
+	if (refs == 0) free(payload);
+}
+
+
+Payload *payload_retain(Payload *payload){
+	__atomic_add_fetch(&(payload->retained), 1, __ATOMIC_RELEASE);
+	return payload_ref(payload);
+}
+
+
+void payload_release(Payload *payload){
+	/* Queues still holding it record the latency once they are done */
+	__atomic_sub_fetch(&(payload->retained), 1, __ATOMIC_RELEASE);
+
+	/* Otherwise it was recorded when this became the last reference */
+	if (__atomic_sub_fetch(&(payload->refs), 1, __ATOMIC_ACQ_REL) == 0)
+		free(payload);
+}
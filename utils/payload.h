@@ -0,0 +1,68 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdint.h>
+
+#include <irc_utils.h>
+
+
+/*
+	A message formatted and framed once, which
+	can then be queued for any number of clients.
+	Each queue holds a reference, and the memory
+	is released when the last one is dropped.
+*/
+typedef struct payload{
+	int refs;
+	int retained;		/* References kept after delivery (see payload_retain) */
+	int len;			/* Length of the whole frame 	*/
+	uint64_t received;	/* metrics_now() when the message it relays
+						   came in, or 0 if its delivery isn't timed */
+	uint64_t seq;		/* Position in its channel, or 0 if it isn't a channel message */
+	char frame[];
+} Payload;
+
+
+/*
+	Formats a message (as in printf) and frames
+	it, truncating it to WHOLE_MSG_LEN bytes.
+
+	The payload starts with a single reference,
+	owned by the caller.
+
+	Exits if the allocation fails.
+*/
+Payload *payload_create(const char *format, ...);
+
+
+/* Takes a new reference to payload and returns it */
+Payload *payload_ref(Payload *payload);
+
+
+/*
+	Drops a reference to payload, freeing it if
+	it was the last one. A timed payload records
+	its delivery latency when its last queue drops
+	it, once: replaying it later doesn't count.
+
+	NOTE: references may be taken and dropped
+		  from different threads.
+*/
+void payload_unref(Payload *payload);
+
+
+/*
+	Takes a reference that outlives the payload's
+	delivery (e.g. a channel's history), so that
+	its delivery latency is recorded as soon as
+	only such references are left. The caller must
+	still hold a reference of its own.
+*/
+Payload *payload_retain(Payload *payload);
+
+
+/* Drops the reference taken with payload_retain */
+void payload_release(Payload *payload);
+
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <irc_utils.h>
+#include <slab.h>
+
+#define ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+
+/* Bookkeeping stored right before each object */
+typedef struct slab_slot{
+	uint32_t generation;
+	int next_free;	/* Next released slot, if this one is released */
+	uint8_t in_use;	/* Boolean */
+} SlabSlot;
+
+#define SLOT_HEADER_LEN ALIGN(sizeof(SlabSlot))
+
+
+Slab *slab_create(size_t object_size, int max_objects){
+	Slab *slab = (Slab *)malloc(sizeof(Slab));
+	if (slab == NULL)
+		exit_error("slab_create: Could not allocate slab");
+
+	if (max_objects > SLAB_MAX_OBJECTS) max_objects = SLAB_MAX_OBJECTS;
+
+	slab->slot_size = SLOT_HEADER_LEN + ALIGN(object_size);
+	slab->max_objects = max_objects;
+	slab->count = 0;
+	slab->n_slots = 0;
+	slab->free_head = -1;
+	slab->n_chunks = 0;
+
+	slab->chunks = (char **)calloc((max_objects + SLAB_CHUNK_LEN - 1)/SLAB_CHUNK_LEN, sizeof(char *));
+	if (slab->chunks == NULL)
+		exit_error("slab_create: Could not allocate chunk table");
+
+	return slab;
+}
+
+
+SlabSlot *get_slot(Slab *slab, int index){
+	char *chunk = slab->chunks[index / SLAB_CHUNK_LEN];
+	return (SlabSlot *)(chunk + (index % SLAB_CHUNK_LEN)*slab->slot_size);
+}
+
+
+void *slab_alloc(Slab *slab, int64_t *handle){
+
+	if (slab->count >= slab->max_objects) return NULL;
+
+	int index;
+
+	if (slab->free_head >= 0){
+		index = slab->free_head;
+		slab->free_head = get_slot(slab, index)->next_free;
+	} else {
+		index = slab->n_slots++;
+
+		if (index / SLAB_CHUNK_LEN >= slab->n_chunks){
+			char *chunk = (char *)calloc(SLAB_CHUNK_LEN, slab->slot_size);
+			if (chunk == NULL)
+				exit_error("slab_alloc: Could not allocate chunk");
+
+			slab->chunks[slab->n_chunks++] = chunk;
+		}
+	}
+
+	SlabSlot *slot = get_slot(slab, index);
+	slot->in_use = 1;
+	slab->count++;
+
+	void *object = (char *)slot + SLOT_HEADER_LEN;
+	memset(object, 0, slab->slot_size - SLOT_HEADER_LEN);
+
+	*handle = ((int64_t)slot->generation << SLAB_INDEX_BITS) | index;
+	return object;
+}
+
+
+void slab_release(Slab *slab, int64_t handle){
+
+	if (slab_get(slab, handle) == NULL) return;
+
+	int index = HANDLE_INDEX(handle);
+	SlabSlot *slot = get_slot(slab, index);
+
+	slot->in_use = 0;
+	slot->generation = (slot->generation + 1) % SLAB_GENERATIONS;
+	slot->next_free = slab->free_head;
+
+	slab->free_head = index;
+	slab->count--;
+}
+
+
+void *slab_get(Slab *slab, int64_t handle){
+
+	if (handle < 0) return NULL;
+
+	int index = HANDLE_INDEX(handle);
+	if (index >= slab->n_slots) return NULL;
+
+	SlabSlot *slot = get_slot(slab, index);
+	if (!slot->in_use || slot->generation != (uint64_t)handle >> SLAB_INDEX_BITS)
+		return NULL;
+
+	return (char *)slot + SLOT_HEADER_LEN;
+}
+
+
+int slab_count(Slab *slab){
+	return slab->count;
+}
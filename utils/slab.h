@@ -0,0 +1,83 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_INDEX_BITS 32				/* The low half of a handle 					*/
+#define SLAB_MAX_OBJECTS (1 << 20)
+#define SLAB_GENERATIONS 0x80000000u	/* Per slot, so that handles stay positive 	*/
+#define SLAB_CHUNK_LEN 64
+
+#define HANDLE_INDEX(handle) ((int)((handle) & 0xFFFFFFFF))
+#define NO_HANDLE -1
+
+
+/*
+	Pool of fixed-size objects, allocated in
+	chunks of SLAB_CHUNK_LEN as it grows. Objects
+	never move, and released ones are recycled
+	through a free list.
+
+	Every object is identified by a 64-bit handle,
+	which holds its index in the low SLAB_INDEX_BITS
+	bits and the slot's generation above them. The
+	generation changes whenever the object is
+	released, so a stale handle never finds the
+	object that later takes its place, and a handle
+	only comes back once its slot has been reused
+	SLAB_GENERATIONS times: in practice, never.
+	Handles are never negative.
+
+	NOTE: slabs are not thread-safe. Memory is never
+		  given back, so reading a stale object is
+		  harmless, but callers must synchronize
+		  allocations and releases.
+*/
+typedef struct slab{
+	size_t slot_size;
+	int max_objects;	/* Runtime limit of live objects */
+	int count;			/* Live objects */
+
+	int n_slots;		/* Slots ever handed out */
+	int free_head;		/* First released slot, or -1 */
+
+	int n_chunks;
+	char **chunks;		/* Sized for max_objects up front */
+} Slab;
+
+
+/*
+	Creates an empty slab of objects of the given
+	size, which will hold at most max_objects
+	(up to SLAB_MAX_OBJECTS) at a time.
+	No object memory is allocated until needed.
+
+	Exits if allocation fails.
+*/
+Slab *slab_create(size_t object_size, int max_objects);
+
+
+/*
+	Returns a new zeroed object and writes its
+	handle to handle, or returns NULL if the slab
+	already holds max_objects objects.
+
+	Exits if allocation fails.
+*/
+void *slab_alloc(Slab *slab, int64_t *handle);
+
+
+/* Gives the object back to the slab. Its handle becomes stale */
+void slab_release(Slab *slab, int64_t handle);
+
+
+/* Returns the object with the given handle, or NULL if the handle is stale */
+void *slab_get(Slab *slab, int64_t handle);
+
+
+/* Returns the number of live objects */
+int slab_count(Slab *slab);
+
+
+#endif
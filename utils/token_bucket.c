@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <token_bucket.h>
+
+
+void token_bucket_init(TokenBucket *bucket, int rate, int burst, uint64_t now){
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = (uint64_t)burst*TOKEN_UNIT;
+	bucket->last = now;
+}
+
+
+int token_bucket_take(TokenBucket *bucket, uint64_t now){
+	if (bucket->rate == 0) return 1;
+
+	uint64_t capacity = (uint64_t)bucket->burst*TOKEN_UNIT;
+
+	/* Long idle spans would only overflow: they fill it up anyway */
+	if (now > bucket->last){
+		uint64_t elapsed = now - bucket->last;
+		bucket->tokens = elapsed >= capacity/bucket->rate ? capacity : bucket->tokens + elapsed*bucket->rate;
+		if (bucket->tokens > capacity) bucket->tokens = capacity;
+		bucket->last = now;
+	}
+
+	if (bucket->tokens < TOKEN_UNIT) return 0;
+
+	bucket->tokens -= TOKEN_UNIT;
+	return 1;
+}
+
+
+/* Reads a count at text, leaving end just past it. Returns 0 if there is none */
+int parse_count(const char *text, char **end, int *count){
+	long value = strtol(text, end, 10);
+	if (*end == text || value < 0 || value > INT_MAX/2) return 0;
+
+	*count = value;
+	return 1;
+}
+
+
+int token_bucket_parse(const char *text, int *rate, int *burst){
+	char *end;
+	if (!parse_count(text, &end, rate)) return 0;
+
+	/* Anything but a burst after the rate is junk, e.g. "10x" */
+	if (*end == '\0') *burst = 2*(*rate);
+	else if (*end != ':' || !parse_count(end + 1, &end, burst) || *end != '\0') return 0;
+
+	return *rate == 0 || *burst > 0;
+}
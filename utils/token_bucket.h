@@ -0,0 +1,47 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <stdint.h>
+
+#define TOKEN_UNIT 1000000		/* Fractions a token is counted in: one per µs at 1 token/s */
+
+
+/*
+	Rate limit that lets through rate events per
+	second on average, and bursts of up to burst
+	of them. Tokens are counted in whole numbers
+	of TOKEN_UNIT fractions, so refills are exact.
+	A rate of 0 lets everything through.
+*/
+typedef struct token_bucket{
+	uint64_t tokens;	/* In TOKEN_UNITs of a token 	*/
+	uint64_t last;		/* When it was last refilled, in µs */
+	uint32_t rate;		/* Tokens added per second 		*/
+	uint32_t burst;		/* Tokens it holds at most 		*/
+} TokenBucket;
+
+
+/* Initializes a full bucket, as of now (in µs) */
+void token_bucket_init(TokenBucket *bucket, int rate, int burst, uint64_t now);
+
+
+/*
+	Takes a token for an event happening now (in µs),
+	after adding those earned since the last one.
+
+	Returns 1 if the event is within the limit, and
+	0 if it isn't (no token is taken then).
+*/
+int token_bucket_take(TokenBucket *bucket, uint64_t now);
+
+
+/*
+	Parses "<rate>[:<burst>]" into rate and burst,
+	which defaults to twice the rate.
+
+	Returns 1 on success and 0 if it is malformed.
+*/
+int token_bucket_parse(const char *text, int *rate, int *burst);
+
+
+#endif
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+#include <irc_utils.h>
+#include <uring.h>
+
+#define REQUIRED_OPS_LEN 4
+
+static const int required_ops[REQUIRED_OPS_LEN] = {
+	IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD
+};
+
+
+/*
+	Creates the ring's file descriptor. SINGLE_ISSUER
+	(6.0) is required, which also guarantees multishot
+	receives. DEFER_TASKRUN (6.1) is used if available.
+*/
+int setup_ring(unsigned entries, struct io_uring_params *params){
+
+	unsigned flags[2] = {
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+		IORING_SETUP_SINGLE_ISSUER
+	};
+
+	int i, fd = -1;
+	for (i = 0; i < 2 && fd < 0; i++){
+		memset(params, 0, sizeof(*params));
+
+		/* Multishot requests post many completions per submission */
+		params->flags = flags[i] | IORING_SETUP_CQSIZE;
+		params->cq_entries = 8*entries;
+
+		fd = syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	return fd;
+}
+
+
+/* Returns whether the kernel supports every operation used here */
+int supports_required_ops(int fd){
+
+	struct {
+		struct io_uring_probe probe;
+		struct io_uring_probe_op ops[256];
+	} probe;
+
+	memset(&probe, 0, sizeof(probe));
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, &probe, 256) < 0)
+		return 0;
+
+	int i;
+	for (i = 0; i < REQUIRED_OPS_LEN; i++){
+		if (required_ops[i] > probe.probe.last_op ||\
+			!(probe.ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+Ring *ring_create(unsigned entries){
+
+	struct io_uring_params params;
+	int fd = setup_ring(entries, &params);
+
+	if (fd < 0){
+		console_log("ring_create: io_uring unavailable");
+		return NULL;
+	}
+
+	if (!(params.features & IORING_FEAT_NODROP) || !supports_required_ops(fd)){
+		console_log("ring_create: io_uring lacks required features");
+		close(fd);
+		return NULL;
+	}
+
+	Ring *ring = (Ring *)calloc(1, sizeof(Ring));
+	if (ring == NULL)
+		exit_error("ring_create: Could not allocate ring");
+
+	ring->fd = fd;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+
+	/* With SINGLE_MMAP (5.4+) both queues share one mapping */
+	if (params.features & IORING_FEAT_SINGLE_MMAP){
+		if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,\
+						 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		exit_error("ring_create: Could not map submission queue");
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP){
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,\
+							 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			exit_error("ring_create: Could not map completion queue");
+	}
+
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,\
+											 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		exit_error("ring_create: Could not map submission entries");
+
+	char *sq = (char *)ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail = *(ring->sq_tail);
+	ring->to_submit = 0;
+
+	char *cq = (char *)ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	ring->buffers = NULL;
+	ring->buffer_memory = NULL;
+
+	return ring;
+}
+
+
+void ring_free(Ring *ring){
+
+	if (ring->buffers != NULL){
+		munmap(ring->buffers, ring->buffer_count*sizeof(struct io_uring_buf));
+		free(ring->buffer_memory);
+	}
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+
+	close(ring->fd);
+	free(ring);
+}
+
+
+int ring_setup_buffers(Ring *ring, int group, int count, int size){
+
+	size_t ring_size = count*sizeof(struct io_uring_buf);
+	void *buffers = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,\
+						 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (buffers == MAP_FAILED) return -1;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)buffers;
+	reg.ring_entries = count;
+	reg.bgid = group;
+
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		munmap(buffers, ring_size);
+		return -1;
+	}
+
+	ring->buffers = (struct io_uring_buf_ring *)buffers;
+	ring->buffer_memory = (char *)malloc((size_t)count*size);
+	if (ring->buffer_memory == NULL)
+		exit_error("ring_setup_buffers: Could not allocate buffers");
+
+	ring->buffer_count = count;
+	ring->buffer_size = size;
+	ring->buffer_group = group;
+
+	/* Every buffer starts out in the kernel's hands */
+	int id;
+	for (id = 0; id < count; id++) ring_recycle_buffer(ring, id);
+
+	return 1;
+}
+
+
+char *ring_buffer(Ring *ring, int id){
+	return ring->buffer_memory + (size_t)id*ring->buffer_size;
+}
+
+
+void ring_recycle_buffer(Ring *ring, int id){
+
+	unsigned short tail = ring->buffers->tail;
+	struct io_uring_buf *buffer = ring->buffers->bufs + (tail & (ring->buffer_count - 1));
+
+	buffer->addr = (uint64_t)(uintptr_t)ring_buffer(ring, id);
+	buffer->len = ring->buffer_size;
+	buffer->bid = id;
+
+	/* Publishes the entry along with the new tail */
+	__atomic_store_n(&(ring->buffers->tail), (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+
+struct io_uring_sqe *ring_get_sqe(Ring *ring){
+
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sqe_tail - head >= ring->sq_entries){
+		ring_submit(ring, 0);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sqe_tail - head >= ring->sq_entries)
+			exit_error("ring_get_sqe: Submission queue stuck");
+	}
+
+	unsigned index = ring->sqe_tail & *(ring->sq_mask);
+	struct io_uring_sqe *sqe = ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+	ring->to_submit++;
+
+	return sqe;
+}
+
+
+int ring_submit(Ring *ring, unsigned wait_nr){
+
+	unsigned submitted = ring->to_submit;
+
+	/* Makes the new entries visible to the kernel */
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	ring->to_submit = 0;
+
+	int status = syscall(__NR_io_uring_enter, ring->fd, submitted, wait_nr,\
+						 IORING_ENTER_GETEVENTS, NULL, 0);
+
+	if (status < 0){
+		/* Whatever wasn't consumed goes with the next call */
+		ring->to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		return -1;
+	}
+
+	return status;
+}
+
+
+struct io_uring_cqe *ring_peek_cqe(Ring *ring){
+
+	unsigned head = *(ring->cq_head);
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+
+	return ring->cqes + (head & *(ring->cq_mask));
+}
+
+
+void ring_cqe_seen(Ring *ring){
+	__atomic_store_n(ring->cq_head, *(ring->cq_head) + 1, __ATOMIC_RELEASE);
+}
+
+
+void ring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data){
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = user_data;
+}
+
+
+void ring_prep_recv(struct io_uring_sqe *sqe, int fd, int group, uint64_t user_data){
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = group;
+	sqe->user_data = user_data;
+}
+
+
+void ring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data){
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = user_data;
+}
+
+
+void ring_prep_poll(struct io_uring_sqe *sqe, int fd, uint64_t user_data){
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = user_data;
+}
@@ -0,0 +1,134 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+
+/*
+	Minimal io_uring instance, driven through the raw
+	system calls: a submission queue, a completion
+	queue and (optionally) a ring of buffers that the
+	kernel picks from for multishot receives.
+
+	A ring must only be used by the thread that
+	created it.
+*/
+typedef struct ring{
+	int fd;
+
+	/* Submission queue, shared with the kernel */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	unsigned sqe_tail;		/* Entries handed out, some not yet submitted */
+	unsigned to_submit;
+
+	/* Completion queue, shared with the kernel */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Provided buffers, if any */
+	struct io_uring_buf_ring *buffers;
+	char *buffer_memory;
+	int buffer_count;		/* Always a power of 2 */
+	int buffer_size;
+	int buffer_group;
+
+	/* Mappings, to undo them */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} Ring;
+
+
+/*
+	Sets up a ring with room for entries submissions.
+
+	Returns NULL if the kernel lacks io_uring or the
+	features used here (multishot requests need 6.0+),
+	so the caller can fall back to something else.
+*/
+Ring *ring_create(unsigned entries);
+
+
+/* Tears the ring down. Pending requests are cancelled by the kernel */
+void ring_free(Ring *ring);
+
+
+/*
+	Registers count buffers of size bytes each as
+	buffer group group, for requests that set
+	IOSQE_BUFFER_SELECT. count must be a power of 2.
+
+	Returns 1 on success and -1 if not supported.
+*/
+int ring_setup_buffers(Ring *ring, int group, int count, int size);
+
+
+/* Returns the memory of the provided buffer with the given id */
+char *ring_buffer(Ring *ring, int id);
+
+
+/* Hands the provided buffer with the given id back to the kernel */
+void ring_recycle_buffer(Ring *ring, int id);
+
+
+/*
+	Returns a zeroed submission entry to fill in, to be
+	submitted by the next ring_submit. If the queue is
+	full, what is in it is submitted first.
+*/
+struct io_uring_sqe *ring_get_sqe(Ring *ring);
+
+
+/*
+	Submits every pending entry, then waits until at
+	least wait_nr completions are available.
+
+	Returns the number of entries submitted, or -1
+	with errno set (EINTR if a signal came first).
+*/
+int ring_submit(Ring *ring, unsigned wait_nr);
+
+
+/* Returns the oldest unseen completion, or NULL if there is none */
+struct io_uring_cqe *ring_peek_cqe(Ring *ring);
+
+
+/* Frees the completion returned by ring_peek_cqe for the kernel to reuse */
+void ring_cqe_seen(Ring *ring);
+
+
+/* Multishot accept: a completion for every connection, res being its fd */
+void ring_prep_accept(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+
+/*
+	Multishot receive into buffers picked from
+	group: a completion for every read, with the
+	buffer id in its flags.
+*/
+void ring_prep_recv(struct io_uring_sqe *sqe, int fd, int group, uint64_t user_data);
+
+
+/*
+	Single gathering send. msg (and its iovecs) must
+	stay untouched until the request completes.
+*/
+void ring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, uint64_t user_data);
+
+
+/* Multishot poll: a completion every time fd becomes readable */
+void ring_prep_poll(struct io_uring_sqe *sqe, int fd, uint64_t user_data);
+
+
+#endif